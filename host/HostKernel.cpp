@@ -0,0 +1,632 @@
+#include "mbed.h"
+
+#include <stdarg.h>
+#include <ucontext.h>
+
+// Host stacks are much larger than the target's: host frames are bigger
+// and printf runs on them
+#define HOST_STACK_SIZE (256 * 1024)
+#define HOST_STACK_FILL 0xE5
+
+namespace host {
+
+struct ThreadControl {
+    ucontext_t context;
+    unsigned char *stack;
+    uint32_t targetStack;
+    mbed::Callback<void()> task;
+    int priority;
+    const char *name;
+    uint32_t flags;
+    rtos::Thread::State state;
+    std::function<bool()> ready;
+    uint64_t deadline;
+    ThreadControl *next;
+};
+
+struct Scheduler {
+    uint64_t now = 0;
+    TimerEvent *timers = nullptr;
+    bool interrupt = false;
+    bool idle = false;
+
+    // Interrupt handlers run here, see runInterrupt()
+    ucontext_t isrContext;
+    ucontext_t isrReturn;
+    unsigned char *isrStack = nullptr;
+    const std::function<void()> *isrHandler = nullptr;
+
+    ThreadControl main;
+    ThreadControl *current;
+    ThreadControl *threads;
+
+    Scheduler() {
+        main.stack = nullptr;
+        main.targetStack = OS_STACK_SIZE;
+        main.priority = osPriorityNormal;
+        main.name = "main";
+        main.flags = 0;
+        main.state = rtos::Thread::Running;
+        main.deadline = NEVER;
+        main.next = nullptr;
+        current = &main;
+        threads = &main;
+    }
+};
+
+// Built on first use, so threads can start from global constructors
+static Scheduler &scheduler() {
+    static Scheduler k;
+    return k;
+}
+
+uint64_t nowNs() {
+    return scheduler().now;
+}
+
+uint64_t deadlineMs(uint32_t ms) {
+    return ms == osWaitForever ? NEVER : scheduler().now + (uint64_t)ms * 1000000;
+}
+
+bool inInterrupt() {
+    return scheduler().interrupt;
+}
+
+void setInterrupt(bool active) {
+    scheduler().interrupt = active;
+}
+
+ThreadControl *currentThread() {
+    return scheduler().current;
+}
+
+/* TIMERS */
+void timerStart(TimerEvent *event, uint64_t delay_ns, uint64_t period_ns) {
+    timerStop(event);
+    event->deadline = scheduler().now + delay_ns;
+    event->period = period_ns;
+    event->armed = true;
+
+    // Sorted by deadline, equal deadlines in arming order
+    TimerEvent **p = &scheduler().timers;
+    while (*p && (*p)->deadline <= event->deadline) p = &(*p)->next;
+    event->next = *p;
+    *p = event;
+}
+
+void timerStop(TimerEvent *event) {
+    if (!event->armed) return;
+    for (TimerEvent **p = &scheduler().timers; *p; p = &(*p)->next) {
+        if (*p == event) {
+            *p = event->next;
+            break;
+        }
+    }
+    event->armed = false;
+}
+
+static void isrEntry() {
+    (*scheduler().isrHandler)();
+}
+
+// On the target, interrupts run on the main stack, not on the thread they
+// interrupt. Do the same here so max_stack() counts the thread alone.
+static void runInterrupt(const std::function<void()> &handler) {
+    Scheduler &k = scheduler();
+    if (k.interrupt) {
+        handler();
+        return;
+    }
+    if (!k.isrStack) k.isrStack = (unsigned char *)malloc(HOST_STACK_SIZE);
+    k.isrHandler = &handler;
+    getcontext(&k.isrContext);
+    k.isrContext.uc_stack.ss_sp = k.isrStack;
+    k.isrContext.uc_stack.ss_size = HOST_STACK_SIZE;
+    k.isrContext.uc_link = &k.isrReturn;
+    makecontext(&k.isrContext, isrEntry, 0);
+
+    k.interrupt = true;
+    swapcontext(&k.isrReturn, &k.isrContext);
+    k.interrupt = false;
+}
+
+// Move the clock to t, firing every timer due on the way at its own time
+static void advanceTo(uint64_t t) {
+    Scheduler &k = scheduler();
+    while (k.timers && k.timers->deadline <= t) {
+        TimerEvent *event = k.timers;
+        k.now = event->deadline;
+        k.timers = event->next;
+        event->armed = false;
+        if (event->period) {
+            // Re-armed from its deadline, so a Ticker never drifts
+            uint64_t deadline = event->deadline + event->period;
+            timerStart(event, deadline - k.now, event->period);
+        }
+
+        std::function<void()> handler = event->handler;
+        runInterrupt(handler);
+    }
+    if (t > k.now) k.now = t;
+}
+
+/* SCHEDULER */
+static bool runnable(ThreadControl *t) {
+    switch (t->state) {
+    case rtos::Thread::Ready:
+    case rtos::Thread::Running:
+        return true;
+    case rtos::Thread::Inactive:
+    case rtos::Thread::Deleted:
+        return false;
+    default:
+        return (t->ready && t->ready()) || t->deadline <= scheduler().now;
+    }
+}
+
+// Highest priority runnable thread above min_priority, round robin among
+// equals starting after the running thread
+static ThreadControl *pick(int min_priority) {
+    Scheduler &k = scheduler();
+    ThreadControl *best = nullptr;
+    ThreadControl *t = k.current;
+    do {
+        t = t->next ? t->next : k.threads;
+        if (t->priority > min_priority && runnable(t) && (!best || t->priority > best->priority)) {
+            best = t;
+        }
+    } while (t != k.current);
+    return best;
+}
+
+static void switchTo(ThreadControl *t) {
+    Scheduler &k = scheduler();
+    ThreadControl *from = k.current;
+    if (t == from) return;
+    k.current = t;
+    t->state = rtos::Thread::Running;
+    t->ready = nullptr;
+    swapcontext(&from->context, &t->context);
+}
+
+// Run someone else until the current thread is picked again
+static void schedule() {
+    Scheduler &k = scheduler();
+    while (true) {
+        ThreadControl *t = pick(-1);
+        if (t) {
+            if (t == k.current) {
+                t->state = rtos::Thread::Running;
+                t->ready = nullptr;
+            } else {
+                switchTo(t);
+            }
+            return;
+        }
+
+        // Everyone waits: jump to the next timer or thread deadline
+        uint64_t next = k.timers ? k.timers->deadline : NEVER;
+        for (ThreadControl *w = k.threads; w; w = w->next) {
+            if (w->state != rtos::Thread::Inactive && w->state != rtos::Thread::Deleted &&
+                w->deadline < next) {
+                next = w->deadline;
+            }
+        }
+        if (next == NEVER) {
+            fprintf(stderr, "host: every thread is blocked and no timer is armed\n");
+            abort();
+        }
+        k.idle = true;
+        advanceTo(next);
+        k.idle = false;
+    }
+}
+
+bool block(std::function<bool()> ready, uint64_t deadline) {
+    Scheduler &k = scheduler();
+    if (k.interrupt) {
+        fprintf(stderr, "host: blocking call in interrupt context\n");
+        abort();
+    }
+    if (ready && ready()) return true;
+
+    ThreadControl *self = k.current;
+    self->state = rtos::Thread::WaitingDelay;
+    self->ready = ready;
+    self->deadline = deadline;
+    schedule();
+    self->deadline = NEVER;
+    return ready && ready();
+}
+
+void preempt() {
+    Scheduler &k = scheduler();
+    if (k.interrupt) return;
+    ThreadControl *t = pick(k.current->priority);
+    if (!t) return;
+    k.current->state = rtos::Thread::Ready;
+    switchTo(t);
+}
+
+void spin(uint64_t ns) {
+    advanceTo(scheduler().now + ns);
+    preempt();
+}
+
+void runFor(uint64_t us) {
+    block(nullptr, scheduler().now + us * 1000);
+}
+
+bool runUntil(std::function<bool()> cond, uint64_t timeout_us) {
+    return block(cond, scheduler().now + timeout_us * 1000);
+}
+
+static void threadEntry() {
+    Scheduler &k = scheduler();
+    ThreadControl *self = k.current;
+    self->task();
+
+    self->state = rtos::Thread::Deleted;
+    schedule();
+}
+
+} // namespace host
+
+using host::ThreadControl;
+
+/* THREAD */
+namespace rtos {
+
+Thread::Thread(osPriority priority, uint32_t stack_size, unsigned char *stack_mem, const char *name) {
+    (void)stack_mem;
+    _tcb = new ThreadControl();
+    _tcb->stack = nullptr;
+    _tcb->targetStack = stack_size;
+    _tcb->priority = priority;
+    _tcb->name = name;
+    _tcb->flags = 0;
+    _tcb->state = Inactive;
+    _tcb->deadline = host::NEVER;
+
+    host::Scheduler &k = host::scheduler();
+    _tcb->next = k.threads;
+    k.threads = _tcb;
+}
+
+Thread::~Thread() {
+    terminate();
+    host::Scheduler &k = host::scheduler();
+    for (ThreadControl **p = &k.threads; *p; p = &(*p)->next) {
+        if (*p == _tcb) {
+            *p = _tcb->next;
+            break;
+        }
+    }
+    ::free(_tcb->stack);
+    delete _tcb;
+}
+
+osStatus Thread::start(mbed::Callback<void()> task) {
+    if (_tcb->state != Inactive) return osError;
+
+    _tcb->task = task;
+    _tcb->stack = (unsigned char *)malloc(HOST_STACK_SIZE);
+    memset(_tcb->stack, HOST_STACK_FILL, HOST_STACK_SIZE);
+    getcontext(&_tcb->context);
+    _tcb->context.uc_stack.ss_sp = _tcb->stack;
+    _tcb->context.uc_stack.ss_size = HOST_STACK_SIZE;
+    _tcb->context.uc_link = nullptr;
+    makecontext(&_tcb->context, host::threadEntry, 0);
+
+    _tcb->state = Ready;
+    host::preempt();
+    return osOK;
+}
+
+osStatus Thread::join() {
+    host::block([this] { return _tcb->state == Deleted || _tcb->state == Inactive; }, host::NEVER);
+    return osOK;
+}
+
+osStatus Thread::terminate() {
+    if (_tcb->state == Inactive || _tcb->state == Deleted) return osOK;
+    _tcb->state = Deleted;
+    if (_tcb == host::currentThread()) host::schedule();
+    return osOK;
+}
+
+osStatus Thread::set_priority(osPriority priority) {
+    _tcb->priority = priority;
+    host::preempt();
+    return osOK;
+}
+
+osPriority Thread::get_priority() const {
+    return (osPriority)_tcb->priority;
+}
+
+uint32_t Thread::flags_set(uint32_t flags) {
+    _tcb->flags |= flags;
+    uint32_t result = _tcb->flags;
+    host::preempt();
+    return result;
+}
+
+Thread::State Thread::get_state() const {
+    return _tcb->state;
+}
+
+uint32_t Thread::stack_size() const {
+    return _tcb->targetStack;
+}
+
+uint32_t Thread::free_stack() const {
+    uint32_t used = used_stack();
+    return used < _tcb->targetStack ? _tcb->targetStack - used : 0;
+}
+
+uint32_t Thread::used_stack() const {
+    return max_stack();
+}
+
+// Deepest the host stack has been, from the untouched fill pattern
+uint32_t Thread::max_stack() const {
+    if (!_tcb->stack) return 0;
+    uint32_t untouched = 0;
+    while (untouched < HOST_STACK_SIZE && _tcb->stack[untouched] == HOST_STACK_FILL) untouched++;
+    return HOST_STACK_SIZE - untouched;
+}
+
+const char *Thread::get_name() const {
+    return _tcb->name;
+}
+
+osThreadId_t Thread::get_id() const {
+    return _tcb->state == Inactive || _tcb->state == Deleted ? nullptr : _tcb;
+}
+
+/* THIS THREAD */
+namespace ThisThread {
+
+uint32_t flags_clear(uint32_t flags) {
+    ThreadControl *self = host::currentThread();
+    uint32_t old = self->flags;
+    self->flags &= ~flags;
+    return old;
+}
+
+uint32_t flags_get() {
+    return host::currentThread()->flags;
+}
+
+static uint32_t flagsWait(uint32_t flags, bool all, uint64_t deadline, bool clear) {
+    ThreadControl *self = host::currentThread();
+    auto ready = [self, flags, all] {
+        return all ? (self->flags & flags) == flags : (self->flags & flags) != 0;
+    };
+    if (!host::block(ready, deadline)) return osFlagsErrorTimeout;
+
+    uint32_t result = self->flags;
+    if (clear) self->flags &= ~flags;
+    return result;
+}
+
+uint32_t flags_wait_all(uint32_t flags, bool clear) {
+    return flagsWait(flags, true, host::NEVER, clear);
+}
+
+uint32_t flags_wait_any(uint32_t flags, bool clear) {
+    return flagsWait(flags, false, host::NEVER, clear);
+}
+
+uint32_t flags_wait_any_for(uint32_t flags, Kernel::Clock::duration_u32 rel_time, bool clear) {
+    return flagsWait(flags, false, host::deadlineMs(rel_time.count()), clear);
+}
+
+void sleep_for(Kernel::Clock::duration_u32 rel_time) {
+    host::block(nullptr, host::deadlineMs(rel_time.count()));
+}
+
+void sleep_until(Kernel::Clock::time_point abs_time) {
+    uint64_t deadline = (uint64_t)abs_time.time_since_epoch().count() * 1000000;
+    if (deadline > host::nowNs()) host::block(nullptr, deadline);
+}
+
+void yield() {
+    ThreadControl *self = host::currentThread();
+    int priority = self->priority;
+    // Let equal priority threads have a turn too
+    self->priority--;
+    host::preempt();
+    self->priority = priority;
+}
+
+// NULL from an interrupt that fired while every thread was waiting,
+// where the target would find its idle thread
+osThreadId_t get_id() {
+    return host::scheduler().idle ? nullptr : host::currentThread();
+}
+
+const char *get_name() {
+    return host::currentThread()->name;
+}
+
+} // namespace ThisThread
+
+/* EVENT FLAGS */
+EventFlags::EventFlags(const char *name) : _flags(0) {
+    (void)name;
+}
+
+uint32_t EventFlags::set(uint32_t flags) {
+    _flags |= flags;
+    uint32_t result = _flags;
+    host::preempt();
+    return result;
+}
+
+uint32_t EventFlags::clear(uint32_t flags) {
+    uint32_t old = _flags;
+    _flags &= ~flags;
+    return old;
+}
+
+uint32_t EventFlags::get() const {
+    return _flags;
+}
+
+uint32_t EventFlags::wait(uint32_t flags, bool all, uint64_t deadline, bool clear) {
+    auto ready = [this, flags, all] {
+        return all ? (_flags & flags) == flags : (_flags & flags) != 0;
+    };
+    if (!host::block(ready, deadline)) return osFlagsErrorTimeout;
+
+    uint32_t result = _flags;
+    if (clear) _flags &= ~flags;
+    return result;
+}
+
+uint32_t EventFlags::wait_all(uint32_t flags, uint32_t millisec, bool clear) {
+    return wait(flags, true, host::deadlineMs(millisec), clear);
+}
+
+uint32_t EventFlags::wait_any(uint32_t flags, uint32_t millisec, bool clear) {
+    return wait(flags, false, host::deadlineMs(millisec), clear);
+}
+
+uint32_t EventFlags::wait_all_for(uint32_t flags, Kernel::Clock::duration_u32 rel_time, bool clear) {
+    return wait(flags, true, host::deadlineMs(rel_time.count()), clear);
+}
+
+uint32_t EventFlags::wait_any_for(uint32_t flags, Kernel::Clock::duration_u32 rel_time, bool clear) {
+    return wait(flags, false, host::deadlineMs(rel_time.count()), clear);
+}
+
+/* SEMAPHORE */
+Semaphore::Semaphore(int32_t count, uint16_t max_count) : _count(count), _max(max_count) {}
+
+void Semaphore::acquire() {
+    host::block([this] { return _count > 0; }, host::NEVER);
+    _count--;
+}
+
+bool Semaphore::try_acquire() {
+    if (_count <= 0) return false;
+    _count--;
+    return true;
+}
+
+bool Semaphore::try_acquire_for(Kernel::Clock::duration_u32 rel_time) {
+    if (!host::block([this] { return _count > 0; }, host::deadlineMs(rel_time.count()))) return false;
+    _count--;
+    return true;
+}
+
+osStatus Semaphore::release() {
+    if (_count >= _max) return osError;
+    _count++;
+    host::preempt();
+    return osOK;
+}
+
+/* MUTEX */
+Mutex::Mutex(const char *name) : _owner(nullptr), _count(0) {
+    (void)name;
+}
+
+void Mutex::lock() {
+    ThreadControl *self = host::currentThread();
+    if (_owner != self) host::block([this] { return _owner == nullptr; }, host::NEVER);
+    _owner = self;
+    _count++;
+}
+
+bool Mutex::trylock() {
+    ThreadControl *self = host::currentThread();
+    if (_owner && _owner != self) return false;
+    _owner = self;
+    _count++;
+    return true;
+}
+
+bool Mutex::trylock_for(Kernel::Clock::duration_u32 rel_time) {
+    ThreadControl *self = host::currentThread();
+    if (_owner != self &&
+        !host::block([this] { return _owner == nullptr; }, host::deadlineMs(rel_time.count()))) {
+        return false;
+    }
+    _owner = self;
+    _count++;
+    return true;
+}
+
+void Mutex::unlock() {
+    if (_count && --_count == 0) {
+        _owner = nullptr;
+        host::preempt();
+    }
+}
+
+} // namespace rtos
+
+/* TIME */
+namespace mbed {
+
+void Timer::start() {
+    if (_running) return;
+    _startNs = host::nowNs();
+    _running = true;
+}
+
+void Timer::stop() {
+    if (!_running) return;
+    _elapsedNs += host::nowNs() - _startNs;
+    _running = false;
+}
+
+void Timer::reset() {
+    _elapsedNs = 0;
+    _startNs = host::nowNs();
+}
+
+std::chrono::microseconds Timer::elapsed_time() const {
+    uint64_t ns = _elapsedNs + (_running ? host::nowNs() - _startNs : 0);
+    return std::chrono::microseconds(ns / 1000);
+}
+
+void Timeout::attach(Callback<void()> func, std::chrono::microseconds t) {
+    _event.handler = func;
+    host::timerStart(&_event, (uint64_t)t.count() * 1000, 0);
+}
+
+void Timeout::detach() {
+    host::timerStop(&_event);
+}
+
+void Ticker::attach(Callback<void()> func, std::chrono::microseconds t) {
+    _event.handler = func;
+    host::timerStart(&_event, (uint64_t)t.count() * 1000, (uint64_t)t.count() * 1000);
+}
+
+} // namespace mbed
+
+/* PLATFORM */
+uint32_t us_ticker_read() {
+    return (uint32_t)(host::nowNs() / 1000);
+}
+
+void wait_us(int us) {
+    if (us > 0) host::spin((uint64_t)us * 1000);
+}
+
+void wait_ns(unsigned int ns) {
+    host::spin(ns);
+}
+
+void error(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    abort();
+}
@@ -0,0 +1,64 @@
+/**
+ ******************************************************************************
+ * @file    HostKernel.h
+ * @brief   Virtual clock and cooperative scheduler behind the host mbed API.
+ ******************************************************************************
+ * @attention
+ *
+ * Included by the host mbed.h. Test and benchmark programs use runFor()
+ * and runUntil() from the main thread to let virtual time pass; the rest
+ * is the plumbing the mbed classes are built on.
+ *
+ ******************************************************************************
+ */
+
+#ifndef HOST_KERNEL_H
+#define HOST_KERNEL_H
+
+#include <stdint.h>
+#include <functional>
+
+namespace host {
+
+const uint64_t NEVER = UINT64_MAX;
+
+struct ThreadControl;
+
+// A Ticker or Timeout while it is armed
+struct TimerEvent {
+    uint64_t deadline = 0;
+    uint64_t period = 0;            // 0 = one shot
+    std::function<void()> handler;
+    bool armed = false;
+    TimerEvent *next = nullptr;
+};
+
+// Virtual time in nanoseconds since start-up
+uint64_t nowNs();
+uint64_t deadlineMs(uint32_t ms);
+
+void timerStart(TimerEvent *event, uint64_t delay_ns, uint64_t period_ns);
+void timerStop(TimerEvent *event);
+// True while timer and pin handlers (interrupts) run
+bool inInterrupt();
+void setInterrupt(bool active);
+
+// Block the running thread until ready() holds or the deadline passes;
+// false on timeout. ready may be empty for a plain delay.
+bool block(std::function<bool()> ready, uint64_t deadline);
+// Let a higher priority thread that has become ready run now
+void preempt();
+// Busy wait: time passes and interrupts fire, but the thread keeps the CPU
+void spin(uint64_t ns);
+
+ThreadControl *currentThread();
+
+// Let the other threads and interrupts run for a while from the calling
+// thread, normally the program's main()
+void runFor(uint64_t us);
+// Same, until cond() holds; false if timeout_us passed first
+bool runUntil(std::function<bool()> cond, uint64_t timeout_us);
+
+} // namespace host
+
+#endif
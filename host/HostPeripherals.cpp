@@ -0,0 +1,375 @@
+#include "mbed.h"
+
+#include <map>
+
+namespace host {
+
+struct Board {
+    bool tracing = true;
+    std::vector<TraceEvent> events;
+    std::map<int, int> levels;
+    std::map<int, float> analog;
+    std::map<int, std::pair<int64_t, int64_t> > pwm;
+    std::multimap<int, mbed::InterruptIn *> interrupts;
+    I2CResponder responder;
+};
+
+static Board &board() {
+    static Board b;
+    return b;
+}
+
+void trace(TraceKind kind, int id, int64_t a, int64_t b, const void *data, size_t len) {
+    if (!board().tracing) return;
+    TraceEvent event;
+    event.ns = nowNs();
+    event.kind = kind;
+    event.id = id;
+    event.a = a;
+    event.b = b;
+    if (data) event.data.assign((const uint8_t *)data, (const uint8_t *)data + len);
+    board().events.push_back(event);
+}
+
+const std::vector<TraceEvent> &traceEvents() {
+    return board().events;
+}
+
+void traceClear() {
+    board().events.clear();
+}
+
+void traceEnable(bool enable) {
+    board().tracing = enable;
+}
+
+const char *pinName(int pin) {
+    static char name[3][8];
+    static int slot = 0;
+    if (pin == NC) return "NC";
+
+    // A few names alive at once, so one printf can show several pins
+    char *out = name[slot];
+    slot = (slot + 1) % 3;
+    snprintf(out, sizeof(name[0]), "P%c_%d", 'A' + ((pin >> 4) & 0xF), pin & 0xF);
+    return out;
+}
+
+void traceWrite(FILE *out) {
+    static const char *kinds[] = {"pin", "pwm", "i2c"};
+    for (const TraceEvent &e : board().events) {
+        fprintf(out, "%llu.%03llu,%s,", (unsigned long long)(e.ns / 1000),
+                (unsigned long long)(e.ns % 1000), kinds[e.kind]);
+        if (e.kind == TRACE_I2C) {
+            fprintf(out, "0x%02X", e.id);
+        } else {
+            fprintf(out, "%s", pinName(e.id));
+        }
+        fprintf(out, ",%lld,%lld,", (long long)e.a, (long long)e.b);
+        for (uint8_t byte : e.data) fprintf(out, "%02X", byte);
+        fprintf(out, "\n");
+    }
+}
+
+int pinLevel(int pin) {
+    auto it = board().levels.find(pin);
+    return it == board().levels.end() ? 0 : it->second;
+}
+
+// Level change from either side; edges reach InterruptIn handlers
+static void drive(int pin, int level) {
+    level = level ? 1 : 0;
+    int old = pinLevel(pin);
+    board().levels[pin] = level;
+    if (level == old) return;
+
+    trace(TRACE_PIN, pin, level, 0);
+    auto range = board().interrupts.equal_range(pin);
+    for (auto it = range.first; it != range.second; ++it) {
+        it->second->edge(level);
+    }
+}
+
+void setPin(int pin, int level) {
+    drive(pin, level);
+    preempt();
+}
+
+void setAnalog(int pin, float value) {
+    board().analog[pin] = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+}
+
+void setI2CResponder(I2CResponder responder) {
+    board().responder = responder;
+}
+
+void attachInterrupt(int pin, mbed::InterruptIn *in) {
+    board().interrupts.insert(std::make_pair(pin, in));
+}
+
+void detachInterrupt(int pin, mbed::InterruptIn *in) {
+    auto range = board().interrupts.equal_range(pin);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == in) {
+            board().interrupts.erase(it);
+            return;
+        }
+    }
+}
+
+// Only settings that change what the pin outputs are recorded
+static void tracePwm(int pin, int64_t period_ns, int64_t pulse_ns) {
+    std::pair<int64_t, int64_t> setting(period_ns, pulse_ns);
+    auto it = board().pwm.find(pin);
+    if (it != board().pwm.end() && it->second == setting) return;
+    board().pwm[pin] = setting;
+    trace(TRACE_PWM, pin, period_ns, pulse_ns);
+}
+
+static int i2cExchange(uint8_t addr, const uint8_t *tx, int tx_len, uint8_t *rx, int rx_len) {
+    trace(TRACE_I2C, addr, tx_len, rx_len, tx, tx_len);
+    if (rx_len) memset(rx, 0, rx_len);
+    if (!board().responder) return 0;
+    return board().responder(addr, tx, tx_len, rx, rx_len);
+}
+
+} // namespace host
+
+namespace mbed {
+
+/* GPIO */
+DigitalOut::DigitalOut(PinName pin) : _pin(pin) {}
+
+DigitalOut::DigitalOut(PinName pin, int value) : _pin(pin) {
+    write(value);
+}
+
+void DigitalOut::write(int value) {
+    if (_pin != NC) host::drive(_pin, value);
+}
+
+int DigitalOut::read() {
+    return _pin == NC ? 0 : host::pinLevel(_pin);
+}
+
+DigitalIn::DigitalIn(PinName pin, PinMode mode) : _pin(pin) {
+    this->mode(mode);
+}
+
+int DigitalIn::read() {
+    return _pin == NC ? 0 : host::pinLevel(_pin);
+}
+
+// Pull-ups set the idle level, until the test side drives the pin
+void DigitalIn::mode(PinMode pull) {
+    if (pull == PullUp && _pin != NC) host::drive(_pin, 1);
+}
+
+InterruptIn::InterruptIn(PinName pin, PinMode mode) : _pin(pin), _enabled(true) {
+    this->mode(mode);
+    if (_pin != NC) host::attachInterrupt(_pin, this);
+}
+
+InterruptIn::~InterruptIn() {
+    if (_pin != NC) host::detachInterrupt(_pin, this);
+}
+
+int InterruptIn::read() {
+    return _pin == NC ? 0 : host::pinLevel(_pin);
+}
+
+void InterruptIn::rise(Callback<void()> func) {
+    _rise = func;
+}
+
+void InterruptIn::fall(Callback<void()> func) {
+    _fall = func;
+}
+
+void InterruptIn::mode(PinMode pull) {
+    if (pull == PullUp && _pin != NC) host::drive(_pin, 1);
+}
+
+void InterruptIn::edge(int value) {
+    Callback<void()> &handler = value ? _rise : _fall;
+    if (!_enabled || !handler) return;
+    bool nested = host::inInterrupt();
+    if (!nested) host::setInterrupt(true);
+    handler();
+    if (!nested) host::setInterrupt(false);
+}
+
+AnalogIn::AnalogIn(PinName pin) : _pin(pin) {}
+
+float AnalogIn::read() {
+    auto it = host::board().analog.find(_pin);
+    return it == host::board().analog.end() ? 0.0f : it->second;
+}
+
+unsigned short AnalogIn::read_u16() {
+    return (unsigned short)(read() * 65535.0f + 0.5f);
+}
+
+/* PWM: the default mbed period is 20 ms */
+PwmOut::PwmOut(PinName pin) : _pin(pin), _periodNs(20000000), _pulseNs(0), _suspended(false) {
+    update();
+}
+
+PwmOut::~PwmOut() {
+    _pulseNs = 0;
+    update();
+}
+
+void PwmOut::write(float value) {
+    if (value < 0.0f) value = 0.0f;
+    if (value > 1.0f) value = 1.0f;
+    _pulseNs = (uint64_t)(value * _periodNs + 0.5f);
+    update();
+}
+
+float PwmOut::read() {
+    return _periodNs ? (float)_pulseNs / _periodNs : 0.0f;
+}
+
+// As on the target, a new period keeps the duty cycle
+void PwmOut::period(float seconds) {
+    float duty = read();
+    _periodNs = (uint64_t)(seconds * 1e9f + 0.5f);
+    _pulseNs = (uint64_t)(duty * _periodNs + 0.5f);
+    update();
+}
+
+void PwmOut::period_ms(int ms) {
+    period(ms / 1000.0f);
+}
+
+void PwmOut::period_us(int us) {
+    float duty = read();
+    _periodNs = (uint64_t)us * 1000;
+    _pulseNs = (uint64_t)(duty * _periodNs + 0.5f);
+    update();
+}
+
+void PwmOut::pulsewidth(float seconds) {
+    _pulseNs = (uint64_t)(seconds * 1e9f + 0.5f);
+    update();
+}
+
+void PwmOut::pulsewidth_ms(int ms) {
+    _pulseNs = (uint64_t)ms * 1000000;
+    update();
+}
+
+void PwmOut::pulsewidth_us(int us) {
+    _pulseNs = (uint64_t)us * 1000;
+    update();
+}
+
+void PwmOut::suspend() {
+    _suspended = true;
+    update();
+}
+
+void PwmOut::resume() {
+    _suspended = false;
+    update();
+}
+
+void PwmOut::update() {
+    if (_pin == NC) return;
+    host::tracePwm(_pin, (int64_t)_periodNs, _suspended ? 0 : (int64_t)_pulseNs);
+}
+
+/* SERIAL */
+UnbufferedSerial::UnbufferedSerial(PinName tx, PinName rx, int baud) {}
+
+ssize_t UnbufferedSerial::write(const void *buffer, size_t length) {
+    return length;
+}
+
+ssize_t UnbufferedSerial::read(void *buffer, size_t length) {
+    size_t n = length < _rx.size() ? length : _rx.size();
+    memcpy(buffer, _rx.data(), n);
+    _rx.erase(0, n);
+    return n;
+}
+
+void UnbufferedSerial::attach(Callback<void()> func, IrqType type) {
+    if (type == RxIrq) _rxIrq = func;
+}
+
+void UnbufferedSerial::receive(const char *data, int length) {
+    _rx.append(data, length);
+    if (!_rxIrq) return;
+    bool nested = host::inInterrupt();
+    if (!nested) host::setInterrupt(true);
+    _rxIrq();
+    if (!nested) host::setInterrupt(false);
+    host::preempt();
+}
+
+/* I2C */
+I2C::I2C(PinName sda, PinName scl) : _sda(sda), _hz(100000), _busy(false), _result(0), _eventMask(0) {
+    (void)scl;
+}
+
+void I2C::frequency(int hz) {
+    _hz = hz;
+}
+
+// Address, data and ACK bits on the wire
+uint64_t I2C::busNs(int tx_length, int rx_length) const {
+    uint64_t bits = (uint64_t)(tx_length + rx_length + 1) * 9;
+    return bits * 1000000000ull / _hz;
+}
+
+int I2C::write(int address, const char *data, int length, bool repeated) {
+    (void)repeated;
+    host::spin(busNs(length, 0));
+    int ack = host::i2cExchange(address >> 1, (const uint8_t *)data, length, nullptr, 0);
+    return ack ? -1 : 0;
+}
+
+int I2C::read(int address, char *data, int length, bool repeated) {
+    (void)repeated;
+    host::spin(busNs(0, length));
+    int ack = host::i2cExchange(address >> 1, nullptr, 0, (uint8_t *)data, length);
+    return ack ? -1 : 0;
+}
+
+// The exchange happens at once; the callback comes when the bus would
+// have finished
+int I2C::transfer(int address, const char *tx_buffer, int tx_length, char *rx_buffer, int rx_length,
+                  const event_callback_t &handler, int event, bool repeated) {
+    (void)repeated;
+    if (_busy) return -1;
+
+    int ack = host::i2cExchange(address >> 1, (const uint8_t *)tx_buffer, tx_length,
+                                (uint8_t *)rx_buffer, rx_length);
+    _result = ack ? I2C_EVENT_ERROR_NO_SLAVE : I2C_EVENT_TRANSFER_COMPLETE;
+    _eventMask = event;
+    _callback = handler;
+    _busy = true;
+    _done.attach(callback(this, &I2C::transferDone),
+                 std::chrono::microseconds(busNs(ack ? 0 : tx_length, ack ? 0 : rx_length) / 1000 + 1));
+    return 0;
+}
+
+void I2C::abort_transfer() {
+    _done.detach();
+    _busy = false;
+}
+
+void I2C::transferDone() {
+    _busy = false;
+    int events = _result & _eventMask;
+    if (events && _callback) _callback(events);
+}
+
+} // namespace mbed
+
+/* GPIO HAL */
+void gpio_init_out_ex(gpio_t *obj, PinName pin, int value) {
+    obj->pin = pin;
+    if (pin != NC) host::drive(pin, value);
+}
@@ -0,0 +1,68 @@
+/**
+ ******************************************************************************
+ * @file    HostTrace.h
+ * @brief   Record of everything the drivers did to the simulated hardware.
+ ******************************************************************************
+ * @attention
+ *
+ * Each entry carries the virtual time it happened at:
+ *
+ *  kind         id           a              b             data
+ *  TRACE_PIN    pin          level          -             -
+ *  TRACE_PWM    pin          period ns      pulse ns      -
+ *  TRACE_I2C    7-bit addr   tx length      rx length     tx bytes
+ *
+ * Inputs are driven from the test side with setPin() (edges reach
+ * InterruptIn handlers as interrupts), setAnalog() and an I2C responder.
+ *
+ ******************************************************************************
+ */
+
+#ifndef HOST_TRACE_H
+#define HOST_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+#include <vector>
+
+namespace host {
+
+enum TraceKind {
+    TRACE_PIN,
+    TRACE_PWM,
+    TRACE_I2C
+};
+
+struct TraceEvent {
+    uint64_t ns;
+    TraceKind kind;
+    int id;
+    int64_t a;
+    int64_t b;
+    std::vector<uint8_t> data;
+};
+
+void trace(TraceKind kind, int id, int64_t a, int64_t b, const void *data = nullptr, size_t len = 0);
+const std::vector<TraceEvent> &traceEvents();
+void traceClear();
+void traceEnable(bool enable);
+
+// "PA_6" style name of a pin
+const char *pinName(int pin);
+// One line per event: time us, kind, id, a, b, data
+void traceWrite(FILE *out);
+
+// Inputs
+int pinLevel(int pin);
+void setPin(int pin, int level);
+void setAnalog(int pin, float value);
+
+// Answers I2C transfers: fill rx, return 0 for ACK or -1 for NACK.
+// Without one every address ACKs and reads return zeros.
+typedef std::function<int(uint8_t addr, const uint8_t *tx, int tx_len, uint8_t *rx, int rx_len)> I2CResponder;
+void setI2CResponder(I2CResponder responder);
+
+} // namespace host
+
+#endif
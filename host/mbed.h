@@ -0,0 +1,616 @@
+/**
+ ******************************************************************************
+ * @file    mbed.h
+ * @brief   Host backend of the mbed API subset the VMShield drivers use.
+ ******************************************************************************
+ * @attention
+ *
+ * The drivers in src/ only reach the hardware through this subset of mbed
+ * (pins, PWM, I2C, timers and the RTOS primitives), so that subset is the
+ * hardware abstraction layer. On the target mbed-os provides it; the host
+ * build puts this directory first on the include path instead.
+ *
+ * Everything runs against a virtual clock in one process:
+ *  - Threads are cooperative contexts scheduled by priority. A thread runs
+ *    until it blocks or wakes a higher priority thread.
+ *  - Time only moves when every thread is blocked (or in wait_us), and
+ *    jumps straight to the next timer or thread deadline. Ticker, Timeout
+ *    and I2C completions fire as interrupts at their exact virtual time.
+ *  - Code takes no virtual time, so a run is deterministic and timing
+ *    results show the design, not the host's load.
+ *
+ * Every pin edge, PWM setting and I2C transaction is recorded with its
+ * virtual time, see HostTrace.h.
+ *
+ ******************************************************************************
+ */
+
+#ifndef HOST_MBED_H
+#define HOST_MBED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <chrono>
+#include <functional>
+#include <new>
+#include <string>
+
+using std::string;
+using namespace std::chrono_literals;
+
+#define MBED_ASSERT(expr) assert(expr)
+#define MBED_UNUSED __attribute__((unused))
+#define MBED_ALIGN(n) alignas(n)
+#define MBED_FORCEINLINE inline
+#define DEVICE_I2C_ASYNCH 1
+
+/* PINS */
+typedef enum {
+    PA_0 = 0x00, PA_1, PA_2, PA_3, PA_4, PA_5, PA_6, PA_7,
+    PA_8, PA_9, PA_10, PA_11, PA_12, PA_13, PA_14, PA_15,
+    PB_0 = 0x10, PB_1, PB_2, PB_3, PB_4, PB_5, PB_6, PB_7,
+    PB_8, PB_9, PB_10, PB_11, PB_12, PB_13, PB_14, PB_15,
+    PC_0 = 0x20, PC_1, PC_2, PC_3, PC_4, PC_5, PC_6, PC_7,
+    PC_8, PC_9, PC_10, PC_11, PC_12, PC_13, PC_14, PC_15,
+    PD_2 = 0x32,
+    NC = (int)0xFFFFFFFF
+} PinName;
+
+typedef enum {
+    PullNone = 0,
+    PullUp = 1,
+    PullDown = 2,
+    PullDefault = PullNone
+} PinMode;
+
+/* RTOS TYPES */
+typedef int32_t osStatus;
+#define osOK 0
+#define osError -1
+#define osErrorTimeout -2
+#define osWaitForever 0xFFFFFFFFu
+#define osFlagsError 0x80000000u
+#define osFlagsErrorTimeout 0xFFFFFFFEu
+
+typedef enum {
+    osPriorityIdle = 1,
+    osPriorityLow = 8,
+    osPriorityBelowNormal = 16,
+    osPriorityNormal = 24,
+    osPriorityAboveNormal = 32,
+    osPriorityHigh = 40,
+    osPriorityRealtime = 48
+} osPriority;
+
+typedef void *osThreadId_t;
+
+#ifndef OS_STACK_SIZE
+#define OS_STACK_SIZE 4096
+#endif
+
+namespace mbed {
+
+/* CALLBACK */
+template <typename F> class Callback;
+
+template <typename R, typename... Args>
+class Callback<R(Args...)> : public std::function<R(Args...)> {
+public:
+    using std::function<R(Args...)>::function;
+    Callback() {}
+    template <typename T>
+    Callback(T *obj, R (T::*method)(Args...))
+        : std::function<R(Args...)>([obj, method](Args... args) { return (obj->*method)(args...); }) {}
+    template <typename T>
+    Callback(const T *obj, R (T::*method)(Args...) const)
+        : std::function<R(Args...)>([obj, method](Args... args) { return (obj->*method)(args...); }) {}
+};
+
+template <typename T, typename R, typename... Args>
+Callback<R(Args...)> callback(T *obj, R (T::*method)(Args...)) {
+    return Callback<R(Args...)>(obj, method);
+}
+template <typename T, typename R, typename... Args>
+Callback<R(Args...)> callback(const T *obj, R (T::*method)(Args...) const) {
+    return Callback<R(Args...)>(obj, method);
+}
+template <typename R, typename... Args>
+Callback<R(Args...)> callback(R (*func)(Args...)) {
+    return Callback<R(Args...)>(func);
+}
+template <typename R, typename... Args>
+Callback<R(Args...)> callback(const Callback<R(Args...)> &func) {
+    return func;
+}
+
+typedef Callback<void(int)> event_callback_t;
+
+} // namespace mbed
+
+using namespace mbed;
+
+#include "HostKernel.h"
+
+namespace rtos {
+
+namespace Kernel {
+struct Clock {
+    typedef std::chrono::milliseconds duration;
+    typedef duration::rep rep;
+    typedef std::milli period;
+    typedef std::chrono::time_point<Clock> time_point;
+    typedef std::chrono::duration<uint32_t, std::milli> duration_u32;
+    static constexpr bool is_steady = true;
+    static time_point now() { return time_point(duration(host::nowNs() / 1000000)); }
+};
+constexpr Clock::duration_u32 wait_for_u32_forever(osWaitForever);
+inline uint64_t get_ms_count() { return host::nowNs() / 1000000; }
+}
+
+class Thread {
+public:
+    enum State {
+        Inactive,
+        Ready,
+        Running,
+        WaitingDelay,
+        WaitingJoin,
+        WaitingThreadFlag,
+        WaitingEventFlag,
+        WaitingMutex,
+        WaitingSemaphore,
+        WaitingMemoryPool,
+        WaitingMessageGet,
+        WaitingMessagePut,
+        Deleted
+    };
+
+    Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = OS_STACK_SIZE,
+           unsigned char *stack_mem = nullptr, const char *name = nullptr);
+    ~Thread();
+
+    osStatus start(mbed::Callback<void()> task);
+    osStatus join();
+    osStatus terminate();
+
+    osStatus set_priority(osPriority priority);
+    osPriority get_priority() const;
+    uint32_t flags_set(uint32_t flags);
+    State get_state() const;
+
+    // Sizes of the stack the target would get; used is measured on the
+    // host stack, so it is only comparable between host runs
+    uint32_t stack_size() const;
+    uint32_t free_stack() const;
+    uint32_t used_stack() const;
+    uint32_t max_stack() const;
+
+    const char *get_name() const;
+    osThreadId_t get_id() const;
+
+private:
+    host::ThreadControl *_tcb;
+};
+
+class EventFlags {
+public:
+    EventFlags(const char *name = nullptr);
+
+    uint32_t set(uint32_t flags);
+    uint32_t clear(uint32_t flags = 0x7fffffff);
+    uint32_t get() const;
+    uint32_t wait_all(uint32_t flags = 0, uint32_t millisec = osWaitForever, bool clear = true);
+    uint32_t wait_any(uint32_t flags = 0, uint32_t millisec = osWaitForever, bool clear = true);
+    uint32_t wait_all_for(uint32_t flags, Kernel::Clock::duration_u32 rel_time, bool clear = true);
+    uint32_t wait_any_for(uint32_t flags, Kernel::Clock::duration_u32 rel_time, bool clear = true);
+
+private:
+    uint32_t wait(uint32_t flags, bool all, uint64_t deadline, bool clear);
+
+    volatile uint32_t _flags;
+};
+
+class Semaphore {
+public:
+    Semaphore(int32_t count = 0, uint16_t max_count = 0xffff);
+
+    void acquire();
+    bool try_acquire();
+    bool try_acquire_for(Kernel::Clock::duration_u32 rel_time);
+    osStatus release();
+
+private:
+    volatile int32_t _count;
+    uint16_t _max;
+};
+
+class Mutex {
+public:
+    Mutex(const char *name = nullptr);
+
+    void lock();
+    bool trylock();
+    bool trylock_for(Kernel::Clock::duration_u32 rel_time);
+    void unlock();
+
+private:
+    host::ThreadControl *_owner;
+    uint32_t _count;
+};
+
+template <typename T, uint32_t pool_sz>
+class MemoryPool {
+public:
+    MemoryPool() : _free(nullptr), _used(0) {
+        for (uint32_t i = 0; i < pool_sz; i++) {
+            _slots[i].next = _free;
+            _free = &_slots[i];
+        }
+    }
+
+    T *try_alloc() {
+        if (!_free) return nullptr;
+        Slot *slot = _free;
+        _free = slot->next;
+        _used++;
+        return reinterpret_cast<T *>(slot->data);
+    }
+    T *try_alloc_for(Kernel::Clock::duration_u32 rel_time) {
+        if (!_free && rel_time.count()) {
+            host::block([this] { return _free != nullptr; }, host::deadlineMs(rel_time.count()));
+        }
+        return try_alloc();
+    }
+    T *try_calloc() {
+        T *item = try_alloc();
+        if (item) memset(item, 0, sizeof(T));
+        return item;
+    }
+    osStatus free(T *item) {
+        Slot *slot = reinterpret_cast<Slot *>(item);
+        if (slot < _slots || slot >= _slots + pool_sz) return osError;
+        slot->next = _free;
+        _free = slot;
+        _used--;
+        host::preempt();
+        return osOK;
+    }
+    bool empty() const { return _used == 0; }
+    bool full() const { return _free == nullptr; }
+
+private:
+    union Slot {
+        Slot *next;
+        alignas(T) unsigned char data[sizeof(T)];
+    };
+
+    Slot _slots[pool_sz];
+    Slot *_free;
+    uint32_t _used;
+};
+
+template <typename T, uint32_t queue_sz>
+class Mail {
+public:
+    Mail() : _head(0), _count(0) {}
+
+    T *try_alloc() { return _pool.try_alloc(); }
+    T *try_alloc_for(Kernel::Clock::duration_u32 rel_time) { return _pool.try_alloc_for(rel_time); }
+    T *try_calloc() { return _pool.try_calloc(); }
+
+    osStatus put(T *mptr) {
+        if (_count == queue_sz) return osError;
+        _queue[(_head + _count) % queue_sz] = mptr;
+        _count++;
+        host::preempt();
+        return osOK;
+    }
+    T *try_get() {
+        if (!_count) return nullptr;
+        T *mptr = _queue[_head];
+        _head = (_head + 1) % queue_sz;
+        _count--;
+        return mptr;
+    }
+    T *try_get_for(Kernel::Clock::duration_u32 rel_time) {
+        if (!_count && rel_time.count()) {
+            uint64_t deadline = rel_time == Kernel::wait_for_u32_forever
+                                ? host::NEVER : host::deadlineMs(rel_time.count());
+            host::block([this] { return _count != 0; }, deadline);
+        }
+        return try_get();
+    }
+    osStatus free(T *mptr) { return _pool.free(mptr); }
+
+    bool empty() const { return _count == 0; }
+    bool full() const { return _count == queue_sz; }
+    uint32_t count() const { return _count; }
+
+private:
+    MemoryPool<T, queue_sz> _pool;
+    T *_queue[queue_sz];
+    uint32_t _head;
+    volatile uint32_t _count;
+};
+
+template <typename T, uint32_t queue_sz>
+class Queue {
+public:
+    Queue() : _head(0), _count(0) {}
+
+    bool try_put(T *data) {
+        if (_count == queue_sz) return false;
+        _queue[(_head + _count) % queue_sz] = data;
+        _count++;
+        host::preempt();
+        return true;
+    }
+    bool try_get(T **data_out) {
+        if (!_count) return false;
+        *data_out = _queue[_head];
+        _head = (_head + 1) % queue_sz;
+        _count--;
+        return true;
+    }
+    bool try_get_for(Kernel::Clock::duration_u32 rel_time, T **data_out) {
+        if (!_count && rel_time.count()) {
+            uint64_t deadline = rel_time == Kernel::wait_for_u32_forever
+                                ? host::NEVER : host::deadlineMs(rel_time.count());
+            host::block([this] { return _count != 0; }, deadline);
+        }
+        return try_get(data_out);
+    }
+
+    bool empty() const { return _count == 0; }
+    bool full() const { return _count == queue_sz; }
+    uint32_t count() const { return _count; }
+
+private:
+    T *_queue[queue_sz];
+    uint32_t _head;
+    volatile uint32_t _count;
+};
+
+namespace ThisThread {
+uint32_t flags_clear(uint32_t flags);
+uint32_t flags_get();
+uint32_t flags_wait_all(uint32_t flags, bool clear = true);
+uint32_t flags_wait_any(uint32_t flags, bool clear = true);
+uint32_t flags_wait_any_for(uint32_t flags, Kernel::Clock::duration_u32 rel_time, bool clear = true);
+void sleep_for(Kernel::Clock::duration_u32 rel_time);
+void sleep_until(Kernel::Clock::time_point abs_time);
+void yield();
+osThreadId_t get_id();
+const char *get_name();
+}
+
+} // namespace rtos
+
+using namespace rtos;
+
+namespace mbed {
+
+/* CRITICAL SECTIONS: threads only switch at kernel calls, so there is
+ * nothing for these to exclude */
+class CriticalSectionLock {
+public:
+    CriticalSectionLock() {}
+    ~CriticalSectionLock() {}
+    static void enable() {}
+    static void disable() {}
+};
+
+/* TIME */
+class Timer {
+public:
+    Timer() : _running(false), _startNs(0), _elapsedNs(0) {}
+
+    void start();
+    void stop();
+    void reset();
+    std::chrono::microseconds elapsed_time() const;
+    int read_us() const { return (int)elapsed_time().count(); }
+
+private:
+    bool _running;
+    uint64_t _startNs;
+    uint64_t _elapsedNs;
+};
+
+class Timeout {
+public:
+    Timeout() {}
+    ~Timeout() { detach(); }
+
+    void attach(Callback<void()> func, std::chrono::microseconds t);
+    void detach();
+
+protected:
+    host::TimerEvent _event;
+};
+
+class Ticker : public Timeout {
+public:
+    void attach(Callback<void()> func, std::chrono::microseconds t);
+};
+
+/* GPIO */
+class DigitalOut {
+public:
+    DigitalOut(PinName pin);
+    DigitalOut(PinName pin, int value);
+
+    void write(int value);
+    int read();
+    int is_connected() const { return _pin != NC; }
+    DigitalOut &operator=(int value) { write(value); return *this; }
+    DigitalOut &operator=(DigitalOut &rhs) { write(rhs.read()); return *this; }
+    operator int() { return read(); }
+
+private:
+    PinName _pin;
+};
+
+class DigitalIn {
+public:
+    DigitalIn(PinName pin, PinMode mode = PullDefault);
+
+    int read();
+    void mode(PinMode pull);
+    int is_connected() const { return _pin != NC; }
+    operator int() { return read(); }
+
+private:
+    PinName _pin;
+};
+
+class InterruptIn {
+public:
+    InterruptIn(PinName pin, PinMode mode = PullDefault);
+    ~InterruptIn();
+
+    int read();
+    void rise(Callback<void()> func);
+    void fall(Callback<void()> func);
+    void mode(PinMode pull);
+    void enable_irq() { _enabled = true; }
+    void disable_irq() { _enabled = false; }
+    operator int() { return read(); }
+
+    // Called by the host when the pin level changes
+    void edge(int value);
+
+private:
+    PinName _pin;
+    Callback<void()> _rise;
+    Callback<void()> _fall;
+    bool _enabled;
+};
+
+class AnalogIn {
+public:
+    AnalogIn(PinName pin);
+
+    float read();
+    unsigned short read_u16();
+    operator float() { return read(); }
+
+private:
+    PinName _pin;
+};
+
+class PwmOut {
+public:
+    PwmOut(PinName pin);
+    ~PwmOut();
+
+    void write(float value);
+    float read();
+    void period(float seconds);
+    void period_ms(int ms);
+    void period_us(int us);
+    void pulsewidth(float seconds);
+    void pulsewidth_ms(int ms);
+    void pulsewidth_us(int us);
+    void suspend();
+    void resume();
+    PwmOut &operator=(float value) { write(value); return *this; }
+    operator float() { return read(); }
+
+private:
+    void update();
+
+    PinName _pin;
+    uint64_t _periodNs;
+    uint64_t _pulseNs;
+    bool _suspended;
+};
+
+/* SERIAL: bytes in come from the host through receive(), bytes out are
+   dropped */
+class SerialBase {
+public:
+    enum IrqType {
+        RxIrq = 0,
+        TxIrq
+    };
+};
+
+class UnbufferedSerial : public SerialBase {
+public:
+    UnbufferedSerial(PinName tx, PinName rx, int baud = 9600);
+
+    ssize_t write(const void *buffer, size_t length);
+    ssize_t read(void *buffer, size_t length);
+    bool readable() const { return !_rx.empty(); }
+    void attach(Callback<void()> func, IrqType type = RxIrq);
+
+    // Called by the host: bytes arrive and the RX interrupt runs
+    void receive(const char *data, int length);
+
+private:
+    std::string _rx;
+    Callback<void()> _rxIrq;
+};
+
+/* I2C */
+#define I2C_EVENT_ERROR (1 << 1)
+#define I2C_EVENT_ERROR_NO_SLAVE (1 << 2)
+#define I2C_EVENT_TRANSFER_COMPLETE (1 << 3)
+#define I2C_EVENT_TRANSFER_EARLY_NACK (1 << 4)
+#define I2C_EVENT_ALL (I2C_EVENT_ERROR | I2C_EVENT_TRANSFER_COMPLETE | I2C_EVENT_ERROR_NO_SLAVE | \
+                       I2C_EVENT_TRANSFER_EARLY_NACK)
+
+class I2C {
+public:
+    I2C(PinName sda, PinName scl);
+
+    void frequency(int hz);
+    // address is the 8-bit form, as on the target
+    int write(int address, const char *data, int length, bool repeated = false);
+    int read(int address, char *data, int length, bool repeated = false);
+    int transfer(int address, const char *tx_buffer, int tx_length, char *rx_buffer, int rx_length,
+                 const event_callback_t &callback, int event = I2C_EVENT_TRANSFER_COMPLETE,
+                 bool repeated = false);
+    void abort_transfer();
+
+private:
+    void transferDone();
+    uint64_t busNs(int tx_length, int rx_length) const;
+
+    PinName _sda;
+    int _hz;
+    bool _busy;
+    int _result;
+    int _eventMask;
+    event_callback_t _callback;
+    Timeout _done;
+};
+
+} // namespace mbed
+
+/* GPIO HAL, for handing a pin back to plain output */
+struct gpio_t {
+    PinName pin;
+};
+void gpio_init_out_ex(gpio_t *obj, PinName pin, int value);
+
+/* PLATFORM */
+uint32_t us_ticker_read();
+void wait_us(int us);
+void wait_ns(unsigned int ns);
+inline void _wait_us_inline(unsigned int us) { wait_us((int)us); }
+inline void thread_sleep_for(uint32_t millisec) { rtos::ThisThread::sleep_for(rtos::Kernel::Clock::duration_u32(millisec)); }
+inline void core_util_critical_section_enter() {}
+inline void core_util_critical_section_exit() {}
+void error(const char *format, ...) __attribute__((noreturn));
+
+#include "HostTrace.h"
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ ******************************************************************************
+ * @file    sim_main.cpp
+ * @brief   Runs Bluetooth commands against the drivers on the host.
+ ******************************************************************************
+ * @attention
+ *
+ * Reads ASCII command lines (the same ones the app sends) from stdin and
+ * writes the trace of everything the drivers did to stdout as CSV:
+ *
+ *     time us, pin|pwm|i2c, pin or address, a, b, tx bytes
+ *
+ * A line "@<ms>" lets that much virtual time pass before the next command
+ * and "#<n>" plays built-in song n; after the last line the simulation runs
+ * until the motors and the song are idle. The timing probe and thread
+ * profiler reports go to stderr.
+ *
+ *     printf '14110\n@500\n3420050\n@1000\n' | ./vmshield_sim > trace.csv
+ *
+ * Pins match main.cpp. The drivers, the parser and the CommandDispatch that
+ * runs each command are the target sources; only the mbed layer underneath
+ * is simulated. Replies (BUSY, statistics) go to stderr, and the profiler's
+ * stack column covers every actuator worker thread.
+ *
+ ******************************************************************************
+ */
+
+#include "mbed.h"
+#include "VMShield.h"
+#include "MotionPlanner.h"
+#include "ServoMotion.h"
+#include "CommandDispatch.h"
+#include "Sequencer.h"
+#include "Songs.h"
+#include "OLED_Display.h"
+#include "CommandProtocol.h"
+#include "TimingProbe.h"
+#include "ThreadProfiler.h"
+
+#define SIM_SETTLE_US 10000000
+
+Stepper MyStepper(PA_6, PA_5, PB_6, PA_7, PB_13, PC_7, PB_10, PA_8);
+DC MyDC(PB_5, PB_4, PC_2, PC_3, PC_12, PC_10);
+BLDC MyBLDC(PB_1, PB_15, PB_14, PB_13, ESC_PWM50);
+MotionPlanner MyPlanner(MyStepper);
+
+I2CBus i2c1(PB_9, PB_8, 100000);
+Servo MyServo(&i2c1, 0x40);
+ServoMotion ServoFrames(MyServo);
+
+I2CBus i2c3(PC_9, PA_8, 400000);
+OLED_Display oled(&i2c3);
+
+Music Voice1(NC, NC);
+Music Voice2(PB_6, PA_7);
+Music Voice3(NC, NC);
+Music Voice4(PB_10, NC);
+Sequencer MySequencer(Voice1, Voice2, Voice3, Voice4);
+
+CommandRing ring;
+CommandParser parser;
+ThreadProfiler profiler;
+
+// The target's command path; replies go to stderr
+CommandDispatch Dispatch(MyPlanner, ServoFrames, MyDC, MyBLDC, MySequencer, parser);
+
+static void reply(const char *data, int len) {
+    fprintf(stderr, "sim: reply %.*s", len, data);
+}
+
+static bool idle() {
+    for (int i = 1; i <= 4; i++) {
+        if (MyStepper.isBusy(i)) return false;
+    }
+    if (!Dispatch.isIdle()) return false;
+    return !MyStepper.isLinearBusy() && ServoFrames.isIdle() && !MySequencer.isPlaying();
+}
+
+int main() {
+    for (int i = 1; i <= 4; i++) {
+        MyStepper.setMotion(i, 1500.0f, 6000.0f);
+    }
+    MyPlanner.configure(1500.0f, 6000.0f, 1.0f);
+    MyServo.begin();
+    MyServo.setPWMFreq(50);
+    oled.begin();
+    Dispatch.onReply(reply);
+
+    profiler.add(ServoFrames.thread());
+    profiler.add(i2c1.thread(), "i2c1_bus");
+    profiler.add(i2c3.thread(), "i2c3_bus");
+    profiler.add(Dispatch.stepperThread());
+    profiler.add(Dispatch.servoThread());
+    profiler.add(Dispatch.dcThread());
+    profiler.add(MySequencer.thread());
+    profiler.start();
+
+    char line[COMMAND_MAX_LINE];
+    while (fgets(line, sizeof(line), stdin)) {
+        if (line[0] == '@') {
+            host::runFor((uint64_t)atoi(line + 1) * 1000);
+            continue;
+        }
+        if (line[0] == '#') {
+            unsigned song = atoi(line + 1);
+            if (song >= SONG_COUNT || !MySequencer.play(SONGS[song].events, SONGS[song].count, SONG_TICK_US)) {
+                fprintf(stderr, "sim: song %u not played\n", song);
+            }
+            continue;
+        }
+
+        for (char *c = line; *c; c++) {
+            ring.push(*c);
+        }
+        Command cmd;
+        while (parser.next(ring, cmd)) {
+            cmd.stamp = us_ticker_read();
+            Dispatch.execute(cmd);
+        }
+    }
+
+    if (!host::runUntil(idle, SIM_SETTLE_US)) fprintf(stderr, "sim: motors still busy\n");
+    i2c1.sync();
+    i2c3.sync();
+
+    char report[TIMING_LINE_MAX];
+    for (int i = 0; i < timingLines(); i++) {
+        timingLine(i, report, sizeof(report));
+        fputs(report, stderr);
+    }
+
+    profiler.update();
+    profiler.summary(report, sizeof(report));
+    fputs(report, stderr);
+    for (int i = 0; i < profiler.threads(); i++) {
+        profiler.line(i, report, sizeof(report));
+        fputs(report, stderr);
+    }
+
+    host::traceWrite(stdout);
+    fprintf(stderr, "sim: %u events, %llu us\n", (unsigned)host::traceEvents().size(),
+            (unsigned long long)(host::nowNs() / 1000));
+    return 0;
+}
@@ -0,0 +1,79 @@
+"""Static RAM report for the VMShield firmware.
+
+Lists what sits in .data and .bss, largest first, with totals for the
+thread stacks and the command/message pools, against the F446's 128 KB.
+Whatever is left over is shared by the heap and the main stack.
+
+PlatformIO runs it after every link (extra_scripts in platformio.ini).
+It also runs on its own:
+
+    python3 scripts/ram_report.py firmware.elf [nm]
+"""
+
+import re
+import subprocess
+import sys
+
+RAM_BYTES = 128 * 1024
+TOP = 25
+
+# Groups by symbol name; a stack or pool inside a driver object (I2CBus,
+# ServoMotion, Sequencer) is counted with that object instead
+GROUPS = [
+    ("thread stacks", re.compile(r"stack")),
+    ("command/message pools", re.compile(r"_pool|Queue|uploadScore|rxRing")),
+    ("display", re.compile(r"oled")),
+]
+
+
+def symbols(elf, nm):
+    out = subprocess.run([nm, "-S", "-C", "--size-sort", elf], check=True,
+                         capture_output=True, text=True).stdout
+    result = []
+    for line in out.splitlines():
+        parts = line.split(None, 3)
+        if len(parts) != 4:
+            continue
+        _, size, kind, name = parts
+        if kind.lower() not in ("b", "d"):
+            continue
+        result.append((int(size, 16), kind.lower(), name))
+    result.sort(reverse=True)
+    return result
+
+
+def report(elf, nm, out=sys.stdout):
+    syms = symbols(elf, nm)
+    data = sum(size for size, kind, _ in syms if kind == "d")
+    bss = sum(size for size, kind, _ in syms if kind == "b")
+    total = data + bss
+
+    out.write("RAM report: %s\n" % elf)
+    out.write("  %-28s %7d\n" % (".data", data))
+    out.write("  %-28s %7d\n" % (".bss", bss))
+    for label, pattern in GROUPS:
+        size = sum(s for s, _, name in syms if pattern.search(name))
+        out.write("    %-26s %7d\n" % (label, size))
+    out.write("  %-28s %7d of %d (%.1f%%)\n" % ("static total", total, RAM_BYTES,
+                                               100.0 * total / RAM_BYTES))
+    out.write("  %-28s %7d\n" % ("heap + main stack", RAM_BYTES - total))
+
+    out.write("  largest:\n")
+    for size, kind, name in syms[:TOP]:
+        out.write("    %7d %s %s\n" % (size, kind, name[:70]))
+
+
+def post_build(source, target, env):
+    elf = str(source[0])
+    nm = env.subst("$CC").replace("gcc", "nm")
+    report(elf, nm)
+
+
+try:
+    Import("env")  # noqa: F821, provided when PlatformIO runs the script
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", post_build)  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        if len(sys.argv) < 2:
+            sys.exit(__doc__)
+        report(sys.argv[1], sys.argv[2] if len(sys.argv) > 2 else "arm-none-eabi-nm")
@@ -0,0 +1,68 @@
+#include "ActuatorQueue.h"
+
+// Only touched by post() and the workers, never during static construction
+MemoryPool<ActuatorQueue::Entry, COMMAND_POOL_SIZE> ActuatorQueue::_pool;
+
+ActuatorQueue::ActuatorQueue(Callback<void(const Command &)> handler, const char *name)
+    : _thread(osPriorityNormal, sizeof(_stack), _stack, name), _handler(handler),
+      _generation(0), _running(0), _busy(0), _dropped(0) {
+
+    _thread.start(callback(this, &ActuatorQueue::worker));
+}
+
+bool ActuatorQueue::post(const Command &cmd) {
+    if (_queue.full()) {
+        _busy++;
+        return false;
+    }
+    Entry *entry = _pool.try_alloc();
+    if (!entry) {
+        _busy++;
+        return false;
+    }
+    entry->cmd = cmd;
+    entry->generation = _generation;
+    // Another poster can take the last slot after the full() check
+    if (!_queue.try_put(entry)) {
+        _pool.free(entry);
+        _busy++;
+        return false;
+    }
+    return true;
+}
+
+// Entries queued before this point carry an old generation. They are
+// drained here so their slots are free at once; one the worker already
+// took is thrown away there instead of being run.
+void ActuatorQueue::cancel() {
+    _generation++;
+
+    Entry *entry;
+    while (_queue.try_get(&entry)) {
+        _pool.free(entry);
+        _dropped++;
+    }
+}
+
+bool ActuatorQueue::replace(const Command &cmd) {
+    cancel();
+    return post(cmd);
+}
+
+void ActuatorQueue::worker() {
+    while (true) {
+        Entry *entry;
+        if (!_queue.try_get_for(Kernel::wait_for_u32_forever, &entry)) continue;
+
+        Command cmd = entry->cmd;
+        uint32_t generation = entry->generation;
+        _pool.free(entry);
+
+        if (generation != _generation) {
+            _dropped++;
+            continue;
+        }
+        _running = generation;
+        _handler(cmd);
+    }
+}
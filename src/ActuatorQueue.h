@@ -0,0 +1,86 @@
+/**
+ ******************************************************************************
+ * @file    ActuatorQueue.h
+ * @brief   Mailbox and worker thread for one actuator.
+ ******************************************************************************
+ * @attention
+ *
+ * The Bluetooth thread only parses and posts; every actuator runs its own
+ * commands on its own thread, so a long stepper move or servo sweep does
+ * not hold up commands for the others.
+ *
+ * post() never blocks: a full mailbox is reported back so the sender can
+ * retry (backpressure). cancel() drops everything still pending and marks
+ * the running command as cancelled; handlers that take a while poll
+ * cancelled() and return early.
+ *
+ * Pending commands live in one pool shared by every queue, so RAM is
+ * sized for the commands in flight rather than every mailbox full at
+ * once. Each queue still holds at most ACTUATOR_QUEUE_DEPTH of them.
+ *
+ ******************************************************************************
+ */
+
+#ifndef ACTUATORQUEUE_H
+#define ACTUATORQUEUE_H
+
+#include "mbed.h"
+#include "CommandProtocol.h"
+
+// Pending commands per actuator
+#ifndef ACTUATOR_QUEUE_DEPTH
+#define ACTUATOR_QUEUE_DEPTH 8
+#endif
+
+// Pending commands across all actuators
+#ifndef COMMAND_POOL_SIZE
+#define COMMAND_POOL_SIZE 12
+#endif
+
+#ifndef ACTUATOR_THREAD_STACK
+#define ACTUATOR_THREAD_STACK 1536
+#endif
+
+class ActuatorQueue {
+public:
+    ActuatorQueue(Callback<void(const Command &)> handler, const char *name);
+
+    // Queue a command, false when the mailbox is full
+    bool post(const Command &cmd);
+    // Drop pending commands and flag the running one
+    void cancel();
+    // cancel() then post(), so cmd is the next thing to run
+    bool replace(const Command &cmd);
+
+    // For the handler: the running command has been cancelled
+    bool cancelled() const { return _running != _generation; }
+
+    uint32_t depth() { return _queue.count(); }
+    uint32_t busy() const { return _busy; }
+    uint32_t dropped() const { return _dropped; }
+
+    const Thread &thread() const { return _thread; }
+
+private:
+    struct Entry {
+        Command cmd;
+        uint32_t generation;
+    };
+
+    void worker();
+
+    static MemoryPool<Entry, COMMAND_POOL_SIZE> _pool;
+
+    Queue<Entry, ACTUATOR_QUEUE_DEPTH> _queue;
+    MBED_ALIGN(8) unsigned char _stack[ACTUATOR_THREAD_STACK];
+    Thread _thread;
+    Callback<void(const Command &)> _handler;
+
+    volatile uint32_t _generation;
+    volatile uint32_t _running;
+
+    uint32_t _busy;
+    uint32_t _dropped;
+};
+
+#endif
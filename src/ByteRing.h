@@ -0,0 +1,59 @@
+/**
+ ******************************************************************************
+ * @file    ByteRing.h
+ * @brief   Lock-free single producer / single consumer byte ring.
+ ******************************************************************************
+ * @attention
+ *
+ * One context pushes (the serial receive path), one context consumes (the
+ * command parser). The indices are free running and only ever written by
+ * their owner, so neither side needs a lock or a critical section.
+ *
+ * The consumer reads bytes in place with peek() and releases them with
+ * drop() once a whole command has been decoded.
+ *
+ ******************************************************************************
+ */
+
+#ifndef BYTERING_H
+#define BYTERING_H
+
+#include <stdint.h>
+#include <atomic>
+
+template <uint32_t Size>
+class ByteRing {
+    static_assert(Size && (Size & (Size - 1)) == 0, "ring size must be a power of two");
+
+public:
+    ByteRing() : _head(0), _tail(0) {}
+
+    // Producer side, false when full
+    bool push(uint8_t byte) {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        if (head - _tail.load(std::memory_order_acquire) == Size) return false;
+        _buf[head & (Size - 1)] = byte;
+        _head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side
+    uint32_t size() const {
+        return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_relaxed);
+    }
+    uint8_t peek(uint32_t offset) const {
+        return _buf[(_tail.load(std::memory_order_relaxed) + offset) & (Size - 1)];
+    }
+    void drop(uint32_t count) {
+        _tail.store(_tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    static uint32_t capacity() { return Size; }
+
+private:
+    uint8_t _buf[Size];
+    std::atomic<uint32_t> _head;
+    std::atomic<uint32_t> _tail;
+};
+
+#endif
@@ -0,0 +1,225 @@
+#include "CommandDispatch.h"
+#include "TimingProbe.h"
+
+static_assert(COMMAND_MAX_DEGREES * 100 == SERVO_MAX_ANGLE, "servo range");
+static_assert(COMMAND_MAX_THROTTLE == ESC_THROTTLE_MAX, "throttle range");
+
+CommandDispatch::CommandDispatch(MotionPlanner &planner, ServoMotion &servos, DC &dc, BLDC &bldc,
+                                 Sequencer &sequencer, const CommandParser &parser)
+    : _planner(planner), _servos(servos), _dc(dc), _bldc(bldc), _sequencer(sequencer), _parser(parser),
+      _stepperQueue(callback(this, &CommandDispatch::stepperCommand), "stepper_cmd"),
+      _servoQueue(callback(this, &CommandDispatch::servoCommand), "servo_cmd"),
+      _dcQueue(callback(this, &CommandDispatch::dcCommand), "dc_cmd"),
+      _active(0), _rxOverflows(0),
+      _latencyLastUs(0), _latencyMaxUs(0), _latencyTotalUs(0), _latencyCount(0) {
+
+    memset(_uploadScore, 0, sizeof(_uploadScore));
+}
+
+// Time from the last received byte to the start of the command
+void CommandDispatch::recordLatency(const Command &cmd) {
+    uint32_t latency = us_ticker_read() - cmd.stamp;
+    CriticalSectionLock lock;
+    _latencyLastUs = latency;
+    if (latency > _latencyMaxUs) _latencyMaxUs = latency;
+    _latencyTotalUs += latency;
+    _latencyCount++;
+}
+
+// Queue a stepper move, waiting while the planner is full
+void CommandDispatch::queueMove(const int delta[4], float speed) {
+    while (!_planner.push(delta[0], delta[1], delta[2], delta[3], speed)) {
+        if (_stepperQueue.cancelled()) return;
+        ThisThread::sleep_for(1ms);
+    }
+}
+
+void CommandDispatch::stepperCommand(const Command &cmd) {
+    _active++;
+    recordLatency(cmd);
+
+    switch (cmd.code)
+    {
+    case CMD_STEPPER: // 14 for Stepper Motor
+        // Queue the move so back-to-back commands blend
+        if (cmd.motor >= 1 && cmd.motor <= 4) {
+            int delta[4] = { 0, 0, 0, 0 };
+            delta[cmd.motor - 1] = cmd.dir == 1 ? cmd.value : -cmd.value;
+            queueMove(delta, 0.0f);
+        }
+        break;
+
+    case CMD_LINEAR: // 15 for coordinated Stepper move
+        {
+        int delta[4];
+        for (int i = 0; i < 4; i++) {
+            delta[i] = cmd.delta[i];
+        }
+        queueMove(delta, cmd.speed);
+        }
+        break;
+    }
+    _active--;
+}
+
+// The chip is set up once by the receiving thread; a command only sets
+// the target and the frame thread ramps to it
+void CommandDispatch::servoCommand(const Command &cmd) {
+    _active++;
+    recordLatency(cmd);
+
+    _servos.moveTo(cmd.motor, cmd.value * 100);
+    _active--;
+}
+
+void CommandDispatch::dcCommand(const Command &cmd) {
+    _active++;
+    recordLatency(cmd);
+
+    switch (cmd.code)
+    {
+    case CMD_DC: // open loop duty cycle
+        _dc.MoveDC(cmd.motor, cmd.dir, cmd.value / 100.0f);
+        break;
+
+    case CMD_DC_SPEED: // closed loop rpm, needs an encoder
+        _dc.setSpeed(cmd.motor, cmd.value);
+        break;
+
+    case CMD_DC_MOVE: // closed loop position in encoder counts
+        _dc.moveTo(cmd.motor, cmd.value);
+        break;
+    }
+    _active--;
+}
+
+ActuatorQueue *CommandDispatch::queueFor(uint8_t code) {
+    switch (code) {
+    case CMD_STEPPER:
+    case CMD_LINEAR:
+        return &_stepperQueue;
+    case CMD_SERVO:
+        return &_servoQueue;
+    case CMD_DC:
+    case CMD_DC_SPEED:
+    case CMD_DC_MOVE:
+        return &_dcQueue;
+    }
+    return NULL;
+}
+
+void CommandDispatch::cancel(uint8_t code) {
+    ActuatorQueue *queue = queueFor(code);
+    if (!queue) return;
+    queue->cancel();
+    if (queue == &_stepperQueue) _planner.clear();
+    if (queue == &_servoQueue) _servos.stopAll();
+}
+
+bool CommandDispatch::isIdle() {
+    return !_active && !_stepperQueue.depth() && !_servoQueue.depth() && !_dcQueue.depth();
+}
+
+void CommandDispatch::reply(const char *data, int len) {
+    if (_reply) _reply(data, len);
+}
+
+// Queue full: tell the sender to retry, in the encoding it used
+void CommandDispatch::sendBusy(const Command &cmd) {
+    if (cmd.binary) {
+        uint8_t payload[2] = { cmd.code, NAK_BUSY };
+        uint8_t frame[sizeof(payload) + COMMAND_FRAME_OVERHEAD];
+        int len = encodeFrame(CMD_NAK, payload, sizeof(payload), frame);
+        reply((const char *)frame, len);
+    } else {
+        char busy[16];
+        int len = snprintf(busy, sizeof(busy), "BUSY %02d\n", cmd.code);
+        reply(busy, len);
+    }
+}
+
+// Only the quick commands run here; actuator commands go to their queue
+void CommandDispatch::execute(const Command &cmd) {
+    switch (cmd.code)
+    {
+    case CMD_CANCEL: // 08 to cancel pending commands: 08<code>
+        cancel(cmd.value);
+        break;
+
+    case CMD_LINK: // 09 for link statistics and command latency
+        {
+        char out[160];
+        int len = snprintf(out, sizeof(out), "RX frames %lu lines %lu crc %lu rej %lu ovf %lu\n"
+                           "LAT last %lu avg %lu max %lu us\n"
+                           "BUSY st %lu sv %lu dc %lu\n",
+                           (unsigned long)_parser.frames(), (unsigned long)_parser.lines(),
+                           (unsigned long)_parser.crcErrors(), (unsigned long)_parser.rejected(),
+                           (unsigned long)_rxOverflows, (unsigned long)_latencyLastUs,
+                           (unsigned long)(_latencyCount ? _latencyTotalUs / _latencyCount : 0),
+                           (unsigned long)_latencyMaxUs, (unsigned long)_stepperQueue.busy(),
+                           (unsigned long)_servoQueue.busy(), (unsigned long)_dcQueue.busy());
+        if (len > (int)sizeof(out) - 1) len = sizeof(out) - 1;
+        reply(out, len);
+        }
+        break;
+
+    case CMD_STATS: // 19 for motion queue and control loop statistics
+        {
+        char out[160];
+        int len = snprintf(out, sizeof(out), "Q %d/%d max %d plan %lu/%lu us\n"
+                           "DC loop %lu/%lu us jitter %lu us n %lu\n"
+                           "SEQ %lu notes late avg %lu max %lu us\n",
+                           _planner.depth(), MOTION_QUEUE_SIZE, _planner.maxDepth(),
+                           (unsigned long)_planner.lastPlanUs(), (unsigned long)_planner.maxPlanUs(),
+                           (unsigned long)_dc.loopTimeUs(), (unsigned long)_dc.maxLoopTimeUs(),
+                           (unsigned long)_dc.maxJitterUs(), (unsigned long)_dc.loopCount(),
+                           (unsigned long)_sequencer.notes(), (unsigned long)_sequencer.avgLateUs(),
+                           (unsigned long)_sequencer.maxLateUs());
+        if (len > (int)sizeof(out) - 1) len = sizeof(out) - 1;
+        reply(out, len);
+        }
+        break;
+
+    case CMD_TIMING: // 29 for step, servo and control loop timing, 291 also clears
+        {
+        char out[TIMING_LINE_MAX];
+        for (int i = 0; i < timingLines(); i++) {
+            int len = timingLine(i, out, sizeof(out));
+            reply(out, len);
+        }
+        if (cmd.value) timingReset();
+        }
+        break;
+
+    case CMD_SCORE: // 50 score upload, binary only
+        if (_sequencer.isPlaying()) {
+            sendBusy(cmd);
+        } else if (cmd.value + cmd.dir / 3 <= SCORE_UPLOAD_EVENTS) {
+            memcpy(&_uploadScore[cmd.value], cmd.data, cmd.dir);
+        }
+        break;
+
+    case CMD_PLAY: // 51 play the uploaded score, 0 events stops
+        if (cmd.value == 0) {
+            _sequencer.stop();
+        } else if (cmd.value > SCORE_UPLOAD_EVENTS ||
+                   !_sequencer.play(_uploadScore, cmd.value, cmd.delta[0] ? cmd.delta[0] : SEQ_DEFAULT_TICK_US)) {
+            sendBusy(cmd);
+        }
+        break;
+
+    case CMD_BLDC: // 44 for BLDC Motor, a single throttle write
+        recordLatency(cmd);
+        _bldc.setThrottle(cmd.motor, cmd.value);
+        break;
+
+    default:
+        {
+        ActuatorQueue *queue = queueFor(cmd.code);
+        if (!queue) break;
+        if (cmd.replace) cancel(cmd.code);
+        if (!queue->post(cmd)) sendBusy(cmd);
+        }
+        break;
+    }
+}
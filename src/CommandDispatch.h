@@ -0,0 +1,94 @@
+/**
+ ******************************************************************************
+ * @file    CommandDispatch.h
+ * @brief   Routes decoded Bluetooth commands to the drivers.
+ ******************************************************************************
+ * @attention
+ *
+ * The receiving thread hands every command the parser decodes to
+ * execute(). Quick ones (statistics, scores, BLDC throttle) run there;
+ * stepper, servo and DC commands go to an ActuatorQueue each, so a long
+ * move on one actuator does not hold up the others. Replies go out through
+ * the onReply() callback, Bluetooth on the target.
+ *
+ * main.cpp and the host simulator both run commands through this class,
+ * so the simulated command path is the one the board runs.
+ *
+ ******************************************************************************
+ */
+
+#ifndef COMMANDDISPATCH_H
+#define COMMANDDISPATCH_H
+
+#include "mbed.h"
+#include "VMShield.h"
+#include "MotionPlanner.h"
+#include "ServoMotion.h"
+#include "Sequencer.h"
+#include "CommandProtocol.h"
+#include "ActuatorQueue.h"
+
+// Scores uploaded over Bluetooth (commands 50 and 51)
+#ifndef SCORE_UPLOAD_EVENTS
+#define SCORE_UPLOAD_EVENTS 256
+#endif
+
+class CommandDispatch {
+public:
+    CommandDispatch(MotionPlanner &planner, ServoMotion &servos, DC &dc, BLDC &bldc,
+                    Sequencer &sequencer, const CommandParser &parser);
+
+    // Where replies and BUSY answers are written
+    void onReply(Callback<void(const char *, int)> reply) { _reply = reply; }
+
+    // Run or queue one decoded command, ASCII or binary
+    void execute(const Command &cmd);
+    // Drop everything still pending for the actuator of a command code
+    void cancel(uint8_t code);
+
+    // RX interrupt: a byte did not fit the ring (reported by command 09)
+    void rxOverflow() { _rxOverflows++; }
+
+    // Nothing queued and no worker running a command
+    bool isIdle();
+
+    const Thread &stepperThread() const { return _stepperQueue.thread(); }
+    const Thread &servoThread() const { return _servoQueue.thread(); }
+    const Thread &dcThread() const { return _dcQueue.thread(); }
+
+private:
+    void stepperCommand(const Command &cmd);
+    void servoCommand(const Command &cmd);
+    void dcCommand(const Command &cmd);
+
+    void queueMove(const int delta[4], float speed);
+    void recordLatency(const Command &cmd);
+    ActuatorQueue *queueFor(uint8_t code);
+    void sendBusy(const Command &cmd);
+    void reply(const char *data, int len);
+
+    MotionPlanner &_planner;
+    ServoMotion &_servos;
+    DC &_dc;
+    BLDC &_bldc;
+    Sequencer &_sequencer;
+    const CommandParser &_parser;
+    Callback<void(const char *, int)> _reply;
+
+    ActuatorQueue _stepperQueue;
+    ActuatorQueue _servoQueue;
+    ActuatorQueue _dcQueue;
+    volatile int _active;       // commands a worker is running
+
+    ScoreEvent _uploadScore[SCORE_UPLOAD_EVENTS];
+
+    volatile uint32_t _rxOverflows;
+
+    // Last received byte to command start, in microseconds
+    uint32_t _latencyLastUs;
+    uint32_t _latencyMaxUs;
+    uint64_t _latencyTotalUs;
+    uint32_t _latencyCount;
+};
+
+#endif
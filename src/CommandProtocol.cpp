@@ -0,0 +1,330 @@
+#include "CommandProtocol.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct CrcTable {
+    uint16_t v[256];
+};
+
+// CRC16-CCITT lookup, one entry per leading byte
+static constexpr CrcTable makeCrcTable() {
+    CrcTable table{};
+    for (int i = 0; i < 256; i++) {
+        uint16_t crc = i << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+        table.v[i] = crc;
+    }
+    return table;
+}
+
+static constexpr CrcTable crc_table = makeCrcTable();
+
+uint16_t commandCrc16(uint16_t crc, uint8_t byte) {
+    return (crc << 8) ^ crc_table.v[(crc >> 8) ^ byte];
+}
+
+int encodeFrame(uint8_t cmd, const uint8_t *payload, int len, uint8_t *out) {
+    if (len < 0 || len > COMMAND_MAX_PAYLOAD) return 0;
+
+    out[0] = COMMAND_SYNC;
+    out[1] = len;
+    out[2] = cmd;
+    memcpy(&out[3], payload, len);
+
+    uint16_t crc = 0xFFFF;
+    for (int i = 1; i < len + 3; i++) {
+        crc = commandCrc16(crc, out[i]);
+    }
+    out[len + 3] = crc & 0xFF;
+    out[len + 4] = crc >> 8;
+    return len + COMMAND_FRAME_OVERHEAD;
+}
+
+// Little-endian field straight out of the ring
+static uint32_t readLE(const CommandRing &ring, uint32_t offset, int bytes) {
+    uint32_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | ring.peek(offset + i);
+    }
+    return value;
+}
+
+// Stepper commands in either encoding: motor 1-4, dir 0 or 1 and a step
+// count that fits the int32 it is stored in
+static bool validStepper(const Command &cmd, int64_t steps) {
+    return cmd.motor >= 1 && cmd.motor <= 4 && cmd.dir <= 1 && steps >= 0 && steps <= INT32_MAX;
+}
+
+// Servo degrees and BLDC throttle, checked here before the dispatch
+// scales them (degrees * 100) or maps them onto the ESC range
+static bool validLevel(const Command &cmd, long value) {
+    long max = cmd.code == CMD_SERVO ? COMMAND_MAX_DEGREES : COMMAND_MAX_THROTTLE;
+    return value >= 0 && value <= max;
+}
+
+// Linear move deltas: int32 whose magnitude is an int32 too, so negating
+// one never overflows (INT32_MIN is refused)
+static bool validDelta(int64_t delta) {
+    return delta >= -INT32_MAX && delta <= INT32_MAX;
+}
+
+CommandParser::CommandParser()
+    : _lineLen(0), _frames(0), _lines(0), _crcErrors(0), _rejected(0) {}
+
+bool CommandParser::next(CommandRing &ring, Command &cmd) {
+    while (ring.size()) {
+        uint8_t byte = ring.peek(0);
+
+        if (byte == COMMAND_SYNC) {
+            // A frame cuts off any partial line in front of it
+            if (_lineLen) {
+                _lineLen = 0;
+                _rejected++;
+            }
+            Result result = decodeFrame(ring, cmd);
+            if (result == FRAME_INCOMPLETE) return false;
+            if (result == FRAME_OK) return true;
+            continue;
+        }
+
+        ring.drop(1);
+        if (byte == '\n' || byte == '\r') {
+            if (_lineLen == 0) continue;
+            _line[_lineLen] = '\0';
+            _lineLen = 0;
+            if (parseLine(cmd)) {
+                _lines++;
+                return true;
+            }
+            _rejected++;
+        } else if (_lineLen < COMMAND_MAX_LINE - 1) {
+            _line[_lineLen++] = byte;
+        }
+    }
+    return false;
+}
+
+CommandParser::Result CommandParser::decodeFrame(CommandRing &ring, Command &cmd) {
+    uint32_t avail = ring.size();
+    if (avail < 2) return FRAME_INCOMPLETE;
+
+    uint8_t len = ring.peek(1);
+    if (len > COMMAND_MAX_PAYLOAD) {
+        ring.drop(1);
+        _rejected++;
+        return FRAME_BAD;
+    }
+
+    uint32_t total = len + COMMAND_FRAME_OVERHEAD;
+    if (avail < total) return FRAME_INCOMPLETE;
+
+    uint16_t crc = 0xFFFF;
+    for (uint32_t i = 1; i < total - 2; i++) {
+        crc = commandCrc16(crc, ring.peek(i));
+    }
+    if (crc != readLE(ring, total - 2, 2)) {
+        // Resync on the next sync byte
+        ring.drop(1);
+        _crcErrors++;
+        return FRAME_BAD;
+    }
+
+    uint8_t code = ring.peek(2);
+    bool ok = decodePayload(ring, code & ~COMMAND_REPLACE, len, cmd);
+    cmd.replace = code & COMMAND_REPLACE;
+    ring.drop(total);
+    if (!ok) {
+        _rejected++;
+        return FRAME_BAD;
+    }
+    _frames++;
+    return FRAME_OK;
+}
+
+bool CommandParser::decodePayload(const CommandRing &ring, uint8_t code, uint8_t len, Command &cmd) {
+    const uint32_t p = 3;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.code = code;
+    cmd.binary = true;
+
+    switch (code) {
+    case CMD_CANCEL:
+        if (len != 1) return false;
+        cmd.value = ring.peek(p);
+        return true;
+
+    case CMD_STEPPER:
+        {
+        if (len != 6) return false;
+        cmd.motor = ring.peek(p);
+        cmd.dir = ring.peek(p + 1);
+        uint32_t steps = readLE(ring, p + 2, 4);
+        if (!validStepper(cmd, steps)) return false;
+        cmd.value = steps;
+        }
+        return true;
+
+    case CMD_LINEAR:
+        if (len != 18) return false;
+        for (int i = 0; i < 4; i++) {
+            int32_t delta = (int32_t)readLE(ring, p + 4 * i, 4);
+            if (!validDelta(delta)) return false;
+            cmd.delta[i] = delta;
+        }
+        cmd.speed = readLE(ring, p + 16, 2);
+        return true;
+
+    case CMD_LINK:
+    case CMD_STATS:
+        return len == 0;
+
+    case CMD_TIMING:
+        if (len > 1) return false;
+        cmd.value = len ? ring.peek(p) : 0;
+        return true;
+
+    case CMD_SERVO:
+    case CMD_BLDC:
+        {
+        if (len != 3) return false;
+        cmd.motor = ring.peek(p);
+        uint32_t level = readLE(ring, p + 1, 2);
+        if (!validLevel(cmd, level)) return false;
+        cmd.value = level;
+        }
+        return true;
+
+    case CMD_DC:
+        if (len != 3) return false;
+        cmd.motor = ring.peek(p);
+        cmd.dir = ring.peek(p + 1);
+        cmd.value = ring.peek(p + 2);
+        return true;
+
+    case CMD_DC_SPEED:
+        if (len != 3) return false;
+        cmd.motor = ring.peek(p);
+        cmd.value = (int16_t)readLE(ring, p + 1, 2);
+        return true;
+
+    case CMD_DC_MOVE:
+        if (len != 5) return false;
+        cmd.motor = ring.peek(p);
+        cmd.value = (int32_t)readLE(ring, p + 1, 4);
+        return true;
+
+    case CMD_SCORE:
+        if (len < 5 || len > 2 + COMMAND_SCORE_BYTES || (len - 2) % 3) return false;
+        cmd.value = readLE(ring, p, 2);
+        cmd.dir = len - 2;
+        for (int i = 0; i < cmd.dir; i++) {
+            cmd.data[i] = ring.peek(p + 2 + i);
+        }
+        return true;
+
+    case CMD_PLAY:
+        if (len != 4) return false;
+        cmd.value = readLE(ring, p, 2);
+        cmd.delta[0] = readLE(ring, p + 2, 2);
+        return true;
+    }
+    return false;
+}
+
+// Fixed-position ASCII as sent by the app
+bool CommandParser::parseLine(Command &cmd) {
+    const char *str = _line;
+    char temp[3];
+    bool replace = str[0] == '!';
+
+    if (replace) str++;
+    if (strlen(str) < 2) return false;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.replace = replace;
+
+    // Extract first two digits
+    temp[0] = str[0];
+    temp[1] = str[1];
+    temp[2] = '\0';
+    cmd.code = atoi(temp);
+
+    switch (cmd.code) {
+    case CMD_CANCEL: // 08<code>
+        cmd.value = atoi(&str[2]);
+        return true;
+
+    case CMD_STEPPER: // 14<motor><dir><steps>
+        {
+        if (strlen(str) < 4) return false;
+        cmd.motor = str[2] - '0';
+        cmd.dir = str[3] - '0';
+        long steps = strtol(&str[4], NULL, 10);
+        if (!validStepper(cmd, steps)) return false;
+        cmd.value = steps;
+        }
+        return true;
+
+    case CMD_LINEAR: // 15<dx1>,<dx2>,<dx3>,<dx4>[,<speed>]
+        {
+        char *p = (char *)&str[2];
+        for (int i = 0; i < 4; i++) {
+            long delta = strtol(p, &p, 10);
+            if (!validDelta(delta)) return false;
+            cmd.delta[i] = delta;
+            if (*p == ',') p++;
+        }
+        cmd.speed = strtof(p, NULL);
+        }
+        return true;
+
+    case CMD_LINK: // 09
+    case CMD_STATS: // 19
+        return true;
+
+    case CMD_TIMING: // 29[<clear>]
+        cmd.value = atoi(&str[2]);
+        return true;
+
+    case CMD_SERVO: // 24<motor 2 digits><degrees>
+        {
+        if (strlen(str) < 4) return false;
+        temp[0] = str[2];
+        temp[1] = str[3];
+        cmd.motor = atoi(temp);
+        long degrees = strtol(&str[4], NULL, 10);
+        if (!validLevel(cmd, degrees)) return false;
+        cmd.value = degrees;
+        }
+        return true;
+
+    case CMD_DC: // 34<motor><dir><duty %>
+        if (strlen(str) < 4) return false;
+        cmd.motor = str[2] - '0';
+        cmd.dir = str[3] - '0';
+        cmd.value = atoi(&str[4]);
+        return true;
+
+    case CMD_DC_SPEED: // 35<motor><rpm>
+    case CMD_DC_MOVE: // 36<motor><counts>
+        if (strlen(str) < 4) return false;
+        cmd.motor = str[2] - '0';
+        cmd.value = atoi(&str[3]);
+        return true;
+
+    case CMD_BLDC: // 44<motor><throttle>
+        {
+        if (strlen(str) < 3) return false;
+        cmd.motor = str[2] - '0';
+        long throttle = strtol(&str[3], NULL, 10);
+        if (!validLevel(cmd, throttle)) return false;
+        cmd.value = throttle;
+        }
+        return true;
+    }
+    return false;
+}
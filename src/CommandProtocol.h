@@ -0,0 +1,150 @@
+/**
+ ******************************************************************************
+ * @file    CommandProtocol.h
+ * @brief   ASCII and binary framed commands for the Bluetooth link.
+ ******************************************************************************
+ * @attention
+ *
+ * Two encodings share one receive ring and decode to the same Command:
+ *
+ * ASCII lines, as sent by the existing app, e.g. "14" motor dir steps:
+ *     14<motor><dir><steps>\n
+ *
+ * Binary frames, all fields little-endian:
+ *     0xA5 | len | cmd | payload[len] | crc16
+ * The CRC16 (CCITT, poly 0x1021, init 0xFFFF) covers len, cmd and the
+ * payload. A frame that fails the check is dropped one byte at a time
+ * until the next sync byte, so a corrupted frame never reaches a motor.
+ * 0xA5 is not printable, so it cannot start an ASCII line.
+ *
+ *  cmd  payload                                       len
+ *  08   code u8 (actuator to cancel)                   1
+ *  09   -                                              0
+ *  14   motor u8, dir u8, steps u32                    6
+ *  15   dx1..dx4 i32, speed u16 (steps/s, 0 = max)    18
+ *  19   -                                              0
+ *  24   motor u8, degrees u16                          3
+ *  29   clear u8 (optional, 1 = clear after the dump)  0-1
+ *  34   motor u8, dir u8, duty u8 (%)                  3
+ *  35   motor u8, rpm i16                              3
+ *  36   motor u8, position i32 (encoder counts)        5
+ *  44   motor u8, throttle u16 (0-1000)                3
+ *  50   offset u16 (events), 1-5 score events       5-17
+ *  51   events u16 (0 = stop), tick us u16             4
+ *
+ * Setting bit 7 of cmd (or starting an ASCII line with '!') replaces
+ * whatever is still pending for that actuator instead of queueing behind
+ * it. A command that finds its actuator queue full is answered with
+ * "BUSY <code>" or a NAK frame: cmd 0x7F, payload code u8, reason u8.
+ *
+ * Commands with a field out of range (a 14 with motor outside 1-4, dir
+ * other than 0/1 or more than INT32_MAX steps) are dropped in either
+ * encoding and counted in rejected(), which command 09 reports.
+ *
+ * Songs are uploaded with 50 and played with 51; both are binary only.
+ * Score events are 3 bytes, see Sequencer.h.
+ *
+ * Binary frames are decoded in place from the ring; only score events
+ * are copied out.
+ *
+ ******************************************************************************
+ */
+
+#ifndef COMMANDPROTOCOL_H
+#define COMMANDPROTOCOL_H
+
+#include <stdint.h>
+#include "ByteRing.h"
+
+#ifndef COMMAND_RING_SIZE
+#define COMMAND_RING_SIZE 256
+#endif
+
+#define COMMAND_SYNC 0xA5
+#define COMMAND_MAX_PAYLOAD 32
+#define COMMAND_MAX_LINE 100
+// sync + len + cmd + crc16
+#define COMMAND_FRAME_OVERHEAD 5
+// cmd bit: replace pending commands for the actuator
+#define COMMAND_REPLACE 0x80
+// Score bytes carried by one CMD_SCORE frame (5 events)
+#define COMMAND_SCORE_BYTES 15
+// Largest CMD_SERVO angle (SERVO_MAX_ANGLE in degrees) and CMD_BLDC
+// throttle (ESC_THROTTLE_MAX)
+#define COMMAND_MAX_DEGREES 180
+#define COMMAND_MAX_THROTTLE 1000
+
+enum CommandCode {
+    CMD_CANCEL = 8,
+    CMD_LINK = 9,
+    CMD_STEPPER = 14,
+    CMD_LINEAR = 15,
+    CMD_STATS = 19,
+    CMD_SERVO = 24,
+    CMD_TIMING = 29,
+    CMD_DC = 34,
+    CMD_DC_SPEED = 35,
+    CMD_DC_MOVE = 36,
+    CMD_BLDC = 44,
+    CMD_SCORE = 50,
+    CMD_PLAY = 51,
+    CMD_NAK = 0x7F      // reply only
+};
+
+enum NakReason {
+    NAK_BUSY = 1
+};
+
+struct Command {
+    uint8_t code;
+    uint8_t motor;
+    uint8_t dir;
+    int32_t value;      // steps, degrees, duty %, rpm, counts, throttle,
+                        // score offset or event count
+    union {
+        int32_t delta[4];   // CMD_LINEAR; delta[0] tick us for CMD_PLAY
+        uint8_t data[COMMAND_SCORE_BYTES];      // CMD_SCORE, length in dir
+    };
+    float speed;        // CMD_LINEAR, 0 = planner maximum
+    bool binary;        // arrived as a frame
+    bool replace;       // drop pending commands for this actuator first
+    uint32_t stamp;     // receive time, set by the caller
+};
+
+typedef ByteRing<COMMAND_RING_SIZE> CommandRing;
+
+uint16_t commandCrc16(uint16_t crc, uint8_t byte);
+
+// Build a frame into out (len + COMMAND_FRAME_OVERHEAD bytes), returns its size
+int encodeFrame(uint8_t cmd, const uint8_t *payload, int len, uint8_t *out);
+
+class CommandParser {
+public:
+    CommandParser();
+
+    // Decode the next complete command from the ring. Returns false when
+    // the ring holds no complete command yet.
+    bool next(CommandRing &ring, Command &cmd);
+
+    uint32_t frames() const { return _frames; }
+    uint32_t lines() const { return _lines; }
+    uint32_t crcErrors() const { return _crcErrors; }
+    uint32_t rejected() const { return _rejected; }
+
+private:
+    enum Result { FRAME_INCOMPLETE, FRAME_BAD, FRAME_OK };
+
+    Result decodeFrame(CommandRing &ring, Command &cmd);
+    bool decodePayload(const CommandRing &ring, uint8_t code, uint8_t len, Command &cmd);
+    bool parseLine(Command &cmd);
+
+    char _line[COMMAND_MAX_LINE];
+    int _lineLen;
+
+    uint32_t _frames;
+    uint32_t _lines;
+    uint32_t _crcErrors;
+    uint32_t _rejected;
+};
+
+#endif
@@ -0,0 +1,301 @@
+#include "EscOutput.h"
+
+#include <new>
+
+#if defined(TARGET_STM)
+#include "pinmap.h"
+#include "PeripheralPins.h"
+#endif
+
+struct EscTiming {
+    uint32_t periodNs;
+    uint32_t minNs;
+    uint32_t maxNs;
+};
+
+// Analog protocols, and the DShot bit period in periodNs
+static const EscTiming ESC_TIMING[] = {
+    { 20000000, 1000000, 2000000 },     // PWM50
+    {  2500000, 1000000, 2000000 },     // PWM400
+    {   500000,  125000,  250000 },     // OneShot125
+    {    50000,    5000,   25000 },     // Multishot
+    {     6667,       0,       0 },     // DShot150
+    {     3333,       0,       0 },     // DShot300
+    {     1667,       0,       0 },     // DShot600
+};
+
+uint16_t dshotFrame(uint16_t value, bool telemetry) {
+    uint16_t v = ((value & 0x7FF) << 1) | (telemetry ? 1 : 0);
+    uint16_t crc = (v ^ (v >> 4) ^ (v >> 8)) & 0xF;
+    return (v << 4) | crc;
+}
+
+uint16_t dshotValue(uint16_t throttle) {
+    if (throttle == 0) return 0;
+    if (throttle > ESC_THROTTLE_MAX) throttle = ESC_THROTTLE_MAX;
+    return DSHOT_THROTTLE_MIN +
+           (uint32_t)throttle * (DSHOT_THROTTLE_MAX - DSHOT_THROTTLE_MIN) / ESC_THROTTLE_MAX;
+}
+
+void dshotBits(uint16_t frame, uint32_t one, uint32_t zero, uint32_t out[DSHOT_BUFFER_LEN]) {
+    for (int i = 0; i < DSHOT_FRAME_BITS; i++) {
+        out[i] = frame & (0x8000 >> i) ? one : zero;
+    }
+    for (int i = DSHOT_FRAME_BITS; i < DSHOT_BUFFER_LEN; i++) {
+        out[i] = 0;
+    }
+}
+
+#if defined(TARGET_STM32F4)
+// Timer channel and the DMA stream its update request is routed to
+struct DShotPort {
+    PinName pin;
+    TIM_TypeDef *tim;
+    uint8_t channel;
+    bool complementary;         // CHxN output of an advanced timer
+    uint8_t af;
+    DMA_TypeDef *dma;
+    DMA_Stream_TypeDef *stream;
+    uint8_t dmaChannel;
+    uint8_t flagShift;          // stream flags position in LISR/HISR
+    bool highFlags;             // streams 4-7 use HISR/HIFCR
+};
+
+// One update DMA request per timer, so one DShot output per timer
+static const DShotPort DSHOT_PORTS[] = {
+    // TIM1_UP on DMA2 stream 5 channel 6; the BLDC 2-4 pins
+    { PB_13, TIM1, 1, true, GPIO_AF1_TIM1, DMA2, DMA2_Stream5, 6, 6, true },
+    { PB_14, TIM1, 2, true, GPIO_AF1_TIM1, DMA2, DMA2_Stream5, 6, 6, true },
+    { PB_15, TIM1, 3, true, GPIO_AF1_TIM1, DMA2, DMA2_Stream5, 6, 6, true },
+    // TIM3_UP on DMA1 stream 2 channel 5; TIM3 is the DC EN timer on
+    // this board, so BLDC refuses it there
+    { PB_1, TIM3, 4, false, GPIO_AF2_TIM3, DMA1, DMA1_Stream2, 5, 16, false },
+};
+#else
+struct DShotPort {
+    PinName pin;
+};
+#endif
+
+EscOutput::EscOutput(PinName pin, EscProtocol protocol)
+    : _protocol(protocol), _pwm(NULL), _ccr(NULL), _cr1(NULL), _ticksPerNs(0.0f), _port(NULL),
+      _bitOne(0), _bitZero(0), _frame(0) {
+
+    if (_protocol >= ESC_DSHOT150 && !setupDShot(pin)) {
+        _protocol = ESC_ONESHOT125;
+    }
+    if (_protocol < ESC_DSHOT150) {
+        setupAnalog(pin);
+    }
+    write(0);
+}
+
+uint32_t EscOutput::framePeriodUs() const {
+    if (_protocol >= ESC_DSHOT150) {
+        return (ESC_TIMING[_protocol].periodNs * DSHOT_BUFFER_LEN + 999) / 1000;
+    }
+    return ESC_TIMING[_protocol].periodNs / 1000;
+}
+
+void EscOutput::write(uint16_t throttle) {
+    if (throttle > ESC_THROTTLE_MAX) throttle = ESC_THROTTLE_MAX;
+
+    if (_protocol >= ESC_DSHOT150) {
+        _frame = dshotFrame(dshotValue(throttle));
+        sendDShot();
+        return;
+    }
+
+    uint32_t ns = _minNs + (uint32_t)throttle * (_maxNs - _minNs) / ESC_THROTTLE_MAX;
+    if (_ccr) {
+        *_ccr = (uint32_t)(ns * _ticksPerNs + 0.5f);
+    } else {
+        _pwm->pulsewidth_us(ns / 1000);
+    }
+}
+
+void EscOutput::hold() {
+#if defined(TARGET_STM)
+    if (_cr1) *_cr1 |= TIM_CR1_UDIS;
+#endif
+}
+
+void EscOutput::release() {
+#if defined(TARGET_STM)
+    if (_cr1) *_cr1 &= ~TIM_CR1_UDIS;
+#endif
+}
+
+static const DShotPort *dshotPort(PinName pin) {
+#if defined(TARGET_STM32F4)
+    for (unsigned i = 0; i < sizeof(DSHOT_PORTS) / sizeof(DSHOT_PORTS[0]); i++) {
+        if (DSHOT_PORTS[i].pin == pin) return &DSHOT_PORTS[i];
+    }
+#else
+    (void)pin;
+#endif
+    return NULL;
+}
+
+bool EscOutput::dshotRoute(PinName pin) {
+    return dshotPort(pin) != NULL;
+}
+
+bool EscOutput::timerChannel(PinName pin, EscProtocol protocol, uint32_t &timer, int &channel) {
+#if defined(TARGET_STM32F4)
+    const DShotPort *port = protocol >= ESC_DSHOT150 ? dshotPort(pin) : NULL;
+    if (port) {
+        timer = (uint32_t)port->tim;
+        channel = port->channel;
+        return true;
+    }
+#endif
+#if defined(TARGET_STM)
+    uint32_t tim = pinmap_find_peripheral(pin, PinMap_PWM);
+    if (tim == (uint32_t)NC) return false;
+    timer = tim;
+    channel = STM_PIN_CHANNEL(pinmap_find_function(pin, PinMap_PWM));
+    return true;
+#else
+    (void)pin;
+    (void)protocol;
+    (void)timer;
+    (void)channel;
+    return false;
+#endif
+}
+
+void EscOutput::command(uint8_t cmd) {
+    if (_protocol < ESC_DSHOT150 || cmd == 0 || cmd >= DSHOT_THROTTLE_MIN) return;
+    _frame = dshotFrame(cmd, true);
+    sendDShot();
+}
+
+// Let PwmOut route the pin and start the channel, then take over the
+// timer: full clock resolution and a preloaded compare register
+void EscOutput::setupAnalog(PinName pin) {
+    const EscTiming &t = ESC_TIMING[_protocol];
+    _minNs = t.minNs;
+    _maxNs = t.maxNs;
+
+    _pwm = new (_pwmStorage) PwmOut(pin);
+    _pwm->period_us(t.periodNs / 1000);
+    _pwm->pulsewidth_us(t.minNs / 1000);
+
+#if defined(TARGET_STM)
+    uint32_t function = pinmap_function(pin, PinMap_PWM);
+    TIM_TypeDef *tim = (TIM_TypeDef *)pinmap_peripheral(pin, PinMap_PWM);
+    int channel = STM_PIN_CHANNEL(function);
+    if (!tim || channel < 1 || channel > 4) return;
+
+    // The prescaler mbed picked gives the timer input clock per tick
+    uint32_t clock = (uint32_t)((uint64_t)(tim->ARR + 1) * (tim->PSC + 1) * 1000000000ull / t.periodNs);
+    uint32_t psc = (uint32_t)((uint64_t)clock * t.periodNs / 1000000000ull / 65536);
+    uint32_t ticks = (uint32_t)((uint64_t)clock * t.periodNs / 1000000000ull / (psc + 1));
+
+    switch (channel) {
+        case 1: tim->CCMR1 |= TIM_CCMR1_OC1PE; _ccr = &tim->CCR1; break;
+        case 2: tim->CCMR1 |= TIM_CCMR1_OC2PE; _ccr = &tim->CCR2; break;
+        case 3: tim->CCMR2 |= TIM_CCMR2_OC3PE; _ccr = &tim->CCR3; break;
+        case 4: tim->CCMR2 |= TIM_CCMR2_OC4PE; _ccr = &tim->CCR4; break;
+    }
+    tim->CR1 |= TIM_CR1_ARPE;
+    _cr1 = &tim->CR1;
+    tim->PSC = psc;
+    tim->ARR = ticks - 1;
+    tim->EGR = TIM_EGR_UG;
+    _ticksPerNs = (float)ticks / t.periodNs;
+#else
+    (void)pin;
+#endif
+}
+
+// No PwmOut here: the pin goes straight to the route's timer channel,
+// and the timer is only set up for the DShot bit period
+bool EscOutput::setupDShot(PinName pin) {
+#if defined(TARGET_STM32F4)
+    _port = dshotPort(pin);
+    if (!_port) return false;
+
+    TIM_TypeDef *tim = _port->tim;
+    DMA_Stream_TypeDef *stream = _port->stream;
+
+    pin_function(pin, STM_PIN_DATA(STM_MODE_AF_PP, GPIO_PULLDOWN, _port->af));
+
+    uint32_t clock;
+    if (tim == TIM1) {
+        // APB2 timers run at twice PCLK2 when the bus is divided
+        __HAL_RCC_TIM1_CLK_ENABLE();
+        clock = HAL_RCC_GetPCLK2Freq();
+        if ((RCC->CFGR & RCC_CFGR_PPRE2) != RCC_CFGR_PPRE2_DIV1) clock *= 2;
+    } else {
+        __HAL_RCC_TIM3_CLK_ENABLE();
+        clock = HAL_RCC_GetPCLK1Freq();
+        if ((RCC->CFGR & RCC_CFGR_PPRE1) != RCC_CFGR_PPRE1_DIV1) clock *= 2;
+    }
+    if (_port->dma == DMA2) {
+        __HAL_RCC_DMA2_CLK_ENABLE();
+    } else {
+        __HAL_RCC_DMA1_CLK_ENABLE();
+    }
+
+    uint32_t ticks = (uint32_t)((uint64_t)clock * ESC_TIMING[_protocol].periodNs / 1000000000ull);
+    _bitOne = ticks * 3 / 4;
+    _bitZero = ticks * 3 / 8;
+
+    tim->CR1 = 0;
+    tim->PSC = 0;
+    tim->ARR = ticks - 1;
+    volatile uint32_t *ccr;
+    switch (_port->channel) {
+        case 1: tim->CCMR1 = (tim->CCMR1 & ~0xFFu) | TIM_CCMR1_OC1M_1 | TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1PE; ccr = &tim->CCR1; break;
+        case 2: tim->CCMR1 = (tim->CCMR1 & ~0xFF00u) | TIM_CCMR1_OC2M_1 | TIM_CCMR1_OC2M_2 | TIM_CCMR1_OC2PE; ccr = &tim->CCR2; break;
+        case 3: tim->CCMR2 = (tim->CCMR2 & ~0xFFu) | TIM_CCMR2_OC3M_1 | TIM_CCMR2_OC3M_2 | TIM_CCMR2_OC3PE; ccr = &tim->CCR3; break;
+        default: tim->CCMR2 = (tim->CCMR2 & ~0xFF00u) | TIM_CCMR2_OC4M_1 | TIM_CCMR2_OC4M_2 | TIM_CCMR2_OC4PE; ccr = &tim->CCR4; break;
+    }
+    *ccr = 0;
+    if (_port->complementary) {
+        // CHxN alone follows OCxREF; advanced timers also need the main
+        // output enable
+        tim->CCER |= TIM_CCER_CC1NE << (4 * (_port->channel - 1));
+        tim->BDTR |= TIM_BDTR_MOE;
+    } else {
+        tim->CCER |= TIM_CCER_CC1E << (4 * (_port->channel - 1));
+    }
+    // Each update event asks the DMA for the next bit's compare value
+    tim->DIER |= TIM_DIER_UDE;
+    tim->EGR = TIM_EGR_UG;
+    tim->CR1 = TIM_CR1_ARPE | TIM_CR1_CEN;
+
+    stream->CR = 0;
+    while (stream->CR & DMA_SxCR_EN) {}
+    stream->PAR = (uint32_t)ccr;
+    stream->M0AR = (uint32_t)_bits;
+    stream->CR = ((uint32_t)_port->dmaChannel << DMA_SxCR_CHSEL_Pos) | DMA_SxCR_PL_1 |
+                 DMA_SxCR_MSIZE_1 | DMA_SxCR_PSIZE_1 | DMA_SxCR_MINC | DMA_SxCR_DIR_0;
+
+    _refresh.attach(callback(this, &EscOutput::sendDShot), std::chrono::microseconds(1000000 / DSHOT_REFRESH_HZ));
+    return true;
+#else
+    (void)pin;
+    return false;
+#endif
+}
+
+// Start one frame unless the previous one is still going out. Called from
+// write() and from the refresh ticker, so it must be interrupt safe.
+void EscOutput::sendDShot() {
+#if defined(TARGET_STM32F4)
+    CriticalSectionLock lock;
+    DMA_Stream_TypeDef *stream = _port->stream;
+    if (stream->CR & DMA_SxCR_EN) return;
+
+    dshotBits(_frame, _bitOne, _bitZero, _bits);
+
+    // Clear the stream's flags before re-enabling it
+    volatile uint32_t *ifcr = _port->highFlags ? &_port->dma->HIFCR : &_port->dma->LIFCR;
+    *ifcr = 0x3Du << _port->flagShift;
+    stream->NDTR = DSHOT_BUFFER_LEN;
+    stream->CR |= DMA_SxCR_EN;
+#endif
+}
@@ -0,0 +1,124 @@
+/**
+ ******************************************************************************
+ * @file    EscOutput.h
+ * @brief   Throttle output to one brushless ESC.
+ ******************************************************************************
+ * @attention
+ *
+ * Supported protocols, fastest last:
+ *
+ *  protocol      signal                          frame
+ *  PWM50         1000-2000 us pulse              20 ms
+ *  PWM400        1000-2000 us pulse              2.5 ms
+ *  OneShot125    125-250 us pulse                500 us
+ *  Multishot     5-25 us pulse                   50 us
+ *  DShot150/300/600  16-bit digital frame        107 / 53 / 27 us
+ *
+ * The analog protocols drive the pin's timer channel directly with a
+ * preloaded compare register, so a new throttle is picked up at the next
+ * period boundary without disturbing the running pulse.
+ *
+ * DShot frames are 11 bits of throttle, a telemetry request bit and a
+ * 4-bit CRC. Every bit is one timer period whose high time encodes the
+ * value, and DMA copies the 16 compare values into the timer, so the CPU
+ * only builds the buffer. The frame is resent at DSHOT_REFRESH_HZ so the
+ * ESC does not disarm. DShot needs a timer channel with a DMA route (see
+ * EscOutput.cpp); on other pins or targets it falls back to OneShot125.
+ * The route's timer runs at the DShot bit period and its update request
+ * belongs to that output, so a timer carries one DShot output and nothing
+ * else.
+ *
+ ******************************************************************************
+ */
+
+#ifndef ESCOUTPUT_H
+#define ESCOUTPUT_H
+
+#include "mbed.h"
+
+enum EscProtocol {
+    ESC_PWM50,
+    ESC_PWM400,
+    ESC_ONESHOT125,
+    ESC_MULTISHOT,
+    ESC_DSHOT150,
+    ESC_DSHOT300,
+    ESC_DSHOT600
+};
+
+#define ESC_THROTTLE_MAX 1000
+
+// 16 frame bits plus low periods that end the frame
+#define DSHOT_FRAME_BITS 16
+#define DSHOT_BUFFER_LEN (DSHOT_FRAME_BITS + 2)
+// Lowest throttle value; 1-47 are commands, 0 is disarmed
+#define DSHOT_THROTTLE_MIN 48
+#define DSHOT_THROTTLE_MAX 2047
+
+#ifndef DSHOT_REFRESH_HZ
+#define DSHOT_REFRESH_HZ 1000
+#endif
+
+// 16-bit DShot frame: value (0-2047) << 1 | telemetry, then the CRC
+// (v ^ v >> 4 ^ v >> 8) & 0xF in the low nibble
+uint16_t dshotFrame(uint16_t value, bool telemetry = false);
+// DShot value of a throttle 0 - ESC_THROTTLE_MAX: 0 (disarmed) or
+// DSHOT_THROTTLE_MIN - DSHOT_THROTTLE_MAX
+uint16_t dshotValue(uint16_t throttle);
+// Timer compare value per bit, MSB first, followed by zeros
+void dshotBits(uint16_t frame, uint32_t one, uint32_t zero, uint32_t out[DSHOT_BUFFER_LEN]);
+
+struct DShotPort;
+
+class EscOutput {
+public:
+    EscOutput(PinName pin, EscProtocol protocol = ESC_PWM50);
+
+    // 0 - ESC_THROTTLE_MAX; 0 is the minimum pulse / DShot disarm value
+    void write(uint16_t throttle);
+    // DShot command 1-47 (beep, direction, save...), ignored for analog
+    void command(uint8_t cmd);
+
+    // Between hold() and release() new throttles of the analog protocols
+    // wait in the preload registers, so every channel of the timer
+    // switches in the same period
+    void hold();
+    void release();
+
+    EscProtocol protocol() const { return _protocol; }
+    // Time between the ESC seeing two throttle values
+    uint32_t framePeriodUs() const;
+
+    // Timer and channel an output on pin would use, for conflict checks.
+    // False if the pin has no timer channel.
+    static bool timerChannel(PinName pin, EscProtocol protocol, uint32_t &timer, int &channel);
+    // The pin can run DShot, rather than falling back to OneShot125
+    static bool dshotRoute(PinName pin);
+
+private:
+    void setupAnalog(PinName pin);
+    bool setupDShot(PinName pin);
+    void sendDShot();
+
+    EscProtocol _protocol;
+    // Analog protocols only; DShot drives the timer itself
+    PwmOut *_pwm;
+    alignas(PwmOut) uint8_t _pwmStorage[sizeof(PwmOut)];
+
+    // Analog: compare register of the channel and its scale
+    volatile uint32_t *_ccr;
+    volatile uint32_t *_cr1;
+    float _ticksPerNs;
+    uint32_t _minNs;
+    uint32_t _maxNs;
+
+    // DShot
+    const DShotPort *_port;
+    Ticker _refresh;
+    uint32_t _bitOne;
+    uint32_t _bitZero;
+    volatile uint16_t _frame;
+    uint32_t _bits[DSHOT_BUFFER_LEN];
+};
+
+#endif
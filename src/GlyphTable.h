@@ -0,0 +1,55 @@
+/**
+ ******************************************************************************
+ * @file    GlyphTable.h
+ * @brief   Compile-time page-major glyph tables for the SSD1306 fonts.
+ ******************************************************************************
+ * @attention
+ *
+ * The font arrays in glcdfont.h are stored glyph by glyph as one width
+ * byte followed by the columns, each column holding one byte per page.
+ * The display takes data one page at a time, so the tables are
+ * transposed at compile time: every page of a glyph becomes one
+ * contiguous run of column bytes that can be copied straight into the
+ * framebuffer row.
+ *
+ ******************************************************************************
+ */
+
+#ifndef GLYPHTABLE_H
+#define GLYPHTABLE_H
+
+#include <stdint.h>
+
+template <int Count, int Columns, int Pages>
+struct GlyphTable {
+    static const int COUNT = Count;
+    static const int COLUMNS = Columns;
+    static const int PAGES = Pages;
+
+    uint8_t width[Count];
+    uint8_t bits[Count][Pages][Columns];
+
+    // Page run of glyph index, NULL when the index is outside the table
+    const uint8_t *page(unsigned int index, int p) const {
+        return index < (unsigned int)Count ? bits[index][p] : NULL;
+    }
+};
+
+// Build a page-major table from a column-major source with a width byte
+// in front of every glyph
+template <int Count, int Columns, int Pages>
+constexpr GlyphTable<Count, Columns, Pages> transposeGlyphs(const unsigned char *src) {
+    GlyphTable<Count, Columns, Pages> table{};
+    for (int g = 0; g < Count; g++) {
+        const unsigned char *glyph = src + g * (1 + Columns * Pages);
+        table.width[g] = glyph[0];
+        for (int c = 0; c < Columns; c++) {
+            for (int p = 0; p < Pages; p++) {
+                table.bits[g][p][c] = glyph[1 + c * Pages + p];
+            }
+        }
+    }
+    return table;
+}
+
+#endif
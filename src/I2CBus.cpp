@@ -0,0 +1,196 @@
+#include "I2CBus.h"
+
+// Worker thread flags
+#define BUS_FLAG_WORK 0x1
+#define BUS_FLAG_DONE 0x2
+
+// Flag set on a synchronous caller's EventFlags
+#define BUS_FLAG_SYNC 0x1
+
+I2CBus::I2CBus(PinName sda, PinName scl, int hz)
+    : _i2c(sda, scl), _thread(osPriorityAboveNormal, sizeof(_stack), _stack, "i2c_bus"),
+      _slots(I2C_BUS_SLOTS), _free(NULL), _pending(0), _event(0), _count(0), _errors(0) {
+
+    _i2c.frequency(hz);
+
+    for (int i = 0; i < I2C_BUS_SLOTS; i++) {
+        _pool[i].next = _free;
+        _free = &_pool[i];
+    }
+    for (int p = 0; p < I2C_PRIORITY_COUNT; p++) {
+        _head[p] = NULL;
+        _tail[p] = NULL;
+    }
+
+    _thread.start(callback(this, &I2CBus::worker));
+}
+
+bool I2CBus::write(uint8_t addr, const char *data, int len, I2CPriority priority,
+                   Callback<void(int)> done) {
+    if (len <= 0 || len > I2C_BUS_MAX_LEN) return false;
+    return queue(alloc(true), addr, data, len, priority, done);
+}
+
+bool I2CBus::tryWrite(uint8_t addr, const char *data, int len, I2CPriority priority,
+                      Callback<void(int)> done) {
+    if (len <= 0 || len > I2C_BUS_MAX_LEN) return false;
+    Transaction *t = alloc(false);
+    if (!t) return false;
+    return queue(t, addr, data, len, priority, done);
+}
+
+int I2CBus::writeSync(uint8_t addr, const char *data, int len, I2CPriority priority) {
+    if (len <= 0 || len > I2C_BUS_MAX_LEN) return -1;
+
+    Transaction *t = alloc(true);
+    memcpy(t->tx, data, len);
+    t->addr = addr;
+    t->priority = priority;
+    t->tx_len = len;
+    t->rx = NULL;
+    t->rx_len = 0;
+    t->done = NULL;
+    return runSync(t);
+}
+
+int I2CBus::transferSync(uint8_t addr, const char *tx, int tx_len, char *rx, int rx_len,
+                         I2CPriority priority) {
+    if (tx_len <= 0 || tx_len > I2C_BUS_MAX_LEN || rx_len < 0) return -1;
+
+    Transaction *t = alloc(true);
+    memcpy(t->tx, tx, tx_len);
+    t->addr = addr;
+    t->priority = priority;
+    t->tx_len = tx_len;
+    t->rx = rx;
+    t->rx_len = rx_len;
+    t->done = NULL;
+    return runSync(t);
+}
+
+void I2CBus::sync() {
+    while (true) {
+        _lock.lock();
+        int pending = _pending;
+        _lock.unlock();
+        if (!pending) return;
+        ThisThread::sleep_for(1ms);
+    }
+}
+
+I2CBus::Transaction *I2CBus::alloc(bool wait) {
+    if (wait) {
+        _slots.acquire();
+    } else if (!_slots.try_acquire()) {
+        return NULL;
+    }
+
+    _lock.lock();
+    Transaction *t = _free;
+    _free = t->next;
+    _lock.unlock();
+
+    t->waiter = NULL;
+    t->result = NULL;
+    t->next = NULL;
+    return t;
+}
+
+bool I2CBus::queue(Transaction *t, uint8_t addr, const char *data, int len, I2CPriority priority,
+                   Callback<void(int)> done) {
+    memcpy(t->tx, data, len);
+    t->addr = addr;
+    t->priority = priority;
+    t->tx_len = len;
+    t->rx = NULL;
+    t->rx_len = 0;
+    t->done = done;
+    enqueue(t);
+    return true;
+}
+
+void I2CBus::enqueue(Transaction *t) {
+    _lock.lock();
+    if (_tail[t->priority]) {
+        _tail[t->priority]->next = t;
+    } else {
+        _head[t->priority] = t;
+    }
+    _tail[t->priority] = t;
+    _pending++;
+    _lock.unlock();
+
+    _thread.flags_set(BUS_FLAG_WORK);
+}
+
+int I2CBus::runSync(Transaction *t) {
+    EventFlags waiter;
+    int result = -1;
+    t->waiter = &waiter;
+    t->result = &result;
+
+    enqueue(t);
+    waiter.wait_any(BUS_FLAG_SYNC);
+    return result;
+}
+
+// Bus thread: run queued transactions, highest priority first
+void I2CBus::worker() {
+    while (true) {
+        ThisThread::flags_wait_any(BUS_FLAG_WORK);
+
+        while (true) {
+            Transaction *t = NULL;
+            _lock.lock();
+            for (int p = 0; p < I2C_PRIORITY_COUNT && !t; p++) {
+                if (!_head[p]) continue;
+                t = _head[p];
+                _head[p] = t->next;
+                if (!_head[p]) _tail[p] = NULL;
+            }
+            _lock.unlock();
+            if (!t) break;
+
+            int result;
+#if DEVICE_I2C_ASYNCH
+            _event = 0;
+            ThisThread::flags_clear(BUS_FLAG_DONE);
+            if (_i2c.transfer(t->addr, t->tx, t->tx_len, t->rx, t->rx_len,
+                              callback(this, &I2CBus::transferDone), I2C_EVENT_ALL) == 0) {
+                ThisThread::flags_wait_any(BUS_FLAG_DONE);
+                result = (_event & I2C_EVENT_TRANSFER_COMPLETE) &&
+                         !(_event & (I2C_EVENT_ERROR | I2C_EVENT_ERROR_NO_SLAVE | I2C_EVENT_TRANSFER_EARLY_NACK))
+                         ? 0 : -1;
+            } else {
+                result = -1;
+            }
+#else
+            result = _i2c.write(t->addr, t->tx, t->tx_len, t->rx_len > 0) ? -1 : 0;
+            if (result == 0 && t->rx_len > 0) {
+                result = _i2c.read(t->addr, t->rx, t->rx_len) ? -1 : 0;
+            }
+#endif
+
+            _count++;
+            if (result) _errors++;
+            if (t->done) t->done(result);
+            if (t->waiter) {
+                *t->result = result;
+                t->waiter->set(BUS_FLAG_SYNC);
+            }
+
+            _lock.lock();
+            t->next = _free;
+            _free = t;
+            _pending--;
+            _lock.unlock();
+            _slots.release();
+        }
+    }
+}
+
+// Interrupt context: hand the transfer result back to the bus thread
+void I2CBus::transferDone(int event) {
+    _event = event;
+    _thread.flags_set(BUS_FLAG_DONE);
+}
@@ -0,0 +1,202 @@
+#include "MotionPlanner.h"
+
+// Corners sharper than this (cosine) are treated as a full reversal
+#define JUNCTION_COS_REVERSE 0.999999f
+#define JUNCTION_COS_STRAIGHT -0.999999f
+
+MotionPlanner::MotionPlanner(Stepper &stepper)
+    : _stepper(stepper), _head(0), _count(0), _running(false),
+      _prevNominalSqr(0.0f), _havePrev(false),
+      _maxCount(0), _lastPlanUs(0), _maxPlanUs(0) {
+
+    memset(_prevUnit, 0, sizeof(_prevUnit));
+    configure(1000.0f, 4000.0f, 2.0f);
+    _stepper.onSegmentNext(callback(this, &MotionPlanner::next));
+    _stepper.onSegmentAbort(callback(this, &MotionPlanner::aborted));
+}
+
+void MotionPlanner::configure(float max_speed, float accel, float junction_deviation) {
+    clear();
+    while (!isIdle()) {
+        ThisThread::sleep_for(1ms);
+    }
+    _accel = accel > 0.0f ? accel : 1.0f;
+    _maxSpeed = _profile.configure(max_speed, _accel);
+    _junction = junction_deviation;
+}
+
+bool MotionPlanner::push(int dx1, int dx2, int dx3, int dx4, float speed) {
+
+    if (_count >= MOTION_QUEUE_SIZE) return false;
+
+    uint32_t start = us_ticker_read();
+
+    Block b;
+    b.steps[0] = dx1;
+    b.steps[1] = dx2;
+    b.steps[2] = dx3;
+    b.steps[3] = dx4;
+
+    float sum = 0.0f;
+    uint32_t ticks = 0;
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        uint32_t d = b.steps[i] < 0 ? 0u - (uint32_t)b.steps[i] : b.steps[i];
+        sum += (float)d * (float)d;
+        if (d > ticks) ticks = d;
+    }
+    if (ticks == 0) return true;
+
+    b.length = sqrtf(sum);
+    b.ratio = ticks / b.length;
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        b.unit[i] = b.steps[i] / b.length;
+    }
+
+    // Longest axis bounded by the ramp limits
+    b.accel = _accel / b.ratio;
+    float nominal = _maxSpeed / b.ratio;
+    if (speed > 0.0f && speed < nominal) nominal = speed;
+    b.nominal_sqr = nominal * nominal;
+
+    // Junction deviation: the corner speed at which the centripetal
+    // acceleration around a circle of deviation _junction equals accel
+    b.max_entry_sqr = 0.0f;
+    if (_havePrev) {
+        float cos_theta = 0.0f;
+        for (int i = 0; i < STEP_CHANNELS; i++) {
+            cos_theta -= _prevUnit[i] * b.unit[i];
+        }
+        float limit = b.nominal_sqr < _prevNominalSqr ? b.nominal_sqr : _prevNominalSqr;
+        if (cos_theta < JUNCTION_COS_STRAIGHT) {
+            b.max_entry_sqr = limit;
+        } else if (cos_theta < JUNCTION_COS_REVERSE) {
+            float sin_theta_d2 = sqrtf(0.5f * (1.0f - cos_theta));
+            float v_sqr = b.accel * _junction * sin_theta_d2 / (1.0f - sin_theta_d2);
+            b.max_entry_sqr = v_sqr < limit ? v_sqr : limit;
+        }
+    }
+    b.entry_sqr = 0.0f;
+    b.locked = false;
+
+    {
+        CriticalSectionLock lock;
+
+        if (_count == 0) {
+            // Nothing pending: the entry is whatever the running block ends at
+            b.locked = true;
+            if (_running) {
+                float stop_sqr = 2.0f * b.accel * b.length;
+                float want = b.max_entry_sqr < stop_sqr ? b.max_entry_sqr : stop_sqr;
+                uint32_t end = _stepper.raiseSegmentExit(rampIndex(_current, want));
+                float end_sqr = 2.0f * _accel * end / (_current.ratio * _current.ratio);
+                b.entry_sqr = end_sqr < want ? end_sqr : want;
+            }
+        }
+
+        _blocks[(_head + _count) % MOTION_QUEUE_SIZE] = b;
+        _count++;
+        if (_count > _maxCount) _maxCount = _count;
+
+        recalculate();
+
+        // Idle generator: start the first block now
+        if (!_running && !_stepper.isLinearBusy()) {
+            LinearSegment seg;
+            Block &first = _blocks[_head];
+            float exit_sqr = _count > 1 ? _blocks[(_head + 1) % MOTION_QUEUE_SIZE].entry_sqr : 0.0f;
+            toSegment(first, exit_sqr, seg);
+            if (_stepper.moveSegment(seg)) {
+                next(seg);
+            }
+        }
+    }
+
+    memcpy(_prevUnit, b.unit, sizeof(_prevUnit));
+    _prevNominalSqr = b.nominal_sqr;
+    _havePrev = true;
+
+    _lastPlanUs = us_ticker_read() - start;
+    if (_lastPlanUs > _maxPlanUs) _maxPlanUs = _lastPlanUs;
+    return true;
+}
+
+bool MotionPlanner::isIdle() {
+    CriticalSectionLock lock;
+    return !_running && _count == 0;
+}
+
+void MotionPlanner::clear() {
+    CriticalSectionLock lock;
+    _stepper.stopSegment();
+    aborted();
+}
+
+// The running block was stopped short, through clear() or a stop on one
+// of its axes. The queue was planned to blend out of it, so it goes too
+// and the next push starts from rest.
+void MotionPlanner::aborted() {
+    _count = 0;
+    _running = false;
+    _havePrev = false;
+}
+
+// Step interrupt: hand over the head block once the running one ends
+bool MotionPlanner::next(LinearSegment &seg) {
+    if (_count == 0) {
+        _running = false;
+        _havePrev = false;
+        return false;
+    }
+
+    const Block &b = _blocks[_head];
+    float exit_sqr = 0.0f;
+    if (_count > 1) {
+        Block &following = _blocks[(_head + 1) % MOTION_QUEUE_SIZE];
+        following.locked = true;
+        exit_sqr = following.entry_sqr;
+    }
+    toSegment(b, exit_sqr, seg);
+
+    _current = b;
+    _running = true;
+    _head = (_head + 1) % MOTION_QUEUE_SIZE;
+    _count--;
+    return true;
+}
+
+void MotionPlanner::recalculate() {
+
+    // Backward pass: every block must be able to slow to the next entry
+    float next_entry = 0.0f;
+    for (int n = _count - 1; n >= 0; n--) {
+        Block &b = _blocks[(_head + n) % MOTION_QUEUE_SIZE];
+        if (b.locked) break;
+        float reach = next_entry + 2.0f * b.accel * b.length;
+        b.entry_sqr = b.max_entry_sqr < reach ? b.max_entry_sqr : reach;
+        next_entry = b.entry_sqr;
+    }
+
+    // Forward pass: and speed up to it from its own entry
+    for (int n = 0; n < _count - 1; n++) {
+        Block &b = _blocks[(_head + n) % MOTION_QUEUE_SIZE];
+        Block &following = _blocks[(_head + n + 1) % MOTION_QUEUE_SIZE];
+        if (following.locked) continue;
+        float reach = b.entry_sqr + 2.0f * b.accel * b.length;
+        if (following.entry_sqr > reach) following.entry_sqr = reach;
+    }
+}
+
+void MotionPlanner::toSegment(const Block &b, float exit_sqr, LinearSegment &seg) const {
+    memcpy(seg.delta, b.steps, sizeof(seg.delta));
+    seg.entry = rampIndex(b, b.entry_sqr);
+    seg.exit = rampIndex(b, exit_sqr);
+    seg.cruise = rampIndex(b, b.nominal_sqr);
+    seg.profile = &_profile;
+}
+
+// Ramp position whose longest-axis speed matches a path speed:
+// v^2 = 2 a n  on the longest axis
+uint32_t MotionPlanner::rampIndex(const Block &b, float speed_sqr) const {
+    float axis_sqr = speed_sqr * b.ratio * b.ratio;
+    return (uint32_t)(axis_sqr / (2.0f * _accel));
+}
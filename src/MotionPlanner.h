@@ -0,0 +1,95 @@
+/**
+ ******************************************************************************
+ * @file    MotionPlanner.h
+ * @brief   Look-ahead queue of coordinated stepper moves.
+ ******************************************************************************
+ * @attention
+ *
+ * Moves are buffered in a ring of MOTION_QUEUE_SIZE blocks. Every time a
+ * block is added the planner recomputes the entry speed of each pending
+ * block (grbl style): the corner speed between two blocks is limited by
+ * the junction deviation, and a backward then forward pass makes sure
+ * every block can still reach its exit speed within its own length.
+ * Consecutive moves therefore blend instead of stopping at every boundary.
+ *
+ * Speeds and lengths are in steps along the path. Acceleration is limited
+ * per axis: the longest axis of a block never exceeds the configured
+ * acceleration, which is also the ramp the step generator plays back.
+ *
+ ******************************************************************************
+ */
+
+#ifndef MOTIONPLANNER_H
+#define MOTIONPLANNER_H
+
+#include "mbed.h"
+#include "VMShield.h"
+
+#ifndef MOTION_QUEUE_SIZE
+#define MOTION_QUEUE_SIZE 16
+#endif
+
+class MotionPlanner {
+public:
+    MotionPlanner(Stepper &stepper);
+
+    // Limits of the longest axis: steps/s, steps/s^2, and the junction
+    // deviation in steps (larger = faster corners)
+    void configure(float max_speed, float accel, float junction_deviation);
+
+    // Queue a coordinated move, speed in steps/s along the path (0 = max).
+    // Returns false if the queue is full.
+    bool push(int dx1, int dx2, int dx3, int dx4, float speed = 0.0f);
+
+    bool isIdle();
+    // Stop the running block where it is and drop everything queued
+    void clear();
+
+    // Sizing statistics
+    int depth() const { return _count; }
+    int maxDepth() const { return _maxCount; }
+    uint32_t lastPlanUs() const { return _lastPlanUs; }
+    uint32_t maxPlanUs() const { return _maxPlanUs; }
+
+private:
+    struct Block {
+        int32_t steps[STEP_CHANNELS];
+        float unit[STEP_CHANNELS];
+        float length;           // path length in steps
+        float ratio;            // longest axis steps / length
+        float accel;            // path acceleration
+        float nominal_sqr;      // path speed squared
+        float max_entry_sqr;
+        float entry_sqr;
+        bool locked;            // entry fixed by the block in front
+    };
+
+    bool next(LinearSegment &seg);
+    void aborted();
+    void recalculate();
+    void toSegment(const Block &b, float exit_sqr, LinearSegment &seg) const;
+    uint32_t rampIndex(const Block &b, float speed_sqr) const;
+
+    Stepper &_stepper;
+    RampProfile _profile;
+    float _accel;
+    float _maxSpeed;
+    float _junction;
+
+    Block _blocks[MOTION_QUEUE_SIZE];
+    int _head;
+    int _count;
+
+    // Last block handed to the step generator
+    bool _running;
+    Block _current;
+    float _prevUnit[STEP_CHANNELS];
+    float _prevNominalSqr;
+    bool _havePrev;
+
+    int _maxCount;
+    uint32_t _lastPlanUs;
+    uint32_t _maxPlanUs;
+};
+
+#endif
@@ -1,54 +1,115 @@
 #include "OLED_Display.h" 
 
-OLED_Display::OLED_Display(PinName sda, PinName scl) : i2c(sda, scl) {} 
+// Constant-initialised from the constexpr transpose, so both tables live in flash
+const OLED_Display::CharGlyphs OLED_Display::_charGlyphs =
+    transposeGlyphs<CharGlyphs::COUNT, CharGlyphs::COLUMNS, CharGlyphs::PAGES>(font_char);
+const OLED_Display::LogoGlyphs OLED_Display::_logoGlyphs =
+    transposeGlyphs<LogoGlyphs::COUNT, LogoGlyphs::COLUMNS, LogoGlyphs::PAGES>(font);
+
+OLED_Display::OLED_Display(I2CBus *bus)
+    : _cursorX(0), _cursorY(0), _transactions(0), _bytesSent(0), _bus(bus) { 
+    memset(_fb, 0, sizeof(_fb)); 
+    markAllDirty(); 
+} 
 
 void OLED_Display::begin() { 
-    i2c.frequency(400000); 
+    _lock.lock(); 
     turnON(); 
 //setInversDisplayMode();
     setNormalDisplayMode();
-    setPageMode(); 
+    setHorizontalMode(); 
     writeCommand(0xA7); // Invert display
     writeCommand(0x8D); // Charge Pump 
     writeCommand(0x14); 
     clearDisplay(); 
+    _lock.unlock(); 
 } 
-void OLED_Display:: print_string(string string,char x,char y)
+// The whole string is rendered first, so display() sends it as one window
+void OLED_Display:: print_string(const string &text,char x,char y)
 {
-       for(int i=0; i< string.length();i++)
+       _lock.lock();
+       for(size_t i=0; i< text.length();i++)
        {
-             char ch  = string[i];
+             int x_cord = (uint8_t)x + i* Char_Horizontal_Columns_Required;
              
-             char x_cord = x+ i* Char_Horizontal_Columns_Required;
-             
-             print_char(ch,x_cord,y);
+             renderChar(text[i],x_cord,(uint8_t)y);
         }
+       display();
+       _lock.unlock();
 }
 
-void OLED_Display:: print_string_logo(string string,char x,char y)
+void OLED_Display:: print_string_logo(const string &text,char x,char y)
 {
-       for(int i=0; i< string.length();i++)
+       _lock.lock();
+       for(size_t i=0; i< text.length();i++)
        {
-             char ch  = string[i];
-             
-             char x_cord = x+ i* Char_Horizontal_Columns_Required_l;
+             int x_cord = (uint8_t)x + i* Char_Horizontal_Columns_Required_l;
              
-             print_logo(ch,x_cord,y);
+             renderLogo(text[i],x_cord,(uint8_t)y);
         }
+       display();
+       _lock.unlock();
 }
 
 void OLED_Display::writeCommand(uint8_t command) { 
     char data[2]; 
     data[0] = COMMAND_REG; 
     data[1] = command; 
-    i2c.write(OLED_I2C_ADDRESS << 1, data, 2); 
+    send(data, 2); 
 } 
 
 void OLED_Display::writeData(uint8_t data) { 
     char buffer[2]; 
     buffer[0] = DATA_REG; 
     buffer[1] = data; 
-    i2c.write(OLED_I2C_ADDRESS << 1, buffer, 2); 
+    send(buffer, 2); 
+} 
+
+// Column (0x21) and page (0x22) window in one command stream; with
+// horizontal addressing the data pointer wraps inside the window
+void OLED_Display::setWindow(uint8_t col0, uint8_t col1, uint8_t page0, uint8_t page1) { 
+    char data[7]; 
+    data[0] = COMMAND_STREAM; 
+    data[1] = COLUMN_ADDR_CMD; 
+    data[2] = col0; 
+    data[3] = col1; 
+    data[4] = PAGE_ADDR_CMD; 
+    data[5] = page0; 
+    data[6] = page1; 
+    send(data, 7); 
+} 
+
+// Stream the framebuffer rectangle as data transactions of up to
+// BURST_LEN bytes behind a single 0x40 control byte each
+void OLED_Display::streamWindow(uint8_t col0, uint8_t col1, uint8_t page0, uint8_t page1) { 
+    char buffer[1 + BURST_LEN]; 
+    int len = 0; 
+
+    setWindow(col0, col1, page0, page1); 
+    buffer[0] = DATA_REG; 
+    for (int page = page0; page <= page1; page++) { 
+        for (int col = col0; col <= col1; col++) { 
+            buffer[1 + len++] = _fb[page][col]; 
+            if (len == BURST_LEN) { 
+                send(buffer, 1 + len); 
+                len = 0; 
+            } 
+        } 
+    } 
+    if (len) send(buffer, 1 + len); 
+} 
+
+void OLED_Display::send(const char *data, int len) { 
+    _bus->write(OLED_I2C_ADDRESS << 1, data, len, I2C_PRIORITY_LOW); 
+    _transactions++; 
+    _bytesSent += len; 
+} 
+
+void OLED_Display::resetStats() { 
+    _lock.lock(); 
+    _transactions = 0; 
+    _bytesSent = 0; 
+    _lock.unlock(); 
 } 
 
 void OLED_Display::turnON() { 
@@ -64,67 +125,76 @@ void OLED_Display::setInversDisplayMode() {
 
 } 
 
-void OLED_Display::setPageMode() { 
+void OLED_Display::setHorizontalMode() { 
     writeCommand(0x20); // Set addressing mode 
-    writeCommand(PAGE_ADDRESSING_MODE); // Set page addressing mode 
+    writeCommand(HORIZONTAL_ADDRESSING_MODE); // Set horizontal addressing mode 
 } 
 
 void OLED_Display::clearDisplay() { 
-    for (uint8_t page = 0; page < 8; page++) { 
-        setCursor(0, page); 
-        for (uint8_t column = 0; column < 128; column++) { 
-            writeData(0x00); 
-        } 
-    } 
+    // Panel RAM is unknown after power-up, so always resend every page
+    _lock.lock(); 
+    memset(_fb, 0, sizeof(_fb)); 
+    markAllDirty(); 
+    display(); 
     setCursor(0, 0); 
+    _lock.unlock(); 
 } 
 
 void OLED_Display::setCursor(uint8_t x, uint8_t y) { 
-    writeCommand(0x00 + (x & 0x0F)); // Set column lower address 
-    writeCommand(0x10 + ((x >> 4) & 0x0F)); // Set column higher address 
-    writeCommand(0xB0 + y); // Set page address 
+    _lock.lock(); 
+    _cursorX = x; 
+    _cursorY = y; 
+    sendCursor(x, y); 
+    _lock.unlock(); 
+} 
+
+// Window from the cursor to the bottom right corner
+void OLED_Display::sendCursor(uint8_t x, uint8_t y) { 
+    setWindow(x, WIDTH - 1, y, PAGES - 1); 
 } 
 
 void OLED_Display::writeText(const char* text) { 
+    _lock.lock(); 
     while (*text) { 
-        char c = *text++; 
-        if (c < 0x20 || c > 0x7E) c = 0x20; // Replace non-printable characters with space 
-        for (int i = 0; i < 5; i++) { 
-            writeData(font[(c - 0x20) * 5 + i]); 
-        } 
-        writeData(0x00); // Add a column of space between characters 
+        renderChar(*text++, _cursorX, _cursorY); 
+        _cursorX += Char_Horizontal_Columns_Required; 
     } 
+    display(); 
+    _lock.unlock(); 
 } 
 void OLED_Display:: print_char(char ch, char x_cord, char y_cord)
 {
-  char ascii_to_array_index = ch - First_char_ascii_code;
-  int char_start_in_array  = ascii_to_array_index * No_of_bytes_Char + 1;
-  
-  for (char j = x_cord; j < x_cord + Char_Horizontal_Columns_Required; j++)
+  _lock.lock();
+  renderChar(ch, (uint8_t)x_cord, (uint8_t)y_cord);
+  display();
+  _lock.unlock();
+}
+// One contiguous column run per page; characters outside the font are skipped
+void OLED_Display:: renderChar(char ch, int x_cord, int y_cord)
+{
+  unsigned int index = (uint8_t)ch - (unsigned int)First_char_ascii_code;
+  for (int page = 0; page < CharGlyphs::PAGES; page++)
   {
-    for (char i = y_cord; i < y_cord + Char_Verticle_Pages_Required; i++)
-    {
-      setCursor(j, i);
-      int array_index = char_start_in_array + (j - x_cord) * Char_Verticle_Pages_Required + (i - y_cord);
-      char char_byte= font_char[array_index];
-      writeData(char_byte);
-    }
+    const uint8_t *run = _charGlyphs.page(index, page);
+    if (!run) return;
+    drawSpan(x_cord, y_cord + page, run, CharGlyphs::COLUMNS);
   }
 }
 void OLED_Display:: print_logo(char ch, char x_cord, char y_cord)
 {
-  char ascii_to_array_index = ch - First_char_ascii_code_l;
-  int char_start_in_array  = ascii_to_array_index * No_of_bytes_Char_l + 1;
-  
-  for (char j = x_cord; j < x_cord + Char_Horizontal_Columns_Required_l; j++)
+  _lock.lock();
+  renderLogo(ch, (uint8_t)x_cord, (uint8_t)y_cord);
+  display();
+  _lock.unlock();
+}
+void OLED_Display:: renderLogo(char ch, int x_cord, int y_cord)
+{
+  unsigned int index = (uint8_t)ch - (unsigned int)First_char_ascii_code_l;
+  for (int page = 0; page < LogoGlyphs::PAGES; page++)
   {
-    for (char i = y_cord; i < y_cord + Char_Verticle_Pages_Required_l; i++)
-    {
-      setCursor(j, i);
-      int array_index = char_start_in_array + (j - x_cord) * Char_Verticle_Pages_Required_l + (i - y_cord);
-      char char_byte= font[array_index];
-      writeData(char_byte);
-    }
+    const uint8_t *run = _logoGlyphs.page(index, page);
+    if (!run) return;
+    drawSpan(x_cord, y_cord + page, run, LogoGlyphs::COLUMNS);
   }
 }
 
@@ -132,32 +202,148 @@ void OLED_Display::drawBasicPattern() {
     // Example to draw a simple 8x8 square at the top-left corner
     const int pattern_width = 8;
     const int pattern_height = 8;
-    char pattern[64] = {   0x08, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF    }; // 8x8 full of 1s
+    uint8_t pattern[64] = {   0x08, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF    }; // 8x8 full of 1s
 
+    _lock.lock();
     for (int y = 0; y < pattern_height; y++) {
         for (int x = 0; x < pattern_width; x++) {
             int index = y * pattern_width + x;
-            setCursor(x, y);
-            writeData(pattern[index]);
+            drawByte(x, y, pattern[index]);
         }
     }
+    display();
+    _lock.unlock();
 }
 
 
 
 
 void OLED_Display::drawSprite(const char sprite[], int char_h , int char_v) {
+    _lock.lock();
     for (int j = 0; j < char_h; j++) {
       
         for ( int  i = 0; i < char_v; i++) {
-              setCursor(j,i); // Set cursor to the beginning of the line
-            // Write each byte from the sprite array to the display
-            writeData(sprite[j* char_v +i]);
+            // Write each byte from the sprite array to the framebuffer
+            drawByte(j, i, sprite[j* char_v +i]);
         }
     }
+    display();
+    _lock.unlock();
 }
 
+/* FRAMEBUFFER */
+void OLED_Display::clear() { 
+    _lock.lock(); 
+    memset(_fb, 0, sizeof(_fb)); 
+    markAllDirty(); 
+    _lock.unlock(); 
+} 
 
+void OLED_Display::drawByte(int column, int page, uint8_t bits) { 
+    if (column < 0 || column >= WIDTH || page < 0 || page >= PAGES) return; 
+    _lock.lock(); 
+    if (_fb[page][column] != bits) { 
+        _fb[page][column] = bits; 
+        markDirty(page, column, column); 
+    } 
+    _lock.unlock(); 
+} 
+
+// Copy a run of column bytes into one page, clipped to the panel, and
+// mark only the part that actually changed
+void OLED_Display::drawSpan(int column, int page, const uint8_t *bits, int len) { 
+    if (page < 0 || page >= PAGES) return; 
+    if (column < 0) { 
+        bits -= column; 
+        len += column; 
+        column = 0; 
+    } 
+    if (column + len > WIDTH) len = WIDTH - column; 
+    if (len <= 0) return; 
+
+    uint8_t *row = &_fb[page][column]; 
+    int lo = 0; 
+    while (lo < len && row[lo] == bits[lo]) lo++; 
+    if (lo == len) return; 
+    int hi = len - 1; 
+    while (row[hi] == bits[hi]) hi--; 
+
+    memcpy(row + lo, bits + lo, hi - lo + 1); 
+    markDirty(page, column + lo, column + hi); 
+} 
+
+void OLED_Display::drawPixel(int x, int y, bool on) { 
+    if (x < 0 || x >= WIDTH || y < 0 || y >= PAGES * 8) return; 
+    uint8_t mask = 1 << (y & 7); 
+    _lock.lock(); 
+    uint8_t bits = on ? (_fb[y >> 3][x] | mask) : (_fb[y >> 3][x] & ~mask); 
+    drawByte(x, y >> 3, bits); 
+    _lock.unlock(); 
+} 
+
+void OLED_Display::fillRect(int x, int y, int w, int h, bool on) { 
+    _lock.lock(); 
+    for (int row = y; row < y + h; row++) { 
+        for (int col = x; col < x + w; col++) { 
+            drawPixel(col, row, on); 
+        } 
+    } 
+    _lock.unlock(); 
+} 
+
+// Only the columns that changed since the last push go out. The dirty
+// pages are sent either as one bounding window or as one window per
+// page, whichever moves fewer bytes.
+void OLED_Display::display() { 
+    int page0 = -1, page1 = -1; 
+    int lo = WIDTH, hi = -1; 
+    int perPage = 0; 
+
+    _lock.lock(); 
+
+    for (int page = 0; page < PAGES; page++) { 
+        if (_dirtyLo[page] > _dirtyHi[page]) continue; 
+        if (page0 < 0) page0 = page; 
+        page1 = page; 
+        if (_dirtyLo[page] < lo) lo = _dirtyLo[page]; 
+        if (_dirtyHi[page] > hi) hi = _dirtyHi[page]; 
+        perPage += WINDOW_COST + 1 + _dirtyHi[page] - _dirtyLo[page] + 1; 
+    } 
+    if (page0 < 0) { 
+        _lock.unlock(); 
+        return; 
+    } 
+
+    int bounding = WINDOW_COST + (hi - lo + 1) * (page1 - page0 + 1); 
+    bounding += (bounding + BURST_LEN - 1) / BURST_LEN; 
+
+    if (bounding <= perPage) { 
+        streamWindow(lo, hi, page0, page1); 
+    } else { 
+        for (int page = page0; page <= page1; page++) { 
+            if (_dirtyLo[page] > _dirtyHi[page]) continue; 
+            streamWindow(_dirtyLo[page], _dirtyHi[page], page, page); 
+        } 
+    } 
+
+    for (int page = 0; page < PAGES; page++) { 
+        _dirtyLo[page] = WIDTH; 
+        _dirtyHi[page] = 0; 
+    } 
+    _lock.unlock(); 
+} 
+
+void OLED_Display::markDirty(int page, int lo, int hi) { 
+    if (lo < _dirtyLo[page]) _dirtyLo[page] = lo; 
+    if (hi > _dirtyHi[page]) _dirtyHi[page] = hi; 
+} 
+
+void OLED_Display::markAllDirty() { 
+    for (int page = 0; page < PAGES; page++) { 
+        _dirtyLo[page] = 0; 
+        _dirtyHi[page] = WIDTH - 1; 
+    } 
+} 
 
 /*void OLED_Display::drawSprite(const int sprite[24][24], uint8_t spriteWidth, uint8_t spriteHeight) {
     for (uint8_t y = 0; y < spriteHeight; y++) {
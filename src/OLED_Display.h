@@ -2,13 +2,18 @@
 #define OLED_DISPLAY_H 
 
 #include "mbed.h" 
+#include "I2CBus.h"
+#include "GlyphTable.h"
 #include "glcdfont.h" 
 //#include "glcdfont_char.h" 
 
 
+// The framebuffer, dirty spans and panel window are shared by every thread
+// that draws; each public call holds _lock for its whole render and push,
+// so a partial string or a window from another thread never goes out.
 class OLED_Display { 
 public: 
-    OLED_Display(PinName sda, PinName scl); 
+    OLED_Display(I2CBus *bus); 
 
     void begin(); 
     void clearDisplay(); 
@@ -18,22 +23,58 @@ public:
         void print_logo(char ch, char x_cord, char y_cord);
          
 
-        void print_string(string string,char x,char y); 
-                void print_string_logo(string string,char x,char y); 
+        void print_string(const string &text,char x,char y); 
+                void print_string_logo(const string &text,char x,char y); 
 
 
     void drawSprite(const char sprite[], int char_h , int char_v);  // New method
     void drawBasicPattern();  // New method
 
+    // Framebuffer drawing; nothing reaches the panel until display()
+    void clear(); 
+    void drawPixel(int x, int y, bool on); 
+    void fillRect(int x, int y, int w, int h, bool on); 
+    void drawByte(int column, int page, uint8_t bits); 
+    // Push the changed span of every dirty page
+    void display(); 
+
+    // Bus traffic since the last resetStats()
+    uint32_t transactions() const { return _transactions; } 
+    uint32_t bytesSent() const { return _bytesSent; } 
+    void resetStats(); 
+
+    static const int WIDTH = 128; 
+    static const int PAGES = 8; 
+
 private: 
-    I2C i2c; 
+    uint8_t _fb[PAGES][WIDTH]; 
+    uint8_t _dirtyLo[PAGES]; 
+    uint8_t _dirtyHi[PAGES]; 
+    uint8_t _cursorX; 
+    uint8_t _cursorY; 
+    uint32_t _transactions; 
+    uint32_t _bytesSent; 
+    // Recursive, so public calls can draw through each other 
+    Mutex _lock; 
+
+    void renderChar(char ch, int x_cord, int y_cord); 
+    void renderLogo(char ch, int x_cord, int y_cord); 
+    void drawSpan(int column, int page, const uint8_t *bits, int len); 
+    void sendCursor(uint8_t x, uint8_t y); 
+    void markDirty(int page, int lo, int hi); 
+    void markAllDirty(); 
+    void setWindow(uint8_t col0, uint8_t col1, uint8_t page0, uint8_t page1); 
+    void streamWindow(uint8_t col0, uint8_t col1, uint8_t page0, uint8_t page1); 
+    void send(const char *data, int len); 
+
+    I2CBus *_bus; 
     void writeCommand(uint8_t command); 
     void writeData(uint8_t data); 
     void turnON(); 
     void setNormalDisplayMode(); 
     void setInversDisplayMode(); 
 
-    void setPageMode(); 
+    void setHorizontalMode(); 
 
     static const uint8_t OLED_I2C_ADDRESS = 0x3C; 
     static const uint8_t COMMAND_REG = 0x80; 
@@ -46,12 +87,26 @@ private:
    static const int Char_Verticle_Pages_Required_l = 6;
    static const int Char_Horizontal_Columns_Required_l = 60;
 
-    static const uint8_t PAGE_ADDRESSING_MODE = 0x02; 
+    static const uint8_t HORIZONTAL_ADDRESSING_MODE = 0x00; 
+    static const uint8_t COMMAND_STREAM = 0x00; 
+    static const uint8_t COLUMN_ADDR_CMD = 0x21; 
+    static const uint8_t PAGE_ADDR_CMD = 0x22; 
+    // Data bytes per transaction, and the cost of one window command
+    static const int BURST_LEN = 128; 
+    static const int WINDOW_COST = 8; 
 
   static const int  First_char_ascii_code = 32 ;
-    static const int  No_of_bytes_Char = 21 ;
+    static const int  No_of_bytes_Char = 1 + Char_Horizontal_Columns_Required * Char_Verticle_Pages_Required ;
     static const int  First_char_ascii_code_l = 32 ;
-    static const int  No_of_bytes_Char_l = 360 ;
+    static const int  No_of_bytes_Char_l = 1 + Char_Horizontal_Columns_Required_l * Char_Verticle_Pages_Required_l ;
+
+    // Fonts transposed to page-major order at compile time
+    typedef GlyphTable<sizeof(font_char) / No_of_bytes_Char,
+                       Char_Horizontal_Columns_Required, Char_Verticle_Pages_Required> CharGlyphs;
+    typedef GlyphTable<sizeof(font) / No_of_bytes_Char_l,
+                       Char_Horizontal_Columns_Required_l, Char_Verticle_Pages_Required_l> LogoGlyphs;
+    static const CharGlyphs _charGlyphs;
+    static const LogoGlyphs _logoGlyphs;
 
 }; 
 
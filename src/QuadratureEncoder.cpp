@@ -0,0 +1,90 @@
+#include "QuadratureEncoder.h"
+
+#if defined(TARGET_STM)
+#include "pinmap.h"
+#include "PeripheralPins.h"
+#endif
+
+// Count change for (previous AB << 2 | new AB); 0 for no change or a
+// skipped state
+static const int8_t QUADRATURE_STEP[16] = {
+     0, -1,  1,  0,
+     1,  0,  0, -1,
+    -1,  0,  0,  1,
+     0,  1, -1,  0
+};
+
+InterruptEncoder::InterruptEncoder(PinName a, PinName b)
+    : _a(a), _b(b), _count(0) {
+
+    _a.mode(PullUp);
+    _b.mode(PullUp);
+    _state = (_a.read() << 1) | _b.read();
+
+    _a.rise(callback(this, &InterruptEncoder::edge));
+    _a.fall(callback(this, &InterruptEncoder::edge));
+    _b.rise(callback(this, &InterruptEncoder::edge));
+    _b.fall(callback(this, &InterruptEncoder::edge));
+}
+
+void InterruptEncoder::reset() {
+    CriticalSectionLock lock;
+    _count = 0;
+}
+
+// Interrupt context: any edge on either input
+void InterruptEncoder::edge() {
+    uint8_t state = (_a.read() << 1) | _b.read();
+    _count += QUADRATURE_STEP[(_state << 2) | state];
+    _state = state;
+}
+
+#if defined(TARGET_STM)
+TimerEncoder::TimerEncoder(TIM_TypeDef *tim, PinName a, PinName b)
+    : _tim(tim), _last(0), _count(0) {
+
+    // The PWM pin map carries the timer alternate function of each pin
+    pinmap_pinout(a, PinMap_PWM);
+    pinmap_pinout(b, PinMap_PWM);
+    pin_mode(a, PullUp);
+    pin_mode(b, PullUp);
+
+    if (tim == TIM1) __HAL_RCC_TIM1_CLK_ENABLE();
+    else if (tim == TIM2) __HAL_RCC_TIM2_CLK_ENABLE();
+    else if (tim == TIM3) __HAL_RCC_TIM3_CLK_ENABLE();
+    else if (tim == TIM4) __HAL_RCC_TIM4_CLK_ENABLE();
+#if defined(TIM5)
+    else if (tim == TIM5) __HAL_RCC_TIM5_CLK_ENABLE();
+#endif
+#if defined(TIM8)
+    else if (tim == TIM8) __HAL_RCC_TIM8_CLK_ENABLE();
+#endif
+
+    _tim->CR1 = 0;
+    // CH1/CH2 as inputs on TI1/TI2 with a short filter against ringing
+    _tim->CCMR1 = TIM_CCMR1_CC1S_0 | TIM_CCMR1_CC2S_0 |
+                  (3u << TIM_CCMR1_IC1F_Pos) | (3u << TIM_CCMR1_IC2F_Pos);
+    _tim->CCER = 0;
+    // Encoder mode 3: count on both edges of both inputs
+    _tim->SMCR = TIM_SMCR_SMS_0 | TIM_SMCR_SMS_1;
+    _tim->ARR = 0xFFFF;
+    _tim->CNT = 0;
+    _tim->CR1 = TIM_CR1_CEN;
+}
+
+// Widen the 16-bit counter: the signed difference since the last read is
+// right as long as less than half the counter range went by
+int32_t TimerEncoder::count() {
+    CriticalSectionLock lock;
+    uint16_t now = _tim->CNT;
+    _count += (int16_t)(now - _last);
+    _last = now;
+    return _count;
+}
+
+void TimerEncoder::reset() {
+    CriticalSectionLock lock;
+    _last = _tim->CNT;
+    _count = 0;
+}
+#endif
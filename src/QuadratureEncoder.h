@@ -0,0 +1,70 @@
+/**
+ ******************************************************************************
+ * @file    QuadratureEncoder.h
+ * @brief   Quadrature encoder inputs for the DC motor channels.
+ ******************************************************************************
+ * @attention
+ *
+ * Two implementations behind one interface:
+ *
+ * - TimerEncoder puts an STM32 general purpose timer in encoder mode. The
+ *   timer counts every edge of both inputs (x4) in hardware, so any speed
+ *   the timer input filter passes costs no CPU. Both pins must be channel
+ *   1 and 2 of the same timer, e.g. TIM2 on PA_15/PB_3.
+ *
+ * - InterruptEncoder decodes x4 in software from InterruptIn edges on any
+ *   pair of pins. Fine for a few tens of kHz of edges.
+ *
+ * count() is safe to call from interrupt context. TimerEncoder extends the
+ * 16-bit hardware counter in software, so it must be read at least once
+ * per 32768 counts; the DC control loop reads it every tick.
+ *
+ ******************************************************************************
+ */
+
+#ifndef QUADRATUREENCODER_H
+#define QUADRATUREENCODER_H
+
+#include "mbed.h"
+
+class QuadratureEncoder {
+public:
+    virtual ~QuadratureEncoder() {}
+
+    virtual int32_t count() = 0;
+    virtual void reset() = 0;
+};
+
+class InterruptEncoder : public QuadratureEncoder {
+public:
+    InterruptEncoder(PinName a, PinName b);
+
+    int32_t count() override { return _count; }
+    void reset() override;
+
+private:
+    void edge();
+
+    InterruptIn _a;
+    InterruptIn _b;
+    volatile int32_t _count;
+    uint8_t _state;
+};
+
+#if defined(TARGET_STM)
+class TimerEncoder : public QuadratureEncoder {
+public:
+    // a and b on CH1 and CH2 of tim
+    TimerEncoder(TIM_TypeDef *tim, PinName a, PinName b);
+
+    int32_t count() override;
+    void reset() override;
+
+private:
+    TIM_TypeDef *_tim;
+    uint16_t _last;
+    int32_t _count;
+};
+#endif
+
+#endif
@@ -0,0 +1,104 @@
+#include "RampProfile.h"
+
+#include <math.h>
+
+// Integration step used to build S-curve tables (seconds)
+#define SCURVE_DT 0.00001f
+
+static inline uint16_t clampInterval(float us) {
+    if (us < 1.0f) return 1;
+    if (us > 65535.0f) return 65535;
+    return (uint16_t)(us + 0.5f);
+}
+
+RampProfile::RampProfile() : _length(0), _cruise(4000) {}
+
+float RampProfile::configure(float max_speed, float accel, float jerk) {
+
+    if (max_speed <= 0.0f) max_speed = 1.0f;
+    uint32_t cruise = clampInterval(1000000.0f / max_speed);
+
+    if (accel <= 0.0f) {
+        _length = 0;
+        _cruise = cruise;
+        return 1000000.0f / _cruise;
+    }
+
+    if (jerk <= 0.0f) {
+        _length = buildTrapezoid(accel, cruise);
+    } else {
+        _length = buildSCurve(max_speed, accel, jerk, cruise);
+    }
+
+    // Table full before reaching max_speed: cruise at the last ramp rate
+    if (_length == RAMP_TABLE_SIZE && _table[_length - 1] > cruise) {
+        cruise = _table[_length - 1];
+    }
+    _cruise = cruise;
+
+    return 1000000.0f / _cruise;
+}
+
+uint32_t RampProfile::buildTrapezoid(float accel, uint32_t cruise) {
+
+    // t(n) = sqrt(2n / a), in microseconds
+    float k = sqrtf(2.0f / accel) * 1000000.0f;
+    float t_prev = 0.0f;
+
+    for (uint32_t n = 0; n < RAMP_TABLE_SIZE; n++) {
+        float t = k * sqrtf((float)(n + 1));
+        uint16_t dt = clampInterval(t - t_prev);
+        t_prev = t;
+        if (dt <= cruise) return n;
+        _table[n] = dt;
+    }
+    return RAMP_TABLE_SIZE;
+}
+
+uint32_t RampProfile::buildSCurve(float max_speed, float accel, float jerk, uint32_t cruise) {
+
+    // Jerk-limited ramp from rest: a rises at +jerk, holds at accel, then
+    // falls at -jerk so it reaches zero exactly at max_speed.
+    float tj = accel / jerk;
+    float a_peak = accel;
+    if (max_speed < accel * tj) {
+        tj = sqrtf(max_speed / jerk);
+        a_peak = jerk * tj;
+    }
+    float ta = (max_speed - a_peak * tj) / a_peak;
+    if (ta < 0.0f) ta = 0.0f;
+    float t_end = 2.0f * tj + ta;
+
+    float t = 0.0f, v = 0.0f, s = 0.0f;
+    float a = 0.0f;
+    float t_step = 0.0f;
+    uint32_t n = 0;
+
+    while (n < RAMP_TABLE_SIZE && t < t_end) {
+        float t_next = t + SCURVE_DT;
+        float a_next;
+        if (t_next < tj)           a_next = jerk * t_next;
+        else if (t_next < tj + ta) a_next = a_peak;
+        else if (t_next < t_end)   a_next = a_peak - jerk * (t_next - tj - ta);
+        else                       a_next = 0.0f;
+
+        float v_next = v + 0.5f * (a + a_next) * SCURVE_DT;
+        float s_next = s + 0.5f * (v + v_next) * SCURVE_DT;
+
+        // Record every whole step crossed during this slice
+        while (s_next >= (float)(n + 1) && n < RAMP_TABLE_SIZE) {
+            float frac = ((float)(n + 1) - s) / (s_next - s);
+            float t_cross = t + frac * SCURVE_DT;
+            uint16_t dt = clampInterval((t_cross - t_step) * 1000000.0f);
+            t_step = t_cross;
+            if (dt <= cruise) return n;
+            _table[n++] = dt;
+        }
+
+        t = t_next;
+        v = v_next;
+        s = s_next;
+        a = a_next;
+    }
+    return n;
+}
@@ -0,0 +1,59 @@
+/**
+ ******************************************************************************
+ * @file    RampProfile.h
+ * @brief   Precomputed acceleration ramp for stepper moves.
+ ******************************************************************************
+ * @attention
+ *
+ * The ramp is stored as a table of step intervals for accelerating from
+ * rest: entry n is the time between step n and step n+1. A move of any
+ * length uses the same table from both ends (index = min(steps done,
+ * steps left)), so the step interrupt only does a compare and a lookup.
+ *
+ * jerk == 0 gives a trapezoidal profile using the exact AVR446 step times
+ * t(n) = sqrt(2n/a). jerk > 0 gives an S-curve whose acceleration ramps up
+ * and down at the jerk limit.
+ *
+ ******************************************************************************
+ */
+
+#ifndef RAMPPROFILE_H
+#define RAMPPROFILE_H
+
+#include <stdint.h>
+
+// Number of ramp steps kept per profile (2 bytes each)
+#ifndef RAMP_TABLE_SIZE
+#define RAMP_TABLE_SIZE 512
+#endif
+
+class RampProfile {
+public:
+    RampProfile();
+
+    // Speeds in steps/s, accel in steps/s^2, jerk in steps/s^3 (0 = trapezoid).
+    // accel == 0 disables the ramp and runs every step at max_speed.
+    // Returns the reachable top speed, lower than max_speed if the ramp
+    // does not fit in the table.
+    float configure(float max_speed, float accel, float jerk = 0.0f);
+
+    // Interval in microseconds before the next step
+    inline uint32_t interval(uint32_t done, uint32_t remaining) const {
+        uint32_t idx = done < remaining - 1 ? done : remaining - 1;
+        return idx < _length ? _table[idx] : _cruise;
+    }
+
+    uint32_t length() const { return _length; }
+    uint32_t cruiseInterval() const { return _cruise; }
+    uint16_t at(uint32_t idx) const { return idx < _length ? _table[idx] : _cruise; }
+
+private:
+    uint32_t buildTrapezoid(float accel, uint32_t cruise);
+    uint32_t buildSCurve(float max_speed, float accel, float jerk, uint32_t cruise);
+
+    uint16_t _table[RAMP_TABLE_SIZE];
+    uint32_t _length;
+    uint32_t _cruise;
+};
+
+#endif
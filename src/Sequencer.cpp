@@ -0,0 +1,133 @@
+#include "Sequencer.h"
+
+#define SEQ_FLAG_TICK 0x1
+#define SEQ_FLAG_STOP 0x2
+#define SEQ_FLAG_DONE 0x1
+
+struct MidiTable {
+    uint32_t us[128];
+};
+
+// Equal temperament from A4 (note 69), one semitone = 2^(1/12)
+static constexpr MidiTable makeMidiTable() {
+    MidiTable table{};
+    for (int n = 0; n < 128; n++) {
+        double period = 1000000.0 / 440.0;
+        for (int k = n; k > 69; k--) period /= 1.0594630943592953;
+        for (int k = n; k < 69; k++) period *= 1.0594630943592953;
+        table.us[n] = (uint32_t)(period + 0.5);
+    }
+    return table;
+}
+
+static constexpr MidiTable midi_table = makeMidiTable();
+
+uint32_t midiPeriodUs(uint8_t note) {
+    return midi_table.us[note & 0x7F];
+}
+
+Sequencer::Sequencer(Music &voice1, Music &voice2, Music &voice3, Music &voice4)
+    : _thread(osPriorityHigh, sizeof(_stack), _stack, "sequencer"),
+      _events(NULL), _count(0), _next(0), _nextTick(0), _endTick(0), _tickUs(SEQ_DEFAULT_TICK_US),
+      _startUs(0), _ticks(0), _playing(false), _stopping(false),
+      _notes(0), _maxLateUs(0), _totalLateUs(0) {
+
+    _voice[0] = &voice1;
+    _voice[1] = &voice2;
+    _voice[2] = &voice3;
+    _voice[3] = &voice4;
+    _thread.start(callback(this, &Sequencer::run));
+}
+
+bool Sequencer::play(const ScoreEvent *events, uint16_t count, uint32_t tick_us) {
+    if (_playing || !events || !count || !tick_us) return false;
+
+    // Last tick any note or rest still sounds
+    uint32_t start = 0;
+    uint32_t end = 0;
+    for (uint16_t i = 0; i < count; i++) {
+        start += events[i].voiceDelta & SCORE_MAX_DELTA;
+        if (start + events[i].length > end) end = start + events[i].length;
+    }
+
+    _events = events;
+    _count = count;
+    _next = 0;
+    _nextTick = events[0].voiceDelta & SCORE_MAX_DELTA;
+    _endTick = end;
+    _tickUs = tick_us;
+    _ticks = 0;
+    _notes = 0;
+    _maxLateUs = 0;
+    _totalLateUs = 0;
+    _stopping = false;
+    _done.clear(SEQ_FLAG_DONE);
+    _playing = true;
+
+    _startUs = us_ticker_read();
+    _tempo.attach(callback(this, &Sequencer::onTick), std::chrono::microseconds(tick_us));
+    // Notes on tick 0 start now
+    _thread.flags_set(SEQ_FLAG_TICK);
+    return true;
+}
+
+void Sequencer::stop() {
+    if (!_playing) return;
+    _stopping = true;
+    _thread.flags_set(SEQ_FLAG_STOP);
+}
+
+void Sequencer::wait() {
+    if (_playing) _done.wait_any(SEQ_FLAG_DONE);
+}
+
+// Tempo clock interrupt
+void Sequencer::onTick() {
+    _ticks = _ticks + 1;
+    _thread.flags_set(SEQ_FLAG_TICK);
+}
+
+void Sequencer::run() {
+    while (true) {
+        ThisThread::flags_wait_any(SEQ_FLAG_TICK | SEQ_FLAG_STOP);
+        if (!_playing) continue;
+
+        if (_stopping) {
+            finish();
+            continue;
+        }
+
+        uint32_t now = _ticks;
+        startDue(now);
+        if (_next == _count && now >= _endTick) finish();
+    }
+}
+
+// Start every event whose tick has come, measuring how late it is
+void Sequencer::startDue(uint32_t now) {
+    while (_next < _count && _nextTick <= now) {
+        const ScoreEvent &e = _events[_next];
+
+        if (e.note != SCORE_REST && e.length) {
+            uint32_t late = us_ticker_read() - (_startUs + _nextTick * _tickUs);
+            _voice[e.voiceDelta >> 6]->tonePeriod(midiPeriodUs(e.note), e.length * _tickUs);
+
+            _notes++;
+            _totalLateUs += late;
+            if (late > _maxLateUs) _maxLateUs = late;
+        }
+
+        _next++;
+        if (_next < _count) _nextTick += _events[_next].voiceDelta & SCORE_MAX_DELTA;
+    }
+}
+
+// Silence every voice and hand the step pins back to the steppers
+void Sequencer::finish() {
+    _tempo.detach();
+    for (int i = 0; i < SEQ_VOICES; i++) {
+        _voice[i]->release();
+    }
+    _playing = false;
+    _done.set(SEQ_FLAG_DONE);
+}
@@ -0,0 +1,110 @@
+/**
+ ******************************************************************************
+ * @file    Sequencer.h
+ * @brief   Multi-voice song player on the stepper step pins.
+ ******************************************************************************
+ * @attention
+ *
+ * A score is an array of 3-byte events in start order:
+ *
+ *  byte  bits   field
+ *  0     7..0   MIDI note, 0 = rest
+ *  1     7..6   voice (stepper 1-4 as 0-3)
+ *        5..0   delta: ticks from the previous event's start (0 - 63)
+ *  2     7..0   length in ticks
+ *
+ * Events with delta 0 start together, which is how chords and several
+ * voices are written. Longer gaps are chained rests. The tick length is
+ * given when the score is played, so one table plays at any tempo.
+ *
+ * One Ticker is the tempo clock for every voice. Note times come from the
+ * tick count, never from summed sleeps, so the song cannot drift. Each
+ * note is a Music tone whose Timeout ends it, so the sequencer thread only
+ * starts notes. lateUs() is how far behind its tick a note actually
+ * started.
+ *
+ ******************************************************************************
+ */
+
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+#include "mbed.h"
+#include "VMShield.h"
+
+#define SEQ_VOICES 4
+// 776 B measured on the host playing the built-in songs from main.cpp
+#ifndef SEQ_THREAD_STACK
+#define SEQ_THREAD_STACK 1280
+#endif
+#define SCORE_REST 0
+#define SCORE_MAX_DELTA 63
+
+#ifndef SEQ_DEFAULT_TICK_US
+#define SEQ_DEFAULT_TICK_US 10000
+#endif
+
+struct ScoreEvent {
+    uint8_t note;
+    uint8_t voiceDelta;
+    uint8_t length;
+};
+
+static_assert(sizeof(ScoreEvent) == 3, "score events are 3 bytes");
+
+constexpr ScoreEvent scoreNote(uint8_t voice, uint8_t delta, uint8_t note, uint8_t length) {
+    return ScoreEvent{ note, (uint8_t)((voice << 6) | (delta & SCORE_MAX_DELTA)), length };
+}
+
+// Step period of every MIDI note in microseconds, A4 = 440 Hz
+uint32_t midiPeriodUs(uint8_t note);
+
+class Sequencer {
+public:
+    Sequencer(Music &voice1, Music &voice2, Music &voice3, Music &voice4);
+
+    // Start a score; false if one is already playing
+    bool play(const ScoreEvent *events, uint16_t count, uint32_t tick_us = SEQ_DEFAULT_TICK_US);
+    void stop();
+    bool isPlaying() const { return _playing; }
+    // Sleep until the score has finished or was stopped
+    void wait();
+
+    // Timing of the last score
+    uint32_t notes() const { return _notes; }
+    uint32_t maxLateUs() const { return _maxLateUs; }
+    uint32_t avgLateUs() const { return _notes ? _totalLateUs / _notes : 0; }
+    // Ticks the score spans
+    uint32_t lengthTicks() const { return _endTick; }
+
+    const Thread &thread() const { return _thread; }
+
+private:
+    void onTick();
+    void run();
+    void startDue(uint32_t now);
+    void finish();
+
+    Music *_voice[SEQ_VOICES];
+    MBED_ALIGN(8) unsigned char _stack[SEQ_THREAD_STACK];
+    Thread _thread;
+    Ticker _tempo;
+    EventFlags _done;
+
+    const ScoreEvent *_events;
+    uint16_t _count;
+    uint16_t _next;
+    uint32_t _nextTick;         // start tick of _events[_next]
+    uint32_t _endTick;
+    uint32_t _tickUs;
+    uint32_t _startUs;
+    volatile uint32_t _ticks;
+    volatile bool _playing;
+    volatile bool _stopping;
+
+    uint32_t _notes;
+    uint32_t _maxLateUs;
+    uint64_t _totalLateUs;
+};
+
+#endif
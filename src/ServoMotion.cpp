@@ -0,0 +1,182 @@
+#include "ServoMotion.h"
+
+#define SERVO_FLAG_WAKE 0x1
+
+static const Kernel::Clock::duration SERVO_FRAME = std::chrono::milliseconds(1000 / SERVO_FRAME_HZ);
+
+static uint32_t isqrt(uint64_t v) {
+    uint64_t root = 0;
+    uint64_t bit = 1ull << 62;
+    while (bit > v) bit >>= 2;
+    while (bit) {
+        if (v >= root + bit) {
+            v -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)root;
+}
+
+ServoMotion::ServoMotion(Servo &servo)
+    : _servo(servo), _thread(osPriorityAboveNormal, sizeof(_stack), _stack, "servo_motion"),
+      _frames(0), _overruns(0) {
+
+    memset(_ch, 0, sizeof(_ch));
+    for (int ch = 0; ch < PCA9685_CHANNELS; ch++) {
+        _ch[ch].maxVel = (SERVO_DEFAULT_SPEED << 8) / SERVO_FRAME_HZ;
+        _ch[ch].accel = (SERVO_DEFAULT_ACCEL << 8) / (SERVO_FRAME_HZ * SERVO_FRAME_HZ);
+    }
+    _thread.start(callback(this, &ServoMotion::run));
+}
+
+void ServoMotion::setLimits(uint8_t ch, uint32_t max_speed, uint32_t accel) {
+    if (ch >= PCA9685_CHANNELS) return;
+
+    int32_t vel = ((uint64_t)max_speed << 8) / SERVO_FRAME_HZ;
+    int32_t acc = ((uint64_t)accel << 8) / (SERVO_FRAME_HZ * SERVO_FRAME_HZ);
+
+    _lock.lock();
+    _ch[ch].maxVel = vel > 0 ? vel : 1;
+    _ch[ch].accel = acc > 0 ? acc : 1;
+    _lock.unlock();
+}
+
+void ServoMotion::moveTo(uint8_t ch, int32_t centidegrees) {
+    if (ch >= PCA9685_CHANNELS) return;
+    if (centidegrees < 0) centidegrees = 0;
+    if (centidegrees > SERVO_MAX_ANGLE) centidegrees = SERVO_MAX_ANGLE;
+
+    _lock.lock();
+    Channel &c = _ch[ch];
+    c.target = centidegrees << 8;
+    if (!c.known) {
+        c.pos = c.target;
+        c.vel = 0;
+        c.known = true;
+    }
+    c.moving = true;
+    _lock.unlock();
+
+    _thread.flags_set(SERVO_FLAG_WAKE);
+}
+
+// Come to rest as quickly as the acceleration limit allows
+void ServoMotion::stop(uint8_t ch) {
+    if (ch >= PCA9685_CHANNELS) return;
+
+    _lock.lock();
+    Channel &c = _ch[ch];
+    if (c.moving) {
+        int32_t brake = (int32_t)(((int64_t)c.vel * c.vel) / (2 * c.accel));
+        int32_t target = c.pos + (c.vel < 0 ? -brake : brake);
+        if (target < 0) target = 0;
+        if (target > (SERVO_MAX_ANGLE << 8)) target = SERVO_MAX_ANGLE << 8;
+        c.target = target;
+    }
+    _lock.unlock();
+}
+
+void ServoMotion::stopAll() {
+    for (int ch = 0; ch < PCA9685_CHANNELS; ch++) {
+        stop(ch);
+    }
+}
+
+bool ServoMotion::isMoving(uint8_t ch) {
+    if (ch >= PCA9685_CHANNELS) return false;
+    _lock.lock();
+    bool moving = _ch[ch].moving;
+    _lock.unlock();
+    return moving;
+}
+
+bool ServoMotion::isIdle() {
+    _lock.lock();
+    bool idle = true;
+    for (int ch = 0; ch < PCA9685_CHANNELS && idle; ch++) {
+        idle = !_ch[ch].moving;
+    }
+    _lock.unlock();
+    return idle;
+}
+
+int32_t ServoMotion::position(uint8_t ch) {
+    if (ch >= PCA9685_CHANNELS) return 0;
+    _lock.lock();
+    int32_t pos = (_ch[ch].pos + 128) >> 8;
+    _lock.unlock();
+    return pos;
+}
+
+// One frame of a trapezoidal move: accelerate towards the speed limit,
+// capped by the speed from which the channel can still stop at the target
+void ServoMotion::advance(Channel &c) {
+    int32_t err = c.target - c.pos;
+    if (err == 0 && c.vel == 0) {
+        c.moving = false;
+        return;
+    }
+
+    int32_t dir = err >= 0 ? 1 : -1;
+    int32_t limit = isqrt(2ull * c.accel * (uint32_t)(err * dir));
+    if (limit > c.maxVel) limit = c.maxVel;
+    int32_t want = limit * dir;
+
+    if (c.vel < want) {
+        c.vel = c.vel + c.accel < want ? c.vel + c.accel : want;
+    } else {
+        c.vel = c.vel - c.accel > want ? c.vel - c.accel : want;
+    }
+
+    int32_t next = c.pos + c.vel;
+    if ((dir > 0 && next >= c.target) || (dir < 0 && next <= c.target)) {
+        c.pos = c.target;
+        c.vel = 0;
+    } else {
+        c.pos = next;
+    }
+}
+
+// Frame thread: step every moving channel, then send them all at once
+void ServoMotion::run() {
+    Kernel::Clock::time_point next = Kernel::Clock::now();
+    uint32_t stamp;
+    TimingStats::stamp(stamp);
+
+    while (true) {
+        bool moving = false;
+
+        _lock.lock();
+        for (int ch = 0; ch < PCA9685_CHANNELS; ch++) {
+            Channel &c = _ch[ch];
+            if (!c.moving) continue;
+            advance(c);
+            _servo.stageAngle(ch, (c.pos + 128) >> 8);
+            moving |= c.moving;
+        }
+        _lock.unlock();
+
+        _servo.flush();
+        _frames++;
+
+        if (!moving) {
+            // Nothing left to move: sleep until the next moveTo()
+            ThisThread::flags_wait_any(SERVO_FLAG_WAKE);
+            next = Kernel::Clock::now();
+            TimingStats::stamp(stamp);
+            continue;
+        }
+
+        next += SERVO_FRAME;
+        Kernel::Clock::time_point now = Kernel::Clock::now();
+        if (now > next) {
+            _overruns++;
+            next = now;
+        }
+        ThisThread::sleep_until(next);
+        servoTiming.period(stamp, 1000000000 / SERVO_FRAME_HZ);
+    }
+}
@@ -0,0 +1,89 @@
+/**
+ ******************************************************************************
+ * @file    ServoMotion.h
+ * @brief   Per-channel servo trajectories, updated once per PWM frame.
+ ******************************************************************************
+ * @attention
+ *
+ * The PCA9685 only takes a new pulse width at the start of each 20 ms
+ * frame, so writing it more often than that is wasted bus time. Every
+ * channel instead holds a target, a speed limit and an acceleration
+ * limit, and one thread advances all moving channels once per frame and
+ * sends them with a single flush() of the shadow registers.
+ *
+ * Angles are in hundredths of a degree (0 - 18000), speeds in
+ * centidegrees/s and accelerations in centidegrees/s^2. The trajectory is
+ * integer only: positions and velocities are kept in 1/256 centidegree
+ * per frame.
+ *
+ ******************************************************************************
+ */
+
+#ifndef SERVOMOTION_H
+#define SERVOMOTION_H
+
+#include "mbed.h"
+#include "VMShield.h"
+#include "TimingProbe.h"
+
+// Matches the 50 Hz PWM frame the chip is programmed for
+#ifndef SERVO_FRAME_HZ
+#define SERVO_FRAME_HZ 50
+#endif
+
+// 760 B measured on the host during six-channel moves
+#ifndef SERVO_THREAD_STACK
+#define SERVO_THREAD_STACK 1280
+#endif
+
+#define SERVO_MAX_ANGLE 18000
+#define SERVO_DEFAULT_SPEED 36000   // 360 deg/s
+#define SERVO_DEFAULT_ACCEL 180000  // full speed in 0.2 s
+
+class ServoMotion {
+public:
+    ServoMotion(Servo &servo);
+
+    void setLimits(uint8_t ch, uint32_t max_speed, uint32_t accel);
+
+    // Ramp to an angle. A channel that has never been positioned jumps
+    // straight there, since its current angle is unknown.
+    void moveTo(uint8_t ch, int32_t centidegrees);
+    // Hold the current angle
+    void stop(uint8_t ch);
+    void stopAll();
+
+    bool isMoving(uint8_t ch);
+    bool isIdle();
+    int32_t position(uint8_t ch);
+
+    uint32_t frames() const { return _frames; }
+    uint32_t overruns() const { return _overruns; }
+
+    const Thread &thread() const { return _thread; }
+
+private:
+    struct Channel {
+        int32_t pos;        // Q8 centidegrees
+        int32_t vel;        // Q8 centidegrees per frame
+        int32_t target;     // Q8 centidegrees
+        int32_t maxVel;     // Q8 centidegrees per frame
+        int32_t accel;      // Q8 centidegrees per frame^2
+        bool moving;
+        bool known;
+    };
+
+    void run();
+    void advance(Channel &c);
+
+    Servo &_servo;
+    Channel _ch[PCA9685_CHANNELS];
+    Mutex _lock;
+    MBED_ALIGN(8) unsigned char _stack[SERVO_THREAD_STACK];
+    Thread _thread;
+
+    uint32_t _frames;
+    uint32_t _overruns;
+};
+
+#endif
@@ -0,0 +1,167 @@
+/**
+ ******************************************************************************
+ * @file    Songs.h
+ * @brief   Built-in scores for the Sequencer.
+ ******************************************************************************
+ * @attention
+ *
+ * Converted from the playNote() calls the music demo used to make, at
+ * 10 ms per tick: voice, delta ticks, MIDI note, length ticks. A note
+ * lasted pulseCount / frequency; the rest after it is part of the next
+ * event's delta.
+ *
+ ******************************************************************************
+ */
+
+#ifndef SONGS_H
+#define SONGS_H
+
+#include "Sequencer.h"
+
+#define SONG_TICK_US 10000
+
+// Voices with a step pin whose timer DC and BLDC leave free (main.cpp):
+// stepper 4 (PB_10, TIM2) and stepper 2 (PB_6, TIM4)
+#define SONG_MELODY 3
+#define SONG_BASS 1
+
+struct Song {
+    const char *name;
+    const ScoreEvent *events;
+    uint16_t count;
+};
+
+// Pirates of Caribbean
+static constexpr ScoreEvent SONG_PIRATES[] = {
+    scoreNote(SONG_MELODY,  2,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 39,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 39,  57, 45),   // A3
+    scoreNote(SONG_MELODY, 46,  60, 38),   // C4
+    scoreNote(SONG_MELODY, 38,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 35,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 35,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 30,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 30,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 30,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 28,  67, 26),   // G4
+    scoreNote(SONG_MELODY, 26,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 31,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 31,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  60, 38),   // C4
+    scoreNote(SONG_MELODY, 39,  60, 38),   // C4
+    scoreNote(SONG_MELODY, 38,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 38,  57, 45),   // A3
+    scoreNote(SONG_MELODY, 45,  60, 38),   // C4
+    scoreNote(SONG_MELODY, 39,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 35,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 35,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 30,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 30,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 29,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 29,  67, 26),   // G4
+    scoreNote(SONG_MELODY, 26,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 31,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 31,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  60, 38),   // C4
+    scoreNote(SONG_MELODY, 38,  60, 38),   // C4
+    scoreNote(SONG_MELODY, 39,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 38,  57, 45),   // A3
+    scoreNote(SONG_MELODY, 45,  60, 38),   // C4
+    scoreNote(SONG_MELODY, 38,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 35,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 36,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 28,  67, 26),   // G4
+    scoreNote(SONG_MELODY, 27,  67, 26),   // G4
+    scoreNote(SONG_MELODY, 26,  67, 26),   // G4
+    scoreNote(SONG_MELODY, 26,  69, 23),   // A4
+    scoreNote(SONG_MELODY, 22,  70, 21),   // A#4
+    scoreNote(SONG_MELODY, 23,  70, 21),   // A#4
+    scoreNote(SONG_MELODY, 22,  69, 23),   // A4
+    scoreNote(SONG_MELODY, 23,  67, 26),   // G4
+    scoreNote(SONG_MELODY, 26,  69, 23),   // A4
+    scoreNote(SONG_MELODY, 22,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 35,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 31,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 28,  67, 26),   // G4
+    scoreNote(SONG_MELODY, 26,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 29,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 30,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 29,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 30,  69, 23),   // A4
+    scoreNote(SONG_MELODY, 23,  60, 38),   // C4
+    scoreNote(SONG_MELODY, 38,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 30,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 29,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 29,  65, 29),   // F4
+    scoreNote(SONG_MELODY, 28,  67, 26),   // G4
+    scoreNote(SONG_MELODY, 26,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 30,  64, 30),   // E4
+    scoreNote(SONG_MELODY, 31,  62, 34),   // D4
+    scoreNote(SONG_MELODY, 34,  60, 38),   // C4
+    scoreNote(SONG_MELODY, 38,  62, 34),   // D4
+};
+
+// Beethoven, Fur Elise, with a bass line
+static constexpr ScoreEvent SONG_ELISE[] = {
+    scoreNote(SONG_MELODY,  0,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 24,  63, 26),   // D#4
+    scoreNote(SONG_MELODY, 26,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 24,  63, 26),   // D#4
+    scoreNote(SONG_MELODY, 26,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 24,  59, 32),   // B3
+    scoreNote(SONG_MELODY, 33,  62, 27),   // D4
+    scoreNote(SONG_MELODY, 27,  60, 31),   // C4
+    scoreNote(SONG_MELODY, 30,  57, 59),   // A3
+    scoreNote(SONG_BASS,    0,  45, 59),   // A2
+    scoreNote(SONG_MELODY, 63,   0,  0),   // rest
+    scoreNote(SONG_MELODY,  3,  60, 31),   // C4
+    scoreNote(SONG_MELODY, 30,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 24,  57, 36),   // A3
+    scoreNote(SONG_MELODY, 37,  59, 53),   // B3
+    scoreNote(SONG_BASS,    0,  40, 53),   // E2
+    scoreNote(SONG_MELODY, 58,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 25,  57, 36),   // A3
+    scoreNote(SONG_MELODY, 36,  59, 32),   // B3
+    scoreNote(SONG_MELODY, 32,  60, 50),   // C4
+    scoreNote(SONG_BASS,    0,  45, 50),   // A2
+    scoreNote(SONG_MELODY, 56,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 24,  63, 26),   // D#4
+    scoreNote(SONG_MELODY, 26,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 24,  63, 26),   // D#4
+    scoreNote(SONG_MELODY, 26,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 24,  59, 32),   // B3
+    scoreNote(SONG_MELODY, 33,  62, 27),   // D4
+    scoreNote(SONG_MELODY, 27,  60, 31),   // C4
+    scoreNote(SONG_MELODY, 31,  57, 59),   // A3
+    scoreNote(SONG_BASS,    0,  45, 59),   // A2
+    scoreNote(SONG_MELODY, 63,   0,  0),   // rest
+    scoreNote(SONG_MELODY,  2,  60, 31),   // C4
+    scoreNote(SONG_MELODY, 30,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 25,  57, 36),   // A3
+    scoreNote(SONG_MELODY, 36,  59, 53),   // B3
+    scoreNote(SONG_BASS,    0,  40, 53),   // E2
+    scoreNote(SONG_MELODY, 59,  64, 24),   // E4
+    scoreNote(SONG_MELODY, 24,  60, 31),   // C4
+    scoreNote(SONG_MELODY, 30,  59, 32),   // B3
+    scoreNote(SONG_MELODY, 33,  57, 59),   // A3
+    scoreNote(SONG_BASS,    0,  45, 59),   // A2
+};
+
+static const Song SONGS[] = {
+    { "pirates", SONG_PIRATES, sizeof(SONG_PIRATES) / sizeof(ScoreEvent) },
+    { "elise", SONG_ELISE, sizeof(SONG_ELISE) / sizeof(ScoreEvent) },
+};
+
+#define SONG_COUNT (sizeof(SONGS) / sizeof(SONGS[0]))
+
+#endif
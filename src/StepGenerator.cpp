@@ -0,0 +1,354 @@
+#include "StepGenerator.h"
+
+/* MBED TIMER BACKEND */
+uint32_t TickerStepTimer::now() {
+    return us_ticker_read();
+}
+
+void TickerStepTimer::schedule(uint32_t delay_us) {
+    _timeout.attach(_handler, std::chrono::microseconds(delay_us));
+}
+
+void TickerStepTimer::cancel() {
+    _timeout.detach();
+}
+
+/* STEP GENERATOR */
+static inline uint32_t clampInterval(uint32_t us) {
+    return us < STEP_MIN_INTERVAL_US ? STEP_MIN_INTERVAL_US : us;
+}
+
+StepGenerator::StepGenerator(StepTimer &timer) : _timer(timer), _high(0), _dirPending(0), _dirLevel(0) {
+    memset(_ch, 0, sizeof(_ch));
+    memset(&_lin, 0, sizeof(_lin));
+    memset(_lowAt, 0, sizeof(_lowAt));
+    _timer.attach(callback(this, &StepGenerator::service));
+}
+
+void StepGenerator::attachChannel(int ch, DigitalOut *step, DigitalOut *dir) {
+    if (ch < 0 || ch >= STEP_CHANNELS) return;
+    _ch[ch].step = step;
+    _ch[ch].dir = dir;
+}
+
+bool StepGenerator::move(int ch, int dir, uint32_t steps, uint32_t interval_us) {
+    return start(ch, dir, steps, interval_us ? interval_us : 1, NULL);
+}
+
+bool StepGenerator::move(int ch, int dir, uint32_t steps, const RampProfile &profile) {
+    return start(ch, dir, steps, 0, &profile);
+}
+
+bool StepGenerator::start(int ch, int dir, uint32_t steps, uint32_t interval_us, const RampProfile *profile) {
+    if (ch < 0 || ch >= STEP_CHANNELS || !_ch[ch].step) return false;
+
+    // Checked and claimed in one go, so two callers cannot both start the
+    // channel or flip its direction under a running move
+    CriticalSectionLock lock;
+    if (_ch[ch].remaining || isLinearAxis(ch)) return false;
+    if (steps == 0) return true;
+
+    // Direction is latched now (or when the last pulse ends), the first
+    // step follows one interval later
+    setDir(ch, dir);
+
+    Channel &c = _ch[ch];
+    uint32_t now = _timer.now();
+    c.profile = profile;
+    c.interval = clampInterval(interval_us);
+    c.done = 0;
+    c.period = profile ? clampInterval(profile->interval(0, steps)) : c.interval;
+    c.next = now + c.period;
+    c.remaining = steps;
+    TimingStats::stamp(c.stamp);
+    reschedule(now);
+    return true;
+}
+
+void StepGenerator::stop(int ch) {
+    if (ch < 0 || ch >= STEP_CHANNELS) return;
+
+    CriticalSectionLock lock;
+    bool aborted = isLinearAxis(ch);
+    _ch[ch].remaining = 0;
+    if (aborted) _lin.remaining = 0;
+    reschedule(_timer.now());
+    if (aborted && _abort) _abort();
+}
+
+bool StepGenerator::moveLinear(const int32_t delta[STEP_CHANNELS], uint32_t interval_us) {
+    LinearSegment seg = { { 0 }, 0, 0, UINT32_MAX, NULL };
+    memcpy(seg.delta, delta, sizeof(seg.delta));
+    return startLinear(seg, interval_us ? interval_us : 1);
+}
+
+bool StepGenerator::moveLinear(const int32_t delta[STEP_CHANNELS], const RampProfile &profile) {
+    LinearSegment seg = { { 0 }, 0, 0, UINT32_MAX, &profile };
+    memcpy(seg.delta, delta, sizeof(seg.delta));
+    return startLinear(seg, 0);
+}
+
+bool StepGenerator::moveSegment(const LinearSegment &seg) {
+    return startLinear(seg, 0);
+}
+
+bool StepGenerator::startLinear(const LinearSegment &seg, uint32_t interval_us) {
+    CriticalSectionLock lock;
+    if (_lin.remaining || !axesFree(seg)) return false;
+
+    bool empty = true;
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        if (seg.delta[i]) empty = false;
+    }
+    if (empty) return true;
+
+    uint32_t now = _timer.now();
+    loadLinear(seg, interval_us, now);
+    TimingStats::stamp(_lin.stamp);
+    reschedule(now);
+    return true;
+}
+
+// Caller holds the critical section or runs in the timer interrupt
+void StepGenerator::loadLinear(const LinearSegment &seg, uint32_t interval_us, uint32_t now) {
+    uint32_t ticks = 0;
+    _lin.mask = 0;
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        // Negated unsigned, so INT32_MIN does not overflow
+        uint32_t d = seg.delta[i] < 0 ? 0u - (uint32_t)seg.delta[i] : seg.delta[i];
+        _lin.delta[i] = d;
+        if (!d) continue;
+        if (d > ticks) ticks = d;
+        _lin.mask |= 1u << i;
+        setDir(i, seg.delta[i] > 0);
+    }
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        // From zero, an axis with d steps steps at the end of each 1/d of
+        // the move, so its last step falls on the final tick
+        _lin.error[i] = 0;
+    }
+    _lin.ticks = ticks;
+    _lin.profile = seg.profile;
+    _lin.interval = interval_us;
+    _lin.entry = seg.entry;
+    _lin.exit = seg.exit;
+    _lin.cruise = seg.cruise;
+    _lin.done = 0;
+    _lin.remaining = ticks;
+    _lin.period = linearInterval();
+    _lin.next = now + _lin.period;
+}
+
+// Every axis of the segment is attached and not running a single move
+bool StepGenerator::axesFree(const LinearSegment &seg) const {
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        if (seg.delta[i] == 0) continue;
+        if (!_ch[i].step || _ch[i].remaining) return false;
+    }
+    return true;
+}
+
+// A direction change waits while the step pin is still high, so DIR is
+// steady for the whole pulse; service() writes it when the pulse ends
+void StepGenerator::setDir(int ch, int level) {
+    uint32_t bit = 1u << ch;
+    if (_high & bit) {
+        _dirPending |= bit;
+        if (level) _dirLevel |= bit;
+        else _dirLevel &= ~bit;
+        return;
+    }
+    _dirPending &= ~bit;
+    _ch[ch].dir->write(level);
+}
+
+inline uint32_t StepGenerator::linearInterval() const {
+    if (!_lin.profile) return clampInterval(_lin.interval);
+
+    uint32_t idx = _lin.entry + _lin.done;
+    uint32_t decel = _lin.exit + _lin.remaining - 1;
+    if (decel < idx) idx = decel;
+    if (_lin.cruise < idx) idx = _lin.cruise;
+    return clampInterval(_lin.profile->at(idx));
+}
+
+uint32_t StepGenerator::raiseLinearExit(uint32_t exit) {
+    CriticalSectionLock lock;
+    if (!_lin.remaining || !_lin.profile) return 0;
+
+    uint32_t idx = _lin.entry + _lin.done;
+    if (_lin.cruise < idx) idx = _lin.cruise;
+    uint32_t decel = _lin.exit + _lin.remaining - 1;
+
+    // Already slowing down: raising the exit would jump the speed up
+    if (exit > _lin.exit && decel >= idx) {
+        _lin.exit = exit;
+    }
+
+    // Speed at the last step is bounded by all three branches
+    uint32_t end = _lin.entry + _lin.done + _lin.remaining - 1;
+    if (_lin.exit < end) end = _lin.exit;
+    if (_lin.cruise < end) end = _lin.cruise;
+    return end;
+}
+
+void StepGenerator::stopLinear() {
+    CriticalSectionLock lock;
+    bool aborted = _lin.remaining != 0;
+    _lin.remaining = 0;
+    reschedule(_timer.now());
+    if (aborted && _abort) _abort();
+}
+
+bool StepGenerator::isBusy(int ch) const {
+    if (ch < 0 || ch >= STEP_CHANNELS) return false;
+    return _ch[ch].remaining != 0 || isLinearAxis(ch);
+}
+
+bool StepGenerator::isLinearAxis(int ch) const {
+    if (ch < 0 || ch >= STEP_CHANNELS) return false;
+    return _lin.remaining && (_lin.mask & (1u << ch));
+}
+
+uint32_t StepGenerator::stepsRemaining(int ch) const {
+    if (ch < 0 || ch >= STEP_CHANNELS) return 0;
+    return _ch[ch].remaining;
+}
+
+// Timer interrupt: end the previous pulses, pulse every due channel,
+// then re-arm for whichever comes first, the pulse end or the next step
+void StepGenerator::service() {
+    uint32_t now = _timer.now();
+    uint32_t due = 0;
+    uint32_t pulsed = 0;
+
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        if ((_high & (1u << i)) && (int32_t)(_lowAt[i] - now) <= 0) {
+            _ch[i].step->write(0);
+            _high &= ~(1u << i);
+            if (_dirPending & (1u << i)) {
+                _ch[i].dir->write((_dirLevel & (1u << i)) != 0);
+                _dirPending &= ~(1u << i);
+                // Direction setup: the next step on this axis waits one
+                // pulse width after the change
+                uint32_t setup = now + STEP_PULSE_US;
+                if (_ch[i].remaining && (int32_t)(_ch[i].next - setup) < 0) _ch[i].next = setup;
+                if (_lin.remaining && (_lin.mask & (1u << i)) && (int32_t)(_lin.next - setup) < 0) _lin.next = setup;
+            }
+        }
+    }
+    bool linear = _lin.remaining && (int32_t)(_lin.next - now) <= 0;
+
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        Channel &c = _ch[i];
+        if (c.remaining && (int32_t)(c.next - now) <= 0) {
+            due |= 1u << i;
+        }
+    }
+
+    // DDA: the longest axis steps on every tick, the others when their
+    // error term overflows
+    if (linear) {
+        for (int i = 0; i < STEP_CHANNELS; i++) {
+            if (!(_lin.mask & (1u << i))) continue;
+            _lin.error[i] += _lin.delta[i];
+            if (_lin.error[i] >= _lin.ticks) {
+                _lin.error[i] -= _lin.ticks;
+                pulsed |= 1u << i;
+            }
+        }
+    }
+    pulsed |= due;
+
+    if (pulsed) {
+        for (int i = 0; i < STEP_CHANNELS; i++) {
+            if (!(pulsed & (1u << i))) continue;
+            _ch[i].step->write(1);
+            _lowAt[i] = now + STEP_PULSE_US;
+        }
+        // Single moves per channel, coordinated ones per major axis tick
+        for (int i = 0; i < STEP_CHANNELS; i++) {
+            if (due & (1u << i)) stepTiming.period(_ch[i].stamp, _ch[i].period * 1000);
+        }
+        if (linear) stepTiming.period(_lin.stamp, _lin.period * 1000);
+        _high |= pulsed;
+    }
+
+    uint32_t finished = 0;
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        if (!(due & (1u << i))) continue;
+        Channel &c = _ch[i];
+        c.done++;
+        if (--c.remaining == 0) {
+            finished |= 1u << i;
+            continue;
+        }
+        uint32_t interval = c.profile ? clampInterval(c.profile->interval(c.done, c.remaining)) : c.interval;
+        c.period = interval;
+        c.next += interval;
+        // Never burst to catch up after a late interrupt, nor cut the
+        // low time of this pulse short
+        if ((int32_t)(c.next - now) < STEP_MIN_INTERVAL_US) c.next = now + interval;
+    }
+
+    bool linear_done = false;
+    bool refused = false;
+    if (linear) {
+        _lin.done++;
+        if (--_lin.remaining == 0) {
+            // Chain the next queued block on the same timebase. If a single
+            // move holds one of its axes, the queue is dropped as on a stop
+            // of that axis rather than stepping under the other move.
+            linear_done = true;
+            LinearSegment seg;
+            if (_next && _next(seg)) {
+                if (axesFree(seg)) loadLinear(seg, 0, now);
+                else refused = true;
+            }
+        } else {
+            uint32_t interval = linearInterval();
+            _lin.period = interval;
+            _lin.next += interval;
+            if ((int32_t)(_lin.next - now) < STEP_MIN_INTERVAL_US) _lin.next = now + interval;
+        }
+    }
+
+    reschedule(_timer.now());
+
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        if ((finished & (1u << i)) && _done) _done(i);
+    }
+    // Every segment completes, so a direct moveLinear() that a queued
+    // block chained onto still wakes its caller
+    if (linear_done && _done) _done(STEP_LINEAR);
+    if (refused && _abort) _abort();
+}
+
+void StepGenerator::reschedule(uint32_t now) {
+    bool active = false;
+    int32_t wait = INT32_MAX;
+
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        if (!_ch[i].remaining) continue;
+        int32_t delta = (int32_t)(_ch[i].next - now);
+        if (delta < wait) wait = delta;
+        active = true;
+    }
+    if (_lin.remaining) {
+        int32_t delta = (int32_t)(_lin.next - now);
+        if (delta < wait) wait = delta;
+        active = true;
+    }
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        if (!(_high & (1u << i))) continue;
+        int32_t delta = (int32_t)(_lowAt[i] - now);
+        if (delta < wait) wait = delta;
+        active = true;
+    }
+
+    if (!active) {
+        _timer.cancel();
+        return;
+    }
+    _timer.schedule(wait > 0 ? (uint32_t)wait : 1);
+}
@@ -0,0 +1,175 @@
+/**
+ ******************************************************************************
+ * @file    StepGenerator.h
+ * @brief   Timer interrupt driven step pulse engine for the four stepper
+ *          channels of the VMShield.
+ ******************************************************************************
+ * @attention
+ *
+ * One timer serves all channels: every interrupt pulses the channels whose
+ * next step is due and re-arms the timer for the earliest pending step, so
+ * each channel runs at its own rate (up to tens of kHz) without a thread
+ * blocking for the length of the move.
+ *
+ * The timer is reached through the StepTimer interface so the engine can be
+ * driven by a mock timer on the host.
+ *
+ ******************************************************************************
+ */
+
+#ifndef STEPGENERATOR_H
+#define STEPGENERATOR_H
+
+#include "mbed.h"
+#include "RampProfile.h"
+#include "TimingProbe.h"
+
+#define STEP_CHANNELS 4
+
+// Channel number reported on completion of a coordinated move
+#define STEP_LINEAR -1
+
+// Minimum high time of a step pulse (A4988 needs 1 us, DRV8825 1.9 us).
+// The pulse is ended by the next timer compare, so the low time is kept
+// at least as long and steps are never closer than STEP_MIN_INTERVAL_US.
+#ifndef STEP_PULSE_NS
+#define STEP_PULSE_NS 2000
+#endif
+#define STEP_PULSE_US ((STEP_PULSE_NS + 999) / 1000)
+#define STEP_MIN_INTERVAL_US (2 * STEP_PULSE_US)
+
+// One block of a streamed coordinated move. entry, exit and cruise are
+// positions in the ramp table, so the block starts at the ramp speed of
+// entry, ends at the speed of exit and never exceeds the speed of cruise.
+struct LinearSegment {
+    int32_t delta[STEP_CHANNELS];
+    uint32_t entry;
+    uint32_t exit;
+    uint32_t cruise;
+    const RampProfile *profile;
+};
+
+// One-shot microsecond timer used by the step generator
+class StepTimer {
+public:
+    virtual ~StepTimer() {}
+
+    // Free running microsecond counter
+    virtual uint32_t now() = 0;
+    // Call the attached handler once, delay_us from now
+    virtual void schedule(uint32_t delay_us) = 0;
+    virtual void cancel() = 0;
+
+    void attach(Callback<void()> handler) { _handler = handler; }
+
+protected:
+    Callback<void()> _handler;
+};
+
+// StepTimer backed by the mbed us_ticker
+class TickerStepTimer : public StepTimer {
+public:
+    uint32_t now() override;
+    void schedule(uint32_t delay_us) override;
+    void cancel() override;
+
+private:
+    Timeout _timeout;
+};
+
+class StepGenerator {
+public:
+    StepGenerator(StepTimer &timer);
+
+    void attachChannel(int ch, DigitalOut *step, DigitalOut *dir);
+
+    // Start a move and return immediately, false if the channel is busy
+    bool move(int ch, int dir, uint32_t steps, uint32_t interval_us);
+    // Same, with step intervals taken from an acceleration ramp
+    bool move(int ch, int dir, uint32_t steps, const RampProfile &profile);
+    void stop(int ch);
+
+    // Coordinated move on all channels with a non-zero delta (sign = direction).
+    // The longest axis is paced by interval_us or the ramp and the others
+    // are interleaved with a Bresenham DDA, so every axis makes its last
+    // step on the final tick.
+    bool moveLinear(const int32_t delta[STEP_CHANNELS], uint32_t interval_us);
+    bool moveLinear(const int32_t delta[STEP_CHANNELS], const RampProfile &profile);
+    bool moveSegment(const LinearSegment &seg);
+    // Stopping any of its axes with stop() ends a coordinated move too
+    void stopLinear();
+    bool isLinearBusy() const { return _lin.remaining != 0; }
+
+    // Let the running block end faster if it has not started slowing down.
+    // Returns the ramp position it will now end at.
+    uint32_t raiseLinearExit(uint32_t exit);
+
+    // Asked from interrupt context for the next block when a coordinated
+    // move ends; returning true chains it without stopping. A block whose
+    // axes are busy with single moves is refused through onLinearAbort().
+    void onLinearNext(Callback<bool(LinearSegment &)> next) { _next = next; }
+    // Called with interrupts off when a coordinated move is stopped early
+    void onLinearAbort(Callback<void()> abort) { _abort = abort; }
+
+    bool isBusy(int ch) const;
+    // Channel is an axis of the running coordinated move
+    bool isLinearAxis(int ch) const;
+    uint32_t stepsRemaining(int ch) const;
+
+    // Called from interrupt context with the channel that finished, and
+    // with STEP_LINEAR at the end of every coordinated segment, chained or not
+    void onComplete(Callback<void(int)> done) { _done = done; }
+
+private:
+    struct Channel {
+        DigitalOut *step;
+        DigitalOut *dir;
+        volatile uint32_t remaining;
+        uint32_t done;
+        uint32_t interval;
+        uint32_t next;
+        uint32_t period;    // us from the previous step to next
+        uint32_t stamp;     // cycle count of the previous step
+        const RampProfile *profile;
+    };
+
+    struct Linear {
+        uint32_t mask;
+        uint32_t delta[STEP_CHANNELS];
+        uint32_t error[STEP_CHANNELS];
+        volatile uint32_t remaining;
+        uint32_t done;
+        uint32_t ticks;
+        uint32_t interval;
+        uint32_t next;
+        uint32_t period;
+        uint32_t stamp;
+        uint32_t entry;
+        uint32_t exit;
+        uint32_t cruise;
+        const RampProfile *profile;
+    };
+
+    bool start(int ch, int dir, uint32_t steps, uint32_t interval_us, const RampProfile *profile);
+    bool startLinear(const LinearSegment &seg, uint32_t interval_us);
+    void loadLinear(const LinearSegment &seg, uint32_t interval_us, uint32_t now);
+    bool axesFree(const LinearSegment &seg) const;
+    void setDir(int ch, int level);
+    uint32_t linearInterval() const;
+
+    void service();
+    void reschedule(uint32_t now);
+
+    StepTimer &_timer;
+    Channel _ch[STEP_CHANNELS];
+    Linear _lin;
+    uint32_t _high;         // step pins to bring low at their _lowAt
+    uint32_t _lowAt[STEP_CHANNELS];
+    uint32_t _dirPending;   // dir pins to write when their pulse ends
+    uint32_t _dirLevel;
+    Callback<void(int)> _done;
+    Callback<bool(LinearSegment &)> _next;
+    Callback<void()> _abort;
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include "ThreadProfiler.h"
+
+#define PROFILER_IDLE_NAME "rtx_idle"
+#define PROFILER_MAX_ENUM 24
+
+ThreadProfiler::ThreadProfiler()
+    : _count(0), _idle(NULL), _last(NULL), _total(0), _idleSamples(0), _otherSamples(0),
+      _windowStart(0), _samples(0), _load(0), _otherCpu(0) {
+    memset(_slot, 0, sizeof(_slot));
+}
+
+bool ThreadProfiler::add(const Thread &thread, const char *name) {
+    if (_count >= PROFILER_THREADS) return false;
+
+    Slot &s = _slot[_count];
+    s.thread = &thread;
+    s.name = name ? name : thread.get_name();
+    if (!s.name) s.name = "?";
+    s.id = thread.get_id();
+
+    CriticalSectionLock lock;
+    _count++;
+    return true;
+}
+
+osThreadId_t ThreadProfiler::findIdle() {
+#if defined(MBED_CONF_RTOS_PRESENT)
+    osThreadId_t ids[PROFILER_MAX_ENUM];
+    uint32_t n = osThreadEnumerate(ids, PROFILER_MAX_ENUM);
+    for (uint32_t i = 0; i < n; i++) {
+        const char *name = osThreadGetName(ids[i]);
+        if (name && strcmp(name, PROFILER_IDLE_NAME) == 0) return ids[i];
+    }
+    return NULL;
+#else
+    // Host build: no thread runs while virtual time passes
+    return NULL;
+#endif
+}
+
+void ThreadProfiler::start() {
+    _idle = findIdle();
+    update();
+    _ticker.attach(callback(this, &ThreadProfiler::sample), std::chrono::microseconds(PROFILER_SAMPLE_US));
+}
+
+void ThreadProfiler::stop() {
+    _ticker.detach();
+}
+
+// Timer interrupt: charge this sample to whichever thread it interrupted
+void ThreadProfiler::sample() {
+    osThreadId_t id = ThisThread::get_id();
+    _total = _total + 1;
+
+    if (id == _idle) {
+        _idleSamples = _idleSamples + 1;
+    } else {
+        int i = 0;
+        while (i < _count && _slot[i].id != id) i++;
+        if (i < _count) {
+            Slot &s = _slot[i];
+            s.samples = s.samples + 1;
+            if (id != _last) s.switches = s.switches + 1;
+        } else {
+            _otherSamples = _otherSamples + 1;
+        }
+    }
+    _last = id;
+}
+
+void ThreadProfiler::update() {
+    uint32_t samples[PROFILER_THREADS];
+    uint32_t switches[PROFILER_THREADS];
+    uint32_t total, idle, other;
+    uint32_t now = us_ticker_read();
+    uint32_t elapsed = now - _windowStart;
+
+    {
+        CriticalSectionLock lock;
+        for (int i = 0; i < _count; i++) {
+            samples[i] = _slot[i].samples;
+            switches[i] = _slot[i].switches;
+            _slot[i].samples = 0;
+            _slot[i].switches = 0;
+            // Threads started or ended since the last window
+            _slot[i].id = _slot[i].thread->get_id();
+        }
+        total = _total;
+        idle = _idleSamples;
+        other = _otherSamples;
+        _total = 0;
+        _idleSamples = 0;
+        _otherSamples = 0;
+        _windowStart = now;
+    }
+
+    for (int i = 0; i < _count; i++) {
+        Slot &s = _slot[i];
+        s.cpu = total ? (samples[i] * 100 + total / 2) / total : 0;
+        s.wakeupsPerSec = elapsed ? (uint32_t)((uint64_t)switches[i] * 1000000 / elapsed) : 0;
+        s.stackUsed = s.thread->max_stack();
+        s.stackSize = s.thread->stack_size();
+    }
+    _samples = total;
+    _load = total ? ((total - idle) * 100 + total / 2) / total : 0;
+    _otherCpu = total ? (other * 100 + total / 2) / total : 0;
+}
+
+int ThreadProfiler::busiest() const {
+    int best = -1;
+    for (int i = 0; i < _count; i++) {
+        if (_slot[i].cpu && (best < 0 || _slot[i].cpu > _slot[best].cpu)) best = i;
+    }
+    return best;
+}
+
+int ThreadProfiler::summary(char *buf, int size) const {
+    int len = snprintf(buf, size, "CPU %lu%% other %lu%% samples %lu\n", (unsigned long)_load,
+                       (unsigned long)_otherCpu, (unsigned long)_samples);
+    return len < size ? len : size - 1;
+}
+
+int ThreadProfiler::line(int i, char *buf, int size) const {
+    if (i < 0 || i >= _count) return 0;
+    const Slot &s = _slot[i];
+    int len = snprintf(buf, size, "%-14s %3lu%% %4lu/s stack %4lu/%lu\n", s.name, (unsigned long)s.cpu,
+                       (unsigned long)s.wakeupsPerSec, (unsigned long)s.stackUsed,
+                       (unsigned long)s.stackSize);
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,101 @@
+/**
+ ******************************************************************************
+ * @file    ThreadProfiler.h
+ * @brief   Sampled CPU share, wakeups and stack use of the RTOS threads.
+ ******************************************************************************
+ * @attention
+ *
+ * RTX keeps no per-thread run time or switch counts, so a timer interrupt
+ * samples the running thread instead. The rate is just off the 1 kHz
+ * kernel tick so the samples do not lock onto it. Over a window:
+ *
+ *  - CPU %: share of samples that found the thread running
+ *  - wakeups/s: samples where it had just taken over from another thread;
+ *    runs shorter than a sample period are only caught in proportion to
+ *    their length, so this is a lower bound
+ *  - stack: high-water mark of the thread's stack, from Thread::max_stack()
+ *
+ * Samples of the idle thread give the total load; running threads that
+ * were not registered are reported together as "other".
+ *
+ ******************************************************************************
+ */
+
+#ifndef THREADPROFILER_H
+#define THREADPROFILER_H
+
+#include "mbed.h"
+
+#ifndef PROFILER_THREADS
+#define PROFILER_THREADS 16
+#endif
+#ifndef PROFILER_SAMPLE_US
+#define PROFILER_SAMPLE_US 1009
+#endif
+
+class ThreadProfiler {
+public:
+    ThreadProfiler();
+
+    // Threads are reported in the order they were added. name defaults
+    // to the thread's own; the thread may be started later.
+    bool add(const Thread &thread, const char *name = NULL);
+
+    void start();
+    void stop();
+
+    // Close the window: compute the figures below from the samples since
+    // the last call and start a new one. Thread context only.
+    void update();
+
+    int threads() const { return _count; }
+    const char *name(int i) const { return _slot[i].name; }
+    uint32_t cpu(int i) const { return _slot[i].cpu; }
+    uint32_t wakeups(int i) const { return _slot[i].wakeupsPerSec; }
+    uint32_t stackUsed(int i) const { return _slot[i].stackUsed; }
+    uint32_t stackSize(int i) const { return _slot[i].stackSize; }
+
+    // Percent of the window not spent in the idle thread
+    uint32_t load() const { return _load; }
+    uint32_t otherCpu() const { return _otherCpu; }
+    // Registered thread with the largest CPU share, -1 if none ran
+    int busiest() const;
+
+    // "CPU 23% other 2% samples 4955"
+    int summary(char *buf, int size) const;
+    // "servo_motion   4%   50/s stack  412/1024"
+    int line(int i, char *buf, int size) const;
+
+private:
+    struct Slot {
+        const Thread *thread;
+        const char *name;
+        osThreadId_t id;
+        volatile uint32_t samples;
+        volatile uint32_t switches;
+        uint32_t cpu;
+        uint32_t wakeupsPerSec;
+        uint32_t stackUsed;
+        uint32_t stackSize;
+    };
+
+    void sample();
+    static osThreadId_t findIdle();
+
+    Slot _slot[PROFILER_THREADS];
+    int _count;
+    Ticker _ticker;
+    osThreadId_t _idle;
+    osThreadId_t _last;
+
+    volatile uint32_t _total;
+    volatile uint32_t _idleSamples;
+    volatile uint32_t _otherSamples;
+    uint32_t _windowStart;
+
+    uint32_t _samples;
+    uint32_t _load;
+    uint32_t _otherCpu;
+};
+
+#endif
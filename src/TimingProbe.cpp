@@ -0,0 +1,118 @@
+#include "TimingProbe.h"
+
+uint32_t timing_ns_q16 = 1u << 16;
+
+TimingStats stepTiming("STEP", TIMING_STEP_MISS_NS);
+TimingStats servoTiming("SERVO", TIMING_SERVO_MISS_NS);
+TimingStats controlTiming("CTRL", TIMING_CONTROL_MISS_NS);
+
+void timingInit() {
+#if VMSHIELD_TIMING && defined(TARGET_STM)
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    timing_ns_q16 = (uint32_t)((1000000000ull << 16) / SystemCoreClock);
+#endif
+}
+
+TimingStats::TimingStats(const char *name, uint32_t miss_ns) : _name(name), _missNs(miss_ns) {
+    reset();
+}
+
+// Interrupt or thread context
+void TimingStats::add(int32_t error_ns) {
+    uint32_t mag = error_ns < 0 ? -(uint32_t)error_ns : (uint32_t)error_ns;
+    int bucket = mag ? 32 - __builtin_clz(mag) : 0;
+    if (bucket >= TIMING_BUCKETS) bucket = TIMING_BUCKETS - 1;
+
+    CriticalSectionLock lock;
+    if (!_count || error_ns < _min) _min = error_ns;
+    if (!_count || error_ns > _max) _max = error_ns;
+    if (error_ns > (int32_t)_missNs) _misses = _misses + 1;
+    _hist[bucket] = _hist[bucket] + 1;
+    _count = _count + 1;
+}
+
+void TimingStats::reset() {
+    CriticalSectionLock lock;
+    _count = 0;
+    _misses = 0;
+    _min = 0;
+    _max = 0;
+    for (int i = 0; i < TIMING_BUCKETS; i++) {
+        _hist[i] = 0;
+    }
+}
+
+static uint32_t percentile(const uint32_t hist[TIMING_BUCKETS], uint32_t count, uint32_t permille) {
+    if (!count) return 0;
+    uint64_t want = ((uint64_t)count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (int i = 0; i < TIMING_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= want) return i ? 1u << i : 0;
+    }
+    return 1u << 31;
+}
+
+uint32_t TimingStats::percentileNs(uint32_t permille) const {
+    uint32_t hist[TIMING_BUCKETS];
+    uint32_t count;
+    {
+        CriticalSectionLock lock;
+        memcpy(hist, (const void *)_hist, sizeof(hist));
+        count = _count;
+    }
+    return percentile(hist, count, permille);
+}
+
+int TimingStats::report(char *buf, int size) const {
+    uint32_t hist[TIMING_BUCKETS];
+    uint32_t count, misses;
+    int32_t min, max;
+    {
+        // A consistent snapshot; the interrupt may be adding right now
+        CriticalSectionLock lock;
+        memcpy(hist, (const void *)_hist, sizeof(hist));
+        count = _count;
+        misses = _misses;
+        min = _min;
+        max = _max;
+    }
+
+    int len = snprintf(buf, size, "%s n %lu min %ld max %ld p50 %lu p90 %lu p99 %lu p999 %lu ns miss %lu\n",
+                       _name, (unsigned long)count, (long)min, (long)max,
+                       (unsigned long)percentile(hist, count, 500),
+                       (unsigned long)percentile(hist, count, 900),
+                       (unsigned long)percentile(hist, count, 990),
+                       (unsigned long)percentile(hist, count, 999), (unsigned long)misses);
+    return len < size ? len : size - 1;
+}
+
+#if VMSHIELD_TIMING
+static const TimingStats *const timing_streams[] = { &stepTiming, &servoTiming, &controlTiming };
+#endif
+
+int timingLines() {
+#if VMSHIELD_TIMING
+    return sizeof(timing_streams) / sizeof(timing_streams[0]);
+#else
+    return 1;
+#endif
+}
+
+int timingLine(int i, char *buf, int size) {
+    if (i < 0 || i >= timingLines() || size <= 0) return 0;
+#if VMSHIELD_TIMING
+    return timing_streams[i]->report(buf, size);
+#else
+    int len = snprintf(buf, size, "TIMING off, build with VMSHIELD_TIMING=1\n");
+    return len < size ? len : size - 1;
+#endif
+}
+
+void timingReset() {
+    stepTiming.reset();
+    servoTiming.reset();
+    controlTiming.reset();
+}
@@ -0,0 +1,122 @@
+/**
+ ******************************************************************************
+ * @file    TimingProbe.h
+ * @brief   Opt-in period error histograms for the real-time paths.
+ ******************************************************************************
+ * @attention
+ *
+ * Built with VMSHIELD_TIMING=1 (add -DVMSHIELD_TIMING=1 to build_flags in
+ * platformio.ini), the step interrupt, the servo frame thread and the DC
+ * control tick timestamp every period with the DWT cycle counter and
+ * compare it with the period they asked for. Without it the probes
+ * compile to nothing.
+ *
+ * Each TimingStats keeps, in fixed RAM:
+ *  - count, signed min and max error
+ *  - a log2 histogram of |error| (bucket k: below 2^k ns), from which the
+ *    percentiles are read, so they are upper bounds within a factor of 2
+ *  - deadline misses: periods late by more than the stream's limit
+ *
+ * Command 29 dumps them over the Bluetooth link, 291 also clears them.
+ * On the host build the virtual clock stands in for the cycle counter.
+ *
+ ******************************************************************************
+ */
+
+#ifndef TIMINGPROBE_H
+#define TIMINGPROBE_H
+
+#include "mbed.h"
+
+#ifndef VMSHIELD_TIMING
+#define VMSHIELD_TIMING 0
+#endif
+
+#define TIMING_BUCKETS 32
+
+// Longest report line: a 5 character name and every number at its widest
+// (10 digits unsigned, 11 signed) is 129 characters, the newline and NUL
+#define TIMING_LINE_MAX 132
+
+// Lateness that counts as a deadline miss, per stream
+#ifndef TIMING_STEP_MISS_NS
+#define TIMING_STEP_MISS_NS 10000
+#endif
+#ifndef TIMING_SERVO_MISS_NS
+#define TIMING_SERVO_MISS_NS 2000000
+#endif
+#ifndef TIMING_CONTROL_MISS_NS
+#define TIMING_CONTROL_MISS_NS 100000
+#endif
+
+// ns per cycle in Q16, set by timingInit()
+extern uint32_t timing_ns_q16;
+
+#if defined(TARGET_STM)
+static inline uint32_t timingCycles() { return DWT->CYCCNT; }
+#else
+// Host build: the virtual clock counts in ns
+static inline uint32_t timingCycles() { return (uint32_t)host::nowNs(); }
+#endif
+
+// Start the cycle counter
+void timingInit();
+
+class TimingStats {
+public:
+    TimingStats(const char *name, uint32_t miss_ns);
+
+    // Mark the start of a series of periods
+    static void stamp(uint32_t &stamp) {
+#if VMSHIELD_TIMING
+        stamp = timingCycles();
+#else
+        (void)stamp;
+#endif
+    }
+
+    // One period ends now: record its error and start the next
+    void period(uint32_t &stamp, uint32_t expected_ns) {
+#if VMSHIELD_TIMING
+        uint32_t now = timingCycles();
+        uint32_t ns = (uint32_t)(((uint64_t)(now - stamp) * timing_ns_q16) >> 16);
+        stamp = now;
+        add((int32_t)(ns - expected_ns));
+#else
+        (void)stamp;
+        (void)expected_ns;
+#endif
+    }
+
+    void add(int32_t error_ns);
+    void reset();
+
+    // Upper bound of the permille-th |error|, 0 when empty
+    uint32_t percentileNs(uint32_t permille) const;
+    uint32_t count() const { return _count; }
+    uint32_t misses() const { return _misses; }
+
+    // One line: name, count, min/max, p50/p90/p99/p99.9 and misses
+    int report(char *buf, int size) const;
+
+private:
+    const char *_name;
+    uint32_t _missNs;
+    volatile uint32_t _count;
+    volatile uint32_t _misses;
+    volatile int32_t _min;
+    volatile int32_t _max;
+    volatile uint32_t _hist[TIMING_BUCKETS];
+};
+
+extern TimingStats stepTiming;
+extern TimingStats servoTiming;
+extern TimingStats controlTiming;
+
+// Report lines (one per stream), and line i of them; returns the length
+// written. A TIMING_LINE_MAX buffer always holds a whole line.
+int timingLines();
+int timingLine(int i, char *buf, int size);
+void timingReset();
+
+#endif
@@ -25,6 +25,13 @@
 #include "mbed.h"
 #include "VMShield.h"
 
+#include <new>
+
+#if defined(TARGET_STM)
+#include "pinmap.h"
+#include "PeripheralPins.h"
+#endif
+
 #define I2C_SDA PB_9
 #define I2C_SCL PB_8
 
@@ -38,152 +45,508 @@
 #define SERVO_MIN_PULSE_WIDTH 150 // Min pulse length out of 4096
 #define SERVO_MAX_PULSE_WIDTH 600 // Max pulse length out of 4096
 #define SERVO_FREQUENCY 50 // Analog servos run at ~50 Hz updates
-
-uint16_t pulsewidth;
+#define SERVO_MAX_CENTIDEGREES 18000
 
 /* STEPPER MOTOR CLASS IMPLEMEMTATION */
+
+// Default step period matches the original 2 ms high + 2 ms low pulse
+#define STEPPER_DEFAULT_INTERVAL_US 4000
+
+// EventFlags bit for the coordinated move
+#define STEPPER_LINEAR_FLAG (1u << STEP_CHANNELS)
+
+/* PIN REGISTRY */
+PinRegistry::Entry PinRegistry::_pins[PIN_REGISTRY_SIZE];
+int PinRegistry::_count = 0;
+
+bool PinRegistry::claim(PinName pin, const char *owner){
+
+    if (pin == NC) return true;
+    const char *current = PinRegistry::owner(pin);
+    if (current) return current == owner;
+    if (_count == PIN_REGISTRY_SIZE) return true;   // untracked, not refused
+    _pins[_count].pin = pin;
+    _pins[_count].owner = owner;
+    _count++;
+    return true;
+}
+
+const char *PinRegistry::owner(PinName pin){
+
+    for (int i = 0; i < _count; i++) {
+        if (_pins[i].pin == pin) return _pins[i].owner;
+    }
+    return NULL;
+}
+
+PinRegistry::TimerEntry PinRegistry::_timers[PIN_REGISTRY_TIMERS];
+int PinRegistry::_timerCount = 0;
+
+bool PinRegistry::claimTimer(uint32_t timer, const char *owner){
+
+    if (timer == 0) return true;
+    const char *current = timerOwner(timer);
+    if (current) return current == owner;
+    if (_timerCount == PIN_REGISTRY_TIMERS) return true;
+    _timers[_timerCount].timer = timer;
+    _timers[_timerCount].owner = owner;
+    _timerCount++;
+    return true;
+}
+
+const char *PinRegistry::timerOwner(uint32_t timer){
+
+    for (int i = 0; i < _timerCount; i++) {
+        if (_timers[i].timer == timer) return _timers[i].owner;
+    }
+    return NULL;
+}
+
+uint32_t PinRegistry::pwmTimer(PinName pin){
+
+#if defined(TARGET_STM)
+    if (pin == NC) return 0;
+    uint32_t tim = pinmap_find_peripheral(pin, PinMap_PWM);
+    return tim == (uint32_t)NC ? 0 : tim;
+#else
+    (void)pin;
+    return 0;
+#endif
+}
+
 Stepper::Stepper(PinName StepPin_1, PinName DirPin_1, PinName StepPin_2, PinName DirPin_2,
                     PinName StepPin_3, PinName DirPin_3, PinName StepPin_4, PinName DirPin_4)
     : StepPin1(StepPin_1), DirPin1(DirPin_1), StepPin2(StepPin_2), DirPin2(DirPin_2),
-        StepPin3(StepPin_3), DirPin3(DirPin_3), StepPin4(StepPin_4), DirPin4(DirPin_4){}
+        StepPin3(StepPin_3), DirPin3(DirPin_3), StepPin4(StepPin_4), DirPin4(DirPin_4),
+        _gen(_timer){
+
+    _gen.attachChannel(0, &StepPin1, &DirPin1);
+    _gen.attachChannel(1, &StepPin2, &DirPin2);
+    _gen.attachChannel(2, &StepPin3, &DirPin3);
+    _gen.attachChannel(3, &StepPin4, &DirPin4);
+    _gen.onComplete(callback(this, &Stepper::moveComplete));
+    _gen.onLinearAbort(callback(this, &Stepper::linearAborted));
+
+    const PinName pins[] = { StepPin_1, DirPin_1, StepPin_2, DirPin_2,
+                             StepPin_3, DirPin_3, StepPin_4, DirPin_4 };
+    for (unsigned i = 0; i < sizeof(pins) / sizeof(pins[0]); i++) {
+        PinRegistry::claim(pins[i], "Stepper");
+    }
 
+    for (int i = 0; i < STEP_CHANNELS; i++) {
+        _interval[i] = STEPPER_DEFAULT_INTERVAL_US;
+        _ramped[i] = false;
+    }
+}
+
+// Blocking move, kept for existing callers
 void Stepper::MoveStepper(int Mot_no, int Dir, int steps){
 
-switch(Mot_no){
-        case 1 :
-            if(Dir == 1){
-                DirPin1.write(1);
-                for(int x = 0; x < steps; x++) {
-                StepPin1.write(1); 
-                thread_sleep_for(2);    
-                StepPin1.write(0); 
-                thread_sleep_for(2); 
-                }
-            }
-            if(Dir == 0){
-                DirPin1.write(0);
-                for(int y = 0; y < steps; y++) {
-                StepPin1.write(1); 
-                thread_sleep_for(2);
-                StepPin1.write(0); 
-                thread_sleep_for(2);
-                }
-            }
-            break;
-
-        case 2 :
-            if(Dir == 1){
-                DirPin2.write(1);
-                for(int x = 0; x < steps; x++) {
-                StepPin2.write(1); 
-                thread_sleep_for(2);    
-                StepPin2.write(0); 
-                thread_sleep_for(2); 
-                }
-            }
-            if(Dir == 0){
-                DirPin2.write(0);
-                for(int y = 0; y < steps; y++) {
-                StepPin2.write(1); 
-                thread_sleep_for(2);
-                StepPin2.write(0); 
-                thread_sleep_for(2);
-                }
-            }
-            break;
-
-        case 3 :
-            if(Dir == 1){
-                DirPin3.write(1);
-                for(int x = 0; x < steps; x++) {
-                StepPin3.write(1); 
-                thread_sleep_for(2);    
-                StepPin3.write(0); 
-                thread_sleep_for(2); 
-                }
-            }
-            if(Dir == 0){
-                DirPin3.write(0);
-                for(int y = 0; y < steps; y++) {
-                StepPin3.write(1); 
-                thread_sleep_for(2);
-                StepPin3.write(0); 
-                thread_sleep_for(2);
-                }
-            }
-            break;
-
-        case 4 :
-            if(Dir == 1){
-                DirPin4.write(1);
-                for(int x = 0; x < steps; x++) {
-                StepPin4.write(1); 
-                thread_sleep_for(2);    
-                StepPin4.write(0); 
-                thread_sleep_for(2); 
-                }
-            }
-            if(Dir == 0){
-                DirPin4.write(0);
-                for(int y = 0; y < steps; y++) {
-                StepPin4.write(1); 
-                thread_sleep_for(2);
-                StepPin4.write(0); 
-                thread_sleep_for(2);
-                }
-            }
-            break;
-        
+    if (Mot_no < 1 || Mot_no > STEP_CHANNELS) return;
+
+    uint32_t flag = 1u << (Mot_no - 1);
+    _flags.clear(flag);
+    if (!move(Mot_no, Dir, steps) || steps <= 0) return;
+    _flags.wait_all(flag);
+
+}
+
+bool Stepper::move(int Mot_no, int Dir, int steps){
+
+    if (Mot_no < 1 || Mot_no > STEP_CHANNELS || steps < 0) return false;
+    if (Dir != 0 && Dir != 1) return false;
+
+    int ch = Mot_no - 1;
+    if (_ramped[ch]) {
+        return _gen.move(ch, Dir, steps, _profile[ch]);
     }
+    return _gen.move(ch, Dir, steps, _interval[ch]);
+
+}
+
+void Stepper::stop(int Mot_no){
+
+    if (Mot_no < 1 || Mot_no > STEP_CHANNELS) return;
+
+    // A coordinated move with this motor in it ends as well, and
+    // linearAborted() wakes its waiter
+    _gen.stop(Mot_no - 1);
+    _flags.set(1u << (Mot_no - 1));
+
+}
+
+void Stepper::setSpeed(int Mot_no, uint32_t steps_per_sec){
+
+    if (Mot_no < 1 || Mot_no > STEP_CHANNELS || steps_per_sec == 0) return;
+    _interval[Mot_no - 1] = 1000000u / steps_per_sec;
+    _ramped[Mot_no - 1] = false;
+
+}
+
+// Rebuilds the ramp table, returns the top speed actually reachable
+float Stepper::setMotion(int Mot_no, float max_speed, float accel, float jerk){
+
+    if (Mot_no < 1 || Mot_no > STEP_CHANNELS) return 0.0f;
+
+    int ch = Mot_no - 1;
+    if (_gen.isBusy(ch)) return 0.0f;
+
+    float top = _profile[ch].configure(max_speed, accel, jerk);
+    _ramped[ch] = true;
+    return top;
+
+}
+
+bool Stepper::isBusy(int Mot_no){
+
+    return _gen.isBusy(Mot_no - 1);
+
+}
+
+bool Stepper::moveLinear(int dx1, int dx2, int dx3, int dx4, bool wait){
+
+    int32_t delta[STEP_CHANNELS] = { dx1, dx2, dx3, dx4 };
+
+    // The longest axis sets the pace
+    int master = 0;
+    for (int i = 1; i < STEP_CHANNELS; i++) {
+        if (llabs(delta[i]) > llabs(delta[master])) master = i;
+    }
+    if (delta[master] == 0) return true;
+
+    _flags.clear(STEPPER_LINEAR_FLAG);
+    bool started = _ramped[master] ? _gen.moveLinear(delta, _profile[master])
+                                   : _gen.moveLinear(delta, _interval[master]);
+    if (started && wait) {
+        _flags.wait_all(STEPPER_LINEAR_FLAG);
+    }
+    return started;
+
+}
+
+// Runs in timer interrupt context
+void Stepper::moveComplete(int ch){
+
+    if (ch == STEP_LINEAR) {
+        _flags.set(STEPPER_LINEAR_FLAG);
+        if (_done) _done(0);
+        return;
+    }
+    _flags.set(1u << ch);
+    if (_done) _done(ch + 1);
+
+}
+
+// Interrupts are off: the generator calls this from inside its stop
+void Stepper::linearAborted(){
+
+    _flags.set(STEPPER_LINEAR_FLAG);
+    if (_abort) _abort();
 
 }
 
 /* DC MOTOR CLASS IMPLEMEMTATION */
 DC::DC(PinName EN_1, PinName EN_2, PinName IN_1, PinName IN_2, PinName IN_3, PinName IN_4)
-    : EN1(EN_1), EN2(EN_2), IN1(IN_1), IN2(IN_2),IN3(IN_3), IN4(IN_4){}
+    : EN1(EN_1), EN2(EN_2), IN1(IN_1), IN2(IN_2),IN3(IN_3), IN4(IN_4), _ticking(false){
+
+    DCGains gains = { 0.002f, 0.02f, 0.0f, 1.0f / DC_DEFAULT_MAX_RPM, 0.5f };
+    for (int i = 0; i < DC_CHANNELS; i++) {
+        _loop[i].encoder = NULL;
+        _loop[i].countsPerRev = 1.0f;
+        _loop[i].gains = gains;
+        _loop[i].maxRpm = DC_DEFAULT_MAX_RPM;
+        _loop[i].mode = LOOP_OPEN;
+        _loop[i].command = 0.0f;
+        _loop[i].duty = 0.0f;
+        _loop[i].slew = DC_DEFAULT_SLEW / DC_LOOP_HZ;
+        _loop[i].dir = 0;
+        _loop[i].dead = 0;
+    }
+    setDeadTime(DC_DEAD_TIME_US);
+    resetLoopStats();
+
+    const PinName pins[] = { EN_1, EN_2, IN_1, IN_2, IN_3, IN_4 };
+    for (unsigned i = 0; i < sizeof(pins) / sizeof(pins[0]); i++) {
+        PinRegistry::claim(pins[i], "DC");
+    }
+    // DC is built before BLDC and Music, which refuse a timer it holds:
+    // their period changes would break _ticksPerPeriod
+    PinRegistry::claimTimer(PinRegistry::pwmTimer(EN_1), "DC");
+    PinRegistry::claimTimer(PinRegistry::pwmTimer(EN_2), "DC");
+
+    setupPwm(0, EN_1);
+    setupPwm(1, EN_2);
+}
+
+// The period is set here and never again. On STM32 the compare register
+// is preloaded, so a new duty is latched at the next period boundary
+// instead of cutting the running pulse short.
+void DC::setupPwm(int idx, PinName pin){
+
+    PwmOut &en = idx ? EN2 : EN1;
+    en.period_us(DC_PWM_PERIOD_US);
+    en.write(0.0f);
+    _ccr[idx] = NULL;
+    _ticksPerPeriod[idx] = 0;
+
+#if defined(TARGET_STM)
+    TIM_TypeDef *tim = (TIM_TypeDef *)pinmap_peripheral(pin, PinMap_PWM);
+    int channel = STM_PIN_CHANNEL(pinmap_function(pin, PinMap_PWM));
+    if (!tim || channel < 1 || channel > 4 || STM_PIN_INVERTED(pinmap_function(pin, PinMap_PWM))) return;
+
+    switch (channel) {
+        case 1: tim->CCMR1 |= TIM_CCMR1_OC1PE; _ccr[idx] = &tim->CCR1; break;
+        case 2: tim->CCMR1 |= TIM_CCMR1_OC2PE; _ccr[idx] = &tim->CCR2; break;
+        case 3: tim->CCMR2 |= TIM_CCMR2_OC3PE; _ccr[idx] = &tim->CCR3; break;
+        case 4: tim->CCMR2 |= TIM_CCMR2_OC4PE; _ccr[idx] = &tim->CCR4; break;
+    }
+    tim->CR1 |= TIM_CR1_ARPE;
+    _ticksPerPeriod[idx] = tim->ARR + 1;
+#else
+    (void)pin;
+#endif
+}
 
 void DC::MoveDC(int Mot_no, int Dir, float Duty_Cycle){
 
-    switch(Mot_no){
-        case 1:
-        if(Dir == 1){
-            IN1.write(1);
-            IN2.write(0);
-            EN1.period(0.01f);      
-            EN1.write(Duty_Cycle);      
+    if (Mot_no < 1 || Mot_no > DC_CHANNELS) return;
+    if (Dir != 0 && Dir != 1) return;
+    if (Duty_Cycle < 0.0f) Duty_Cycle = 0.0f;
+    if (Duty_Cycle > 1.0f) Duty_Cycle = 1.0f;
+
+    Loop &l = _loop[Mot_no - 1];
+    {
+        CriticalSectionLock lock;
+        l.mode = LOOP_OPEN;
+        l.command = Dir == 1 ? Duty_Cycle : -Duty_Cycle;
+    }
+    startTicker();
+}
+
+void DC::setSlewRate(int Mot_no, float duty_per_s){
+
+    if (Mot_no < 1 || Mot_no > DC_CHANNELS) return;
+    _loop[Mot_no - 1].slew = duty_per_s > 0.0f ? duty_per_s / DC_LOOP_HZ : 0.0f;
+}
+
+void DC::setDeadTime(uint32_t us){
+    _deadTicks = (us * DC_LOOP_HZ + 999999) / 1000000;
+}
+
+void DC::attachEncoder(int Mot_no, QuadratureEncoder *encoder, float counts_per_rev){
+
+    if (Mot_no < 1 || Mot_no > DC_CHANNELS) return;
+    Loop &l = _loop[Mot_no - 1];
+    l.mode = LOOP_OPEN;
+    l.encoder = encoder;
+    l.countsPerRev = counts_per_rev > 0.0f ? counts_per_rev : 1.0f;
+}
+
+void DC::setGains(int Mot_no, const DCGains &gains){
+
+    if (Mot_no < 1 || Mot_no > DC_CHANNELS) return;
+    CriticalSectionLock lock;
+    _loop[Mot_no - 1].gains = gains;
+}
+
+void DC::setMaxRpm(int Mot_no, float rpm){
+
+    if (Mot_no < 1 || Mot_no > DC_CHANNELS || rpm <= 0.0f) return;
+    _loop[Mot_no - 1].maxRpm = rpm;
+}
+
+bool DC::setSpeed(int Mot_no, float rpm){
+    return enterLoop(Mot_no, LOOP_SPEED, rpm);
+}
+
+bool DC::moveTo(int Mot_no, int32_t counts){
+    return enterLoop(Mot_no, LOOP_POSITION, counts);
+}
+
+float DC::rpm(int Mot_no){
+
+    if (Mot_no < 1 || Mot_no > DC_CHANNELS) return 0.0f;
+    return _loop[Mot_no - 1].rpm;
+}
+
+int32_t DC::position(int Mot_no){
+
+    if (Mot_no < 1 || Mot_no > DC_CHANNELS || !_loop[Mot_no - 1].encoder) return 0;
+    return _loop[Mot_no - 1].encoder->count();
+}
+
+void DC::resetLoopStats(){
+    _loopUs = 0;
+    _maxLoopUs = 0;
+    _maxJitterUs = 0;
+    _loopCount = 0;
+}
+
+bool DC::enterLoop(int Mot_no, LoopMode mode, float setpoint){
+
+    if (Mot_no < 1 || Mot_no > DC_CHANNELS) return false;
+    Loop &l = _loop[Mot_no - 1];
+    if (!l.encoder) return false;
+
+    if (l.mode == LOOP_OPEN) {
+        // Fresh start: no history from an earlier run
+        CriticalSectionLock lock;
+        l.integral = 0.0f;
+        l.rpm = 0.0f;
+        l.count = l.encoder->count();
+    }
+    {
+        CriticalSectionLock lock;
+        l.setpoint = setpoint;
+        l.mode = mode;
+    }
+
+    startTicker();
+    return true;
+}
+
+void DC::startTicker(){
+
+    if (_ticking) return;
+    _ticking = true;
+    _lastTick = us_ticker_read();
+    TimingStats::stamp(_tickStamp);
+    _ticker.attach(callback(this, &DC::controlTick), std::chrono::microseconds(1000000 / DC_LOOP_HZ));
+}
+
+// Ramp the output towards a signed duty. A reversal first ramps down to
+// zero, then holds both bridge inputs low for the dead time before the
+// direction pins change and the duty ramps up again.
+void DC::output(int idx, float target){
+
+    Loop &l = _loop[idx];
+    int8_t want = target > 0.0f ? 1 : (target < 0.0f ? -1 : 0);
+
+    if (l.dead) {
+        if (--l.dead) return;
+        setDirection(idx, want);
+    }
+
+    float goal = target;
+    if (want && l.dir && want != l.dir) goal = 0.0f;
+
+    if (l.slew > 0.0f) {
+        if (goal > l.duty + l.slew) goal = l.duty + l.slew;
+        else if (goal < l.duty - l.slew) goal = l.duty - l.slew;
+    }
+    l.duty = goal;
+
+    if (l.duty == 0.0f && want && want != l.dir) {
+        if (l.dir && _deadTicks) {
+            setDirection(idx, 0);
+            l.dead = _deadTicks;
+            writeDuty(idx, 0.0f);
+            return;
         }
-        if(Dir == 0){
-            IN1.write(0);
-            IN2.write(1);
-            EN1.period(0.01f);      
-            EN1.write(Duty_Cycle);
+        setDirection(idx, want);
+    } else if (l.dir == 0 && want) {
+        setDirection(idx, want);
+    }
+
+    writeDuty(idx, l.duty >= 0.0f ? l.duty : -l.duty);
+}
+
+void DC::setDirection(int idx, int8_t dir){
+
+    DigitalOut &a = idx ? IN3 : IN1;
+    DigitalOut &b = idx ? IN4 : IN2;
+    a.write(dir > 0);
+    b.write(dir < 0);
+    _loop[idx].dir = dir;
+}
+
+void DC::writeDuty(int idx, float duty){
+
+    if (_ccr[idx]) {
+        *_ccr[idx] = (uint32_t)(duty * _ticksPerPeriod[idx] + 0.5f);
+    } else {
+        (idx ? EN2 : EN1).write(duty);
+    }
+}
+
+// Timer interrupt at DC_LOOP_HZ: open loop motors ramp to their command;
+// closed loop ones run a PI(D) speed loop with feed-forward, and a
+// proportional position loop feeding it the speed setpoint
+void DC::controlTick(){
+
+    const float dt = 1.0f / DC_LOOP_HZ;
+    uint32_t start = us_ticker_read();
+    controlTiming.period(_tickStamp, 1000000000 / DC_LOOP_HZ);
+
+    if (_loopCount) {
+        int32_t late = (int32_t)(start - _lastTick) - 1000000 / DC_LOOP_HZ;
+        uint32_t jitter = late < 0 ? -late : late;
+        if (jitter > _maxJitterUs) _maxJitterUs = jitter;
+    }
+    _lastTick = start;
+
+    for (int i = 0; i < DC_CHANNELS; i++) {
+        Loop &l = _loop[i];
+        if (l.mode == LOOP_OPEN) {
+            output(i, l.command);
+            continue;
         }
-        break;
-
-        case 2:
-        if(Dir == 1){
-            IN3.write(1);
-            IN4.write(0);
-            EN2.period(0.01f);      
-            EN2.write(Duty_Cycle);
+
+        int32_t count = l.encoder->count();
+        float raw = (count - l.count) * (60.0f / dt) / l.countsPerRev;
+        l.count = count;
+        float previous = l.rpm;
+        l.rpm += 0.25f * (raw - l.rpm);
+
+        float target = l.setpoint;
+        if (l.mode == LOOP_POSITION) {
+            target = l.gains.kpos * (l.setpoint - count);
         }
-        if(Dir == 0){
-            IN3.write(0);
-            IN4.write(1);
-            EN2.period(0.01f);      
-            EN2.write(Duty_Cycle);  
+        if (target > l.maxRpm) target = l.maxRpm;
+        if (target < -l.maxRpm) target = -l.maxRpm;
+
+        float error = target - l.rpm;
+        // Derivative on the measurement, so setpoint steps do not kick
+        float base = l.gains.kff * target + l.gains.kp * error -
+                     l.gains.kd * (l.rpm - previous) / dt;
+
+        // Anti-windup: stop integrating while the output is saturated in
+        // the direction the error pushes
+        float integral = l.integral + l.gains.ki * error * dt;
+        float out = base + integral;
+        if ((out > 1.0f && error > 0.0f) || (out < -1.0f && error < 0.0f)) {
+            out = base + l.integral;
+        } else {
+            l.integral = integral;
         }
-        break;
+        if (out > 1.0f) out = 1.0f;
+        if (out < -1.0f) out = -1.0f;
+
+        output(i, out);
     }
-}
 
-/* SERVO MOTOR CLASS IMPLEMEMTATION */
+    _loopUs = us_ticker_read() - start;
+    if (_loopUs > _maxLoopUs) _maxLoopUs = _loopUs;
+    _loopCount++;
+}
 
 /* SERVO MOTOR CLASS IMPLEMEMTATION */
-Servo::Servo(I2C *i2c, uint8_t addr) {
-  _i2c = i2c;
+Servo::Servo(I2CBus *bus, uint8_t addr) {
+  _bus = bus;
   _i2caddr = addr << 1;
 
+  _mode1 = 0;
+  _prescale = 0;
+  _known = 0;
+  _dirty = 0;
+  _modeKnown = false;
+  resetStats();
+
+  ServoCalibration cal = { SERVO_MIN_PULSE_WIDTH, SERVO_MAX_PULSE_WIDTH, 0, false };
+  for (int i = 0; i < PCA9685_CHANNELS; i++) {
+    setCalibration(i, cal);
+  }
+
 }
 
 void Servo::begin(void) {
@@ -191,72 +554,469 @@ void Servo::begin(void) {
 }
 
 void Servo::reset(void) {
- write8(PCA9685_MODE1, 0x1);
+ // Auto-increment lets multi-channel writes run in one transaction
+ _lock.lock();
+ write8(PCA9685_MODE1, PCA9685_MODE1_AI | PCA9685_MODE1_ALLCALL);
+ _lock.unlock();
 
 }
 
 void Servo::setPWMFreq(float freq) {
   
-  float prescaleval = 25000000;
+  float prescaleval = 25000000.0f;
   prescaleval /= 4096;
   prescaleval /= freq;
   prescaleval -= 1;
 
-  uint8_t prescale = floor(prescaleval + 0.5);
+  uint8_t prescale = (uint8_t)(prescaleval + 0.5f);
+
+  // Held through the oscillator restart, so no frame goes out to a
+  // sleeping chip
+  _lock.lock();
+  if (!_modeKnown) {
+    _mode1 = read8(PCA9685_MODE1);
+    _modeKnown = true;
+  }
+  // Already running at this rate: skip the sleep/restart cycle
+  if (prescale == _prescale && (_mode1 & PCA9685_MODE1_AI)) {
+    _lock.unlock();
+    return;
+  }
   
-  uint8_t oldmode = read8(PCA9685_MODE1);
-  uint8_t newmode = (oldmode&0x7F) | 0x10; // sleep
+  uint8_t oldmode = _mode1 & ~PCA9685_MODE1_RESTART;
+  uint8_t newmode = (oldmode&0x7F) | PCA9685_MODE1_SLEEP; // sleep
   write8(PCA9685_MODE1, newmode); // go to sleep
   write8(PCA9685_PRESCALE, prescale); // set the prescaler
   write8(PCA9685_MODE1, oldmode);
+  _bus->sync(); // oscillator start-up counts from the wake write
   thread_sleep_for(5);
-  write8(PCA9685_MODE1, oldmode | 0xa1);  
+  write8(PCA9685_MODE1, oldmode | PCA9685_MODE1_RESTART | PCA9685_MODE1_AI | PCA9685_MODE1_ALLCALL);  
+  _lock.unlock();
+
+}
+
+void Servo::setCalibration(uint8_t num, const ServoCalibration &cal) {
+
+  if (num >= PCA9685_CHANNELS) return;
+
+  _lock.lock();
+  _cal[num] = cal;
+  int32_t span = (int32_t)cal.maxTicks - cal.minTicks;
+  if (cal.reversed) {
+    _base[num] = cal.maxTicks + cal.trim;
+    span = -span;
+  } else {
+    _base[num] = cal.minTicks + cal.trim;
+  }
+  // Q16 ticks per centidegree
+  _scale[num] = (span * 65536) / SERVO_MAX_CENTIDEGREES;
+  _lock.unlock();
+
+}
+
+// Integer only
+uint16_t Servo::angleToTicks(uint8_t num, uint32_t centidegrees) const {
+
+  if (centidegrees > SERVO_MAX_CENTIDEGREES) centidegrees = SERVO_MAX_CENTIDEGREES;
+  int32_t ticks = _base[num] + (((int32_t)centidegrees * _scale[num] + 0x8000) >> 16);
+  if (ticks < 0) ticks = 0;
+  if (ticks > 4095) ticks = 4095;
+  return ticks;
 
 }
 
 void Servo::setPWM(uint8_t servonum, uint16_t on, uint16_t degree) {
-  
-  pulsewidth = ((degree / 180.0) * (SERVO_MAX_PULSE_WIDTH - SERVO_MIN_PULSE_WIDTH) + SERVO_MIN_PULSE_WIDTH);
 
-  uint8_t data[] = { LED0_ON_L+4*servonum, on, on >> 8, pulsewidth, pulsewidth >> 8 };
+  if (servonum >= PCA9685_CHANNELS) return;
 
-  _i2c->write(_i2caddr, (const char *)data, 5);
+  _lock.lock();
+  stage(servonum, on, angleToTicks(servonum, degree * 100u));
+  flush();
+  _lock.unlock();
   
 }
 
+void Servo::setAngle(uint8_t servonum, uint16_t centidegrees) {
+
+  if (servonum >= PCA9685_CHANNELS) return;
+
+  _lock.lock();
+  stage(servonum, 0, angleToTicks(servonum, centidegrees));
+  flush();
+  _lock.unlock();
+
+}
+
+void Servo::stagePWM(uint8_t servonum, uint16_t on, uint16_t degree) {
+
+  if (servonum >= PCA9685_CHANNELS) return;
+  _lock.lock();
+  stage(servonum, on, angleToTicks(servonum, degree * 100u));
+  _lock.unlock();
+
+}
+
+void Servo::stageAngle(uint8_t servonum, uint16_t centidegrees) {
+
+  if (servonum >= PCA9685_CHANNELS) return;
+  _lock.lock();
+  stage(servonum, 0, angleToTicks(servonum, centidegrees));
+  _lock.unlock();
+
+}
+
+void Servo::setPWMMulti(uint8_t first, uint8_t count, const uint16_t degrees[]) {
+
+  if (first >= PCA9685_CHANNELS || count == 0) return;
+  if (count > PCA9685_CHANNELS - first) count = PCA9685_CHANNELS - first;
+
+  _lock.lock();
+  for (int i = 0; i < count; i++) {
+    stage(first + i, 0, angleToTicks(first + i, degrees[i] * 100u));
+  }
+  flush();
+  _lock.unlock();
+
+}
+
+void Servo::setPWMAll(const uint16_t degrees[PCA9685_CHANNELS]) {
+  setPWMMulti(0, PCA9685_CHANNELS, degrees);
+}
+
+// Update the shadow copy, marking the channel dirty only if it changed
+void Servo::stage(uint8_t num, uint16_t on, uint16_t off) {
+
+  uint16_t bit = 1u << num;
+  if ((_known & bit) && _on[num] == on && _off[num] == off) {
+    if (!(_dirty & bit)) _bytesSaved += 4;
+    return;
+  }
+  _on[num] = on;
+  _off[num] = off;
+  _known |= bit;
+  _dirty |= bit;
+
+}
+
+// Send each run of adjacent dirty channels as one auto-increment write.
+// Runs are not merged across clean channels: a clean channel costs 4
+// bytes, more than the start, address and register byte of a new run.
+void Servo::flush(void) {
+
+  _lock.lock();
+  int ch = 0;
+  while (_dirty && ch < PCA9685_CHANNELS) {
+    if (!(_dirty & (1u << ch))) {
+      ch++;
+      continue;
+    }
+
+    int first = ch;
+    char data[1 + 4 * PCA9685_CHANNELS];
+    data[0] = LED0_ON_L + 4 * first;
+    int len = 1;
+    while (ch < PCA9685_CHANNELS && (_dirty & (1u << ch))) {
+      data[len++] = _on[ch] & 0xFF;
+      data[len++] = _on[ch] >> 8;
+      data[len++] = _off[ch] & 0xFF;
+      data[len++] = _off[ch] >> 8;
+      _dirty &= ~(1u << ch);
+      ch++;
+    }
+    writeRegs(data, len);
+  }
+  _lock.unlock();
+
+}
+
+void Servo::resetStats(void) {
+  _lock.lock();
+  _bytesSent = 0;
+  _bytesSaved = 0;
+  _transactions = 0;
+  _lock.unlock();
+}
+
 uint8_t Servo::read8(uint8_t addr) {
-    char data;
-    if(_i2c->write(_i2caddr, (char *)&addr, 1, true))
-        // printf("I2C ERR: no ack on write before read.\n");
-    if(_i2c->read(_i2caddr, &data, 1))
+    char data = 0;
+    if(_bus->transferSync(_i2caddr, (char *)&addr, 1, &data, 1, I2C_PRIORITY_HIGH)) {
         // printf("I2C ERR: no ack on read\n");
+    }
+    _bytesSent += 2;
+    _transactions += 2;
     return (uint8_t)data;
 }
 
 void Servo::write8(uint8_t addr, uint8_t d) {
-    char data[] = { addr, d };
-    if(_i2c->write(_i2caddr, data, 2))
-    {    
-        // printf("I2C ERR: No ACK on i2c write!");
+    char data[] = { (char)addr, (char)d };
+    writeRegs(data, 2);
+
+    // Keep the shadow registers in step with the chip
+    if (addr == PCA9685_MODE1) {
+        _mode1 = d;
+        _modeKnown = true;
+        if (d & PCA9685_MODE1_RESTART) {
+            _mode1 &= ~PCA9685_MODE1_RESTART;
+        }
+    } else if (addr == PCA9685_PRESCALE) {
+        _prescale = d;
+    }
+}
+
+// Queued on the bus ahead of display traffic, returns once copied
+void Servo::writeRegs(const char *data, int len) {
+    _bus->write(_i2caddr, data, len, I2C_PRIORITY_HIGH);
+    _bytesSent += len;
+    _transactions++;
+}
+
+/* BLDC MOTOR CLASS IMPLEMEMTATION */
+BLDC::BLDC(PinName BLDC_1, PinName BLDC_2, PinName BLDC_3, PinName BLDC_4, EscProtocol protocol){
+
+    const PinName pins[BLDC_CHANNELS] = { BLDC_1, BLDC_2, BLDC_3, BLDC_4 };
+    for (int i = 0; i < BLDC_CHANNELS; i++) {
+        Channel &c = _ch[i];
+        c.esc = NULL;
+        c.conflict = NULL;
+        c.timer = 0;
+        c.channel = 0;
+        c.min = 0;
+        c.max = ESC_THROTTLE_MAX;
+        c.throttle = 0;
+        c.arming = false;
+
+        if (checkPin(i, pins[i], protocol)) {
+            PinRegistry::claim(pins[i], "BLDC");
+            PinRegistry::claimTimer(c.timer, "BLDC");
+            c.esc = new (_escStorage[i]) EscOutput(pins[i], protocol);
+        }
+    }
+}
+
+// A channel is left out rather than fighting another driver for its pin
+// or its timer, or another BLDC channel for its timer channel. The ESC
+// output sets the timer's period (and for DShot its DMA), which would
+// break DC or Music PWM on the same timer.
+bool BLDC::checkPin(int idx, PinName pin, EscProtocol protocol){
+
+    Channel &c = _ch[idx];
+    if (pin == NC) {
+        c.conflict = "not connected";
+        return false;
+    }
+    if (PinRegistry::owner(pin)) {
+        c.conflict = PinRegistry::owner(pin);
+        return false;
+    }
+    if (!EscOutput::timerChannel(pin, protocol, c.timer, c.channel)) return true;
+
+    const char *owner = PinRegistry::timerOwner(c.timer);
+    if (owner && strcmp(owner, "BLDC") != 0) {
+        c.conflict = owner;
+        c.timer = 0;
+        c.channel = 0;
+        return false;
+    }
+    // A DShot output has its timer to itself
+    bool dshot = protocol >= ESC_DSHOT150 && EscOutput::dshotRoute(pin);
+    for (int i = 0; i < idx; i++) {
+        if (!_ch[i].esc || !_ch[i].channel || _ch[i].timer != c.timer) continue;
+        if (dshot || _ch[i].esc->protocol() >= ESC_DSHOT150) {
+            c.conflict = "DShot timer";
+        } else if (_ch[i].channel == c.channel) {
+            c.conflict = "timer channel";
+        } else {
+            continue;
+        }
+        c.timer = 0;
+        c.channel = 0;
+        return false;
+    }
+    return true;
+}
+
+bool BLDC::attached(int Mot_no) const{
+
+    if (Mot_no < 1 || Mot_no > BLDC_CHANNELS) return false;
+    return _ch[Mot_no - 1].esc != NULL;
+}
+
+const char *BLDC::conflict(int Mot_no) const{
+
+    if (Mot_no < 1 || Mot_no > BLDC_CHANNELS) return "no channel";
+    return _ch[Mot_no - 1].conflict;
+}
+
+void BLDC::arm(int Mot_no){
+
+    if (!attached(Mot_no)) return;
+    Channel &c = _ch[Mot_no - 1];
+    c.throttle = 0;
+    c.esc->write(0);
+    c.armedAt = Kernel::Clock::now() + std::chrono::milliseconds(BLDC_ARM_MS);
+    c.arming = true;
+}
+
+void BLDC::disarm(int Mot_no){
+
+    if (!attached(Mot_no)) return;
+    Channel &c = _ch[Mot_no - 1];
+    c.arming = false;
+    c.throttle = 0;
+    c.esc->write(0);
+}
+
+bool BLDC::isArmed(int Mot_no) const{
+
+    return attached(Mot_no) && armed(Mot_no - 1);
+}
+
+bool BLDC::armed(int idx) const{
+
+    return _ch[idx].arming && Kernel::Clock::now() >= _ch[idx].armedAt;
+}
+
+void BLDC::calibrate(int Mot_no){
+
+    if (!attached(Mot_no)) return;
+    Channel &c = _ch[Mot_no - 1];
+    c.arming = false;
+    c.throttle = 0;
+    c.esc->write(ESC_THROTTLE_MAX);
+    ThisThread::sleep_for(std::chrono::milliseconds(BLDC_CAL_HIGH_MS));
+    c.esc->write(0);
+    ThisThread::sleep_for(std::chrono::milliseconds(BLDC_CAL_LOW_MS));
+}
+
+void BLDC::setLimits(int Mot_no, uint16_t min, uint16_t max){
+
+    if (Mot_no < 1 || Mot_no > BLDC_CHANNELS) return;
+    if (max > ESC_THROTTLE_MAX) max = ESC_THROTTLE_MAX;
+    if (min > max) min = max;
+    _ch[Mot_no - 1].min = min;
+    _ch[Mot_no - 1].max = max;
+}
+
+void BLDC::setThrottle(int Mot_no, uint16_t throttle){
+
+    if (Mot_no < 1 || Mot_no > BLDC_CHANNELS) return;
+    uint16_t frame[BLDC_CHANNELS] = { BLDC_KEEP, BLDC_KEEP, BLDC_KEEP, BLDC_KEEP };
+    frame[Mot_no - 1] = throttle;
+    setThrottles(frame);
+}
+
+void BLDC::setThrottles(const uint16_t throttle[BLDC_CHANNELS]){
+
+    uint16_t out[BLDC_CHANNELS];
+    for (int i = 0; i < BLDC_CHANNELS; i++) {
+        Channel &c = _ch[i];
+        out[i] = BLDC_KEEP;
+        if (!c.esc || throttle[i] == BLDC_KEEP || !armed(i)) continue;
+
+        c.throttle = throttle[i] > 1000 ? 1000 : throttle[i];
+        out[i] = c.min + (uint32_t)c.throttle * (c.max - c.min) / 1000;
+    }
+    writeAll(out);
+}
+
+void BLDC::stopAll(){
+
+    const uint16_t zero[BLDC_CHANNELS] = { 0, 0, 0, 0 };
+    setThrottles(zero);
+}
+
+uint16_t BLDC::throttle(int Mot_no) const{
+
+    if (!attached(Mot_no)) return 0;
+    return _ch[Mot_no - 1].throttle;
+}
+
+// Hold the update event of every timer involved while the compare
+// registers are written, so channels sharing a timer switch together
+void BLDC::writeAll(const uint16_t out[BLDC_CHANNELS]){
+
+    CriticalSectionLock lock;
+    for (int i = 0; i < BLDC_CHANNELS; i++) {
+        if (out[i] != BLDC_KEEP) _ch[i].esc->hold();
+    }
+    for (int i = 0; i < BLDC_CHANNELS; i++) {
+        if (out[i] != BLDC_KEEP) _ch[i].esc->write(out[i]);
+    }
+    for (int i = 0; i < BLDC_CHANNELS; i++) {
+        if (out[i] != BLDC_KEEP) _ch[i].esc->release();
     }
 }
 
 /* Class for Music */
 Music::Music(PinName StepPin_1, PinName DirPin_1)
-    : StepPin1music(StepPin_1), DirPin1music(DirPin_1){}
+    : _stepPin(StepPin_1), DirPin1music(DirPin_1), _pwm(NULL), _playing(false){
 
-void Music::PlayMusic(int pulseCount, float noteDurationMs, float stepDelay){
+    // A tone reprograms the timer's period, so a timer DC or BLDC drives
+    // leaves the voice silent
+    if (!PinRegistry::claimTimer(PinRegistry::pwmTimer(_stepPin), "Music")) _stepPin = NC;
+}
 
-    DirPin1music.write(1);  // Set the direction
+void Music::PlayMusic(int pulseCount, float noteDurationMs, float stepDelay){
 
-    for(int i = 0; i < pulseCount; i++) {
-        StepPin1music.write(1); 
-        _wait_us_inline(stepDelay * 1000);  // Wait for the calculated delay
-        StepPin1music.write(0); 
-        wait_us(stepDelay * 1000);  // Wait for the calculated delay
+    if (pulseCount > 0 && stepDelay > 0.0f) {
+        DirPin1music.write(1);  // Set the direction
+        tone(1000.0f / (2.0f * stepDelay), (uint32_t)(pulseCount * stepDelay * 2000.0f + 0.5f));
+        waitTone();
+        release();
     }
 
     thread_sleep_for(noteDurationMs);  // Wait between notes
 
 }
 
+void Music::tone(float frequencyHz, uint32_t duration_us){
+
+    if (frequencyHz <= 0.0f) return;
+    // Rounded to the PWM tick instead of truncated
+    tonePeriod((uint32_t)(1000000.0f / frequencyHz + 0.5f), duration_us);
+}
+
+void Music::tonePeriod(uint32_t period_us, uint32_t duration_us){
+
+    if (_stepPin == NC || period_us == 0 || duration_us == 0) return;
+
+    _stop.detach();
+    _flags.clear(MUSIC_DONE_FLAG);
+    if (!_pwm) _pwm = new (_pwmStorage) PwmOut(_stepPin);
+
+    _pwm->period_us(period_us);
+    _pwm->write(0.5f);
+    _playing = true;
+    _stop.attach(callback(this, &Music::toneEnd), std::chrono::microseconds(duration_us));
+}
+
+void Music::silence(){
+
+    _stop.detach();
+    toneEnd();
+}
+
+// Timeout interrupt: pin low, wake the waiting thread
+void Music::toneEnd(){
+
+    if (_pwm) _pwm->write(0.0f);
+    _playing = false;
+    _flags.set(MUSIC_DONE_FLAG);
+}
+
+void Music::waitTone(){
+
+    if (_playing) _flags.wait_any(MUSIC_DONE_FLAG);
+}
+
+void Music::release(){
+
+    if (!_pwm) return;
+    silence();
+    _pwm->~PwmOut();
+    _pwm = NULL;
+
+    // Pin back to a low GPIO output, as the stepper driver left it
+    gpio_t gpio;
+    gpio_init_out_ex(&gpio, _stepPin, 0);
+}
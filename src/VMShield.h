@@ -17,6 +17,8 @@
  * - Stepper    (Mot_no, Dir, steps);
  * - Servo      (Mot_no, Degrees);    
  * - DC         (Mot_no, Dir, Duty_Cycle);
+ * - DC         setSpeed(Mot_no, rpm) / moveTo(Mot_no, counts) with an encoder
+ * - BLDC       (Mot_no, Throttle);
  * -----------------------------------
  * 
  ******************************************************************************
@@ -47,6 +49,11 @@
  * | BLDC 3    | BLDC_3   | PB_14     | N/A         |
  * | BLDC 4    | BLDC_4   | PB_13     | N/A         |
  * |-----------|----------|-----------|-------------|
+ *
+ * Stepper, DC and BLDC claim their pins in PinRegistry. BLDC leaves out a
+ * channel whose pin is already taken (main.cpp runs stepper 3 on PB_13),
+ * or whose timer channel another BLDC channel drives (PB_1 and PB_15 are
+ * both TIM1_CH3N in the default pin map).
  * 
  ******************************************************************************
  */
@@ -55,6 +62,11 @@
 #define VMSHIELD_H
 
 #include "mbed.h"
+#include "StepGenerator.h"
+#include "I2CBus.h"
+#include "EscOutput.h"
+#include "QuadratureEncoder.h"
+#include "TimingProbe.h"
 
 // Defination for PCA9685 Servo Driver
 #define PCA9685_SUBADR1 0x2
@@ -64,6 +76,14 @@
 #define PCA9685_MODE1 0x0
 #define PCA9685_PRESCALE 0xFE
 
+// MODE1 bits
+#define PCA9685_MODE1_ALLCALL 0x01
+#define PCA9685_MODE1_SLEEP 0x10
+#define PCA9685_MODE1_AI 0x20
+#define PCA9685_MODE1_RESTART 0x80
+
+#define PCA9685_CHANNELS 16
+
 #define LED0_ON_L 0x6
 #define LED0_ON_H 0x7
 #define LED0_OFF_L 0x8
@@ -74,6 +94,40 @@
 #define ALLLED_OFF_L 0xFC
 #define ALLLED_OFF_H 0xFD
 
+// Pins handed out to the motor classes, to catch two drivers on one pin
+#define PIN_REGISTRY_SIZE 32
+// Timers whose period or control registers a driver programs. Channels of
+// one timer share its period, so a timer belongs to one driver.
+#define PIN_REGISTRY_TIMERS 8
+
+class PinRegistry {
+public:
+    // False if the pin already belongs to someone else
+    static bool claim(PinName pin, const char *owner);
+    // NULL if the pin is free
+    static const char *owner(PinName pin);
+
+    // Same for a timer, as returned by pwmTimer(); timer 0 is never refused
+    static bool claimTimer(uint32_t timer, const char *owner);
+    static const char *timerOwner(uint32_t timer);
+    // PWM timer of the pin, 0 if it has none or the target is not STM32
+    static uint32_t pwmTimer(PinName pin);
+
+private:
+    struct Entry {
+        PinName pin;
+        const char *owner;
+    };
+    struct TimerEntry {
+        uint32_t timer;
+        const char *owner;
+    };
+    static Entry _pins[PIN_REGISTRY_SIZE];
+    static int _count;
+    static TimerEntry _timers[PIN_REGISTRY_TIMERS];
+    static int _timerCount;
+};
+
 // Stepper Motor Class Defination
 class Stepper {
 public:
@@ -85,6 +139,31 @@ public:
     // Method prototyping or member function
     void MoveStepper(int Mot_no, int Dir, int steps);
 
+    // Non-blocking moves driven by the step generator
+    bool move(int Mot_no, int Dir, int steps);
+    void stop(int Mot_no);
+    void setSpeed(int Mot_no, uint32_t steps_per_sec);
+    // Accelerated moves: steps/s, steps/s^2, steps/s^3 (jerk 0 = trapezoid)
+    float setMotion(int Mot_no, float max_speed, float accel, float jerk = 0.0f);
+    bool isBusy(int Mot_no);
+
+    // Coordinated move of all four axes (signed steps), paced by the
+    // motion settings of the longest axis
+    bool moveLinear(int dx1, int dx2, int dx3, int dx4, bool wait = false);
+
+    // Streamed coordinated moves, used by MotionPlanner
+    bool moveSegment(const LinearSegment &seg) { return _gen.moveSegment(seg); }
+    void stopSegment() { _gen.stopLinear(); }
+    uint32_t raiseSegmentExit(uint32_t exit) { return _gen.raiseLinearExit(exit); }
+    bool isLinearBusy() const { return _gen.isLinearBusy(); }
+    void onSegmentNext(Callback<bool(LinearSegment &)> next) { _gen.onLinearNext(next); }
+    // Running segment stopped early (stop() on one of its axes or
+    // stopSegment()); called with interrupts off
+    void onSegmentAbort(Callback<void()> abort) { _abort = abort; }
+
+    // Mot_no of the finished move, 0 for a coordinated move
+    void onComplete(Callback<void(int)> done) { _done = done; }
+
 private:
 
     // Pin assignment
@@ -97,9 +176,51 @@ private:
      DigitalOut StepPin4;   
      DigitalOut DirPin4;     
 
+     TickerStepTimer _timer;
+     StepGenerator _gen;
+     EventFlags _flags;
+     uint32_t _interval[STEP_CHANNELS];
+     RampProfile _profile[STEP_CHANNELS];
+     bool _ramped[STEP_CHANNELS];
+     Callback<void(int)> _done;
+     Callback<void()> _abort;
+
+     void moveComplete(int ch);
+     void linearAborted();
+
 };
 
 // DC Motor Class Defination
+#define DC_CHANNELS 2
+
+// Closed loop update rate
+#ifndef DC_LOOP_HZ
+#define DC_LOOP_HZ 500
+#endif
+
+#define DC_DEFAULT_MAX_RPM 300.0f
+
+// EN pin PWM period, set once at start-up
+#ifndef DC_PWM_PERIOD_US
+#define DC_PWM_PERIOD_US 10000
+#endif
+
+// Duty ramp (full scale per second) and the pause with both bridge
+// inputs low before the direction is reversed
+#define DC_DEFAULT_SLEW 4.0f
+#define DC_DEAD_TIME_US 2000
+
+// Speed loop gains, output is duty (-1 to 1): kp, ki and kd per rpm of
+// error, kff per rpm of setpoint. kpos turns position error (counts)
+// into an rpm setpoint for moveTo().
+struct DCGains {
+    float kp;
+    float ki;
+    float kd;
+    float kff;
+    float kpos;
+};
+
 class DC {
 public:
     DC(PinName EN_1, PinName EN_2, 
@@ -107,9 +228,63 @@ public:
             PinName IN_3, PinName IN_4); // Constructor
 
     // Method prototyping or member function
+    // Open loop; also takes the motor out of closed loop control. The
+    // duty ramps to the new value at the slew rate.
     void MoveDC(int Mot_no, int Dir, float Duty_Cycle);
 
+    // Duty change per second, 0 = step straight to the new duty
+    void setSlewRate(int Mot_no, float duty_per_s);
+    void setDeadTime(uint32_t us);
+
+    // Closed loop control needs an encoder on the motor shaft
+    void attachEncoder(int Mot_no, QuadratureEncoder *encoder, float counts_per_rev);
+    void setGains(int Mot_no, const DCGains &gains);
+    void setMaxRpm(int Mot_no, float rpm);
+
+    // Hold a speed (signed rpm) or drive to an encoder position.
+    // Return false if the motor has no encoder.
+    bool setSpeed(int Mot_no, float rpm);
+    bool moveTo(int Mot_no, int32_t counts);
+
+    float rpm(int Mot_no);
+    int32_t position(int Mot_no);
+
+    // Control loop timing in microseconds
+    uint32_t loopTimeUs() const { return _loopUs; }
+    uint32_t maxLoopTimeUs() const { return _maxLoopUs; }
+    uint32_t maxJitterUs() const { return _maxJitterUs; }
+    uint32_t loopCount() const { return _loopCount; }
+    void resetLoopStats();
+
 private:
+    enum LoopMode { LOOP_OPEN, LOOP_SPEED, LOOP_POSITION };
+
+    struct Loop {
+        QuadratureEncoder *encoder;
+        float countsPerRev;
+        DCGains gains;
+        float maxRpm;
+        volatile uint8_t mode;
+        float setpoint;         // rpm, or counts in position mode
+        float integral;
+        float rpm;              // filtered measurement
+        int32_t count;
+
+        // Output stage
+        float command;          // open loop duty, signed
+        float duty;             // duty being output, signed
+        float slew;             // duty per tick, 0 = unlimited
+        int8_t dir;             // bridge direction, 0 = both inputs low
+        uint16_t dead;          // ticks left before the bridge may reverse
+    };
+
+    bool enterLoop(int Mot_no, LoopMode mode, float setpoint);
+    void startTicker();
+    void controlTick();
+    void setupPwm(int idx, PinName pin);
+    void output(int idx, float target);
+    void setDirection(int idx, int8_t dir);
+    void writeDuty(int idx, float duty);
 
     // Pin assignment
      PwmOut EN1;   
@@ -119,43 +294,216 @@ private:
      DigitalOut IN3;   
      DigitalOut IN4;     
 
+    Loop _loop[DC_CHANNELS];
+    Ticker _ticker;
+    bool _ticking;
+    uint16_t _deadTicks;
+
+    // Timer compare register behind each EN pin, NULL if not reachable
+    volatile uint32_t *_ccr[DC_CHANNELS];
+    uint32_t _ticksPerPeriod[DC_CHANNELS];
+
+    uint32_t _lastTick;
+    uint32_t _tickStamp;
+    volatile uint32_t _loopUs;
+    volatile uint32_t _maxLoopUs;
+    volatile uint32_t _maxJitterUs;
+    volatile uint32_t _loopCount;
+
 };
 
 // Servo Motor Class Defination
 
+// Pulse range of one channel in PCA9685 ticks (of 4096 per frame)
+struct ServoCalibration {
+  uint16_t minTicks;   // pulse at 0 degrees
+  uint16_t maxTicks;   // pulse at 180 degrees
+  int16_t trim;        // added to every pulse
+  bool reversed;       // 0 degrees at maxTicks
+};
+
+// Every public call takes the driver's lock: the frame thread (ServoMotion)
+// stages and flushes while other threads set the chip up or move channels.
 class Servo{
 
  public:
-  Servo(I2C *i2c, uint8_t addr = 0x40);
+  Servo(I2CBus *bus, uint8_t addr = 0x40);
   void begin(void);
   void reset(void);
   void setPWMFreq(float freq);
   void setPWM(uint8_t num, uint16_t on, uint16_t degree);
+  // Angle in hundredths of a degree (0 - 18000)
+  void setAngle(uint8_t num, uint16_t centidegrees);
+
+  void setCalibration(uint8_t num, const ServoCalibration &cal);
+  const ServoCalibration &calibration(uint8_t num) const { return _cal[num]; }
+
+  // Contiguous channels in one auto-increment transaction
+  void setPWMMulti(uint8_t first, uint8_t count, const uint16_t degrees[]);
+  // Whole 16-channel frame, latched in the same PWM cycle
+  void setPWMAll(const uint16_t degrees[PCA9685_CHANNELS]);
+
+  // Update the shadow registers only; flush() sends what changed
+  void stagePWM(uint8_t num, uint16_t on, uint16_t degree);
+  // Same, angle in hundredths of a degree (0 - 18000)
+  void stageAngle(uint8_t num, uint16_t centidegrees);
+  void flush(void);
+
+  // Bus traffic counters (bytes after the address byte)
+  uint32_t bytesSent() const { return _bytesSent; }
+  uint32_t bytesSaved() const { return _bytesSaved; }
+  uint32_t transactions() const { return _transactions; }
+  void resetStats(void);
 
  private:
-  I2C *_i2c;
+  I2CBus *_bus;
   uint8_t _i2caddr;
 
+  // Shadow of the chip registers
+  uint16_t _on[PCA9685_CHANNELS];
+  uint16_t _off[PCA9685_CHANNELS];
+  uint16_t _known;
+  uint16_t _dirty;
+  uint8_t _mode1;
+  uint8_t _prescale;
+  bool _modeKnown;
+
+  // Calibration and the conversion precomputed from it:
+  // ticks = _base + ((centidegrees * _scale + 0x8000) >> 16)
+  ServoCalibration _cal[PCA9685_CHANNELS];
+  int32_t _base[PCA9685_CHANNELS];
+  int32_t _scale[PCA9685_CHANNELS];
+
+  uint32_t _bytesSent;
+  uint32_t _bytesSaved;
+  uint32_t _transactions;
+
+  // Shadow registers, calibration and counters
+  Mutex _lock;
+
+  // Private helpers expect the caller to hold _lock
+  uint16_t angleToTicks(uint8_t num, uint32_t centidegrees) const;
+  void stage(uint8_t num, uint16_t on, uint16_t off);
+  void writeRegs(const char *data, int len);
+
   uint8_t read8(uint8_t addr);
   void write8(uint8_t addr, uint8_t d);
 
 };
 
+// BLDC Motor Class Defination
+#define BLDC_CHANNELS 4
+
+// Time at zero throttle before an ESC accepts commands
+#ifndef BLDC_ARM_MS
+#define BLDC_ARM_MS 3000
+#endif
+
+// Endpoint calibration: full throttle until the ESC beeps, then zero
+#define BLDC_CAL_HIGH_MS 4000
+#define BLDC_CAL_LOW_MS 4000
+
+// setThrottles() entry that leaves the channel unchanged
+#define BLDC_KEEP 0xFFFF
+
+class BLDC {
+public:
+    BLDC(PinName BLDC_1, PinName BLDC_2 = NC,
+            PinName BLDC_3 = NC, PinName BLDC_4 = NC,
+            EscProtocol protocol = ESC_PWM50); // Constructor
+
+    // Channel has an output; conflict() says why not
+    bool attached(int Mot_no) const;
+    const char *conflict(int Mot_no) const;
+
+    // Zero throttle, commands are taken after BLDC_ARM_MS
+    void arm(int Mot_no);
+    void disarm(int Mot_no);
+    bool isArmed(int Mot_no) const;
+
+    // Teach the ESC its throttle endpoints; blocks for
+    // BLDC_CAL_HIGH_MS + BLDC_CAL_LOW_MS and leaves the channel disarmed.
+    // Only with the propeller off.
+    void calibrate(int Mot_no);
+
+    // Range (ESC units, 0 - ESC_THROTTLE_MAX) that throttle 0 - 1000 maps to
+    void setLimits(int Mot_no, uint16_t min, uint16_t max);
+
+    // Throttle 0 - 1000, ignored until the channel is armed
+    void setThrottle(int Mot_no, uint16_t throttle);
+    // All channels in the same timer period
+    void setThrottles(const uint16_t throttle[BLDC_CHANNELS]);
+    // Every armed channel to throttle 0
+    void stopAll();
+
+    uint16_t throttle(int Mot_no) const;
+
+private:
+    struct Channel {
+        EscOutput *esc;
+        const char *conflict;   // why esc is NULL
+        uint32_t timer;         // timer and channel, 0 if unknown
+        int channel;
+        uint16_t min;
+        uint16_t max;
+        uint16_t throttle;
+        bool arming;
+        Kernel::Clock::time_point armedAt;
+    };
+
+    bool checkPin(int idx, PinName pin, EscProtocol protocol);
+    bool armed(int idx) const;
+    void writeAll(const uint16_t out[BLDC_CHANNELS]);
+
+    Channel _ch[BLDC_CHANNELS];
+    // ESCs are only built for the attached channels
+    alignas(EscOutput) uint8_t _escStorage[BLDC_CHANNELS][sizeof(EscOutput)];
+
+};
+
 // Music Class Defination
+
+// Tones are PWM on the step pin, stopped by a Timeout. The pin is shared
+// with stepper 1 and goes back to a GPIO output after every note.
+#define MUSIC_DONE_FLAG 0x1
+
 class Music{
 
 public:
 
     Music(PinName StepPin_1, PinName DirPin_1);
     // Method prototyping or member function
+    // Blocking note: pulseCount steps at one per 2 * stepDelay ms, then
+    // a noteDurationMs rest. The thread sleeps while the timer plays.
     void PlayMusic(int pulseCount, float noteDurationMs, float stepDelay);
 
+    // Start a tone and return; the timer ends it after duration_us.
+    // Ignored when the step pin is NC or its timer belongs to another
+    // driver (PinRegistry).
+    void tone(float frequencyHz, uint32_t duration_us);
+    void tonePeriod(uint32_t period_us, uint32_t duration_us);
+    void silence();
+    bool isPlaying() const { return _playing; }
+    // Sleep until the current tone has ended
+    void waitTone();
+    // Give the step pin back to the stepper as a GPIO output
+    void release();
+
 private:
 
+    void toneEnd();
+
 // Pin assignment
-     DigitalOut StepPin1music;   
+     PinName _stepPin;
      DigitalOut DirPin1music;
 
+     // The PwmOut only exists while a tone owns the pin
+     PwmOut *_pwm;
+     alignas(PwmOut) uint8_t _pwmStorage[sizeof(PwmOut)];
+     Timeout _stop;
+     EventFlags _flags;
+     volatile bool _playing;
+
 };
 
 #endif
\ No newline at end of file
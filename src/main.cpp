@@ -1,5 +1,13 @@
 #include "mbed.h"
 #include "VMShield.h"
+#include "MotionPlanner.h"
+#include "CommandProtocol.h"
+#include "CommandDispatch.h"
+#include "ServoMotion.h"
+#include "Sequencer.h"
+#include "Songs.h"
+#include "TimingProbe.h"
+#include "ThreadProfiler.h"
 #include "OLED_Display.h"   // Include your OLED library header
 
 // INITIALIZATIONS
@@ -16,8 +24,17 @@ bool B2_State = false;
 bool B3_State = false;
 bool B4_State = false;
 
-// BLDC PWM 1
-PwmOut pwmPin(PB_1);
+// BLDC ESCs. ESC_PWM50 suits any ESC; OneShot125, Multishot and DShot
+// cut the command latency when the ESC supports them. DShot takes a whole
+// timer: BLDC 2 gets TIM1 and BLDC 3 is refused, and BLDC 1 (PB_1) would
+// need TIM3, which DC EN uses, so it is refused too.
+#ifndef BLDC_PROTOCOL
+#define BLDC_PROTOCOL ESC_PWM50
+#endif
+#define BLDC_1 PB_1
+#define BLDC_2 PB_15
+#define BLDC_3 PB_14
+#define BLDC_4 PB_13
 AnalogIn pot(PA_0); // A0
 
 // PCA9685 Definitions
@@ -29,196 +46,162 @@ AnalogIn pot(PA_0); // A0
 // OLED Definitions (for I2C3)
 #define OLED_SDA PC_9
 #define OLED_SCL PA_8
+#define OLED_I2C_FREQUENCY 400000
 
-// PWM frequency (50Hz) for BLDC
-const float pwmFrequency = 50.0f;
-
-// Min and Max pulse widths in seconds (1ms to 2ms)
-const float minPulseWidth = 0.0012f;
-const float maxPulseWidth = 0.0018f;
+// BLDC throttle range in ESC units (0-1000), 1.2 ms to 1.8 ms on PWM50
+#define BLDC_MIN_THROTTLE 200
+#define BLDC_MAX_THROTTLE 800
 
 // I2C frequency (in Hz)
 #define I2C_FREQUENCY 100000
 
+// Optional quadrature encoders on the DC motors for closed loop control
+// (commands 35 and 36). NC leaves the motor open loop.
+#define DC1_ENCODER_A NC
+#define DC1_ENCODER_B NC
+#define DC2_ENCODER_A NC
+#define DC2_ENCODER_B NC
+#define DC_ENCODER_CPR 1200.0f   // counts per output shaft revolution, x4
+
+// Stepper motion limits (steps/s, steps/s^2, junction deviation in steps)
+#define STEPPER_MAX_SPEED 1500.0f
+#define STEPPER_ACCEL 6000.0f
+#define STEPPER_JUNCTION 1.0f
+
 // Bluetooth Serial (TX: PA_9 -> D8, RX: PA_10 -> D2)
-BufferedSerial bluetooth(PA_9, PA_10, 9600); // TX, RX (assuming UART pins)
+// Unbuffered so the RX interrupt can move bytes straight into rxRing
+UnbufferedSerial bluetooth(PA_9, PA_10, 9600); // TX, RX (assuming UART pins)
+
+// Thread flag set by the RX interrupt
+#define BLUETOOTH_RX_FLAG 0x1
 
 // Motor object creation
 Stepper MyStepper(PA_6, PA_5, PB_6, PA_7, PB_13, PC_7, PB_10, PA_8);
 DC MyDC(PB_5, PB_4, PC_2, PC_3, PC_12, PC_10);
+// After the steppers, so BLDC 4 gives PB_13 up to stepper 3
+BLDC MyBLDC(BLDC_1, BLDC_2, BLDC_3, BLDC_4, BLDC_PROTOCOL);
+
+// Look-ahead queue for streamed stepper moves
+MotionPlanner MyPlanner(MyStepper);
 
 // Initialize I2C1 for Servos
-I2C i2c1(I2C_SDA, I2C_SCL);
+I2CBus i2c1(I2C_SDA, I2C_SCL, I2C_FREQUENCY);
 Servo MyServo(&i2c1, PCA9685_ADDRESS);
-
-// Music object creation
-Music Playit(PA_6, PA_5);
+// Servo trajectories, sent once per 20 ms PWM frame
+ServoMotion ServoFrames(MyServo);
+
+// Music voices on the stepper step pins. A tone sets its timer's period,
+// so voices on a motor PWM timer stay silent: stepper 1 (PA_6) is TIM3,
+// the DC EN timer (PB_4/PB_5), and stepper 3 (PB_13) is TIM1, the BLDC
+// timer. Stepper 4 dir (PA_8) is the OLED clock.
+Music Voice1(NC, NC);
+Music Voice2(PB_6, PA_7);
+Music Voice3(NC, NC);
+Music Voice4(PB_10, NC);
+Sequencer MySequencer(Voice1, Voice2, Voice3, Voice4);
 
 // Initialize I2C3 for OLED
-// I2C i2c3(OLED_SDA, OLED_SCL);
-OLED_Display oled(OLED_SDA,OLED_SCL);
+I2CBus i2c3(OLED_SDA, OLED_SCL, OLED_I2C_FREQUENCY);
+OLED_Display oled(&i2c3);
 
 // I2C Scanner to check if PCA9685 is detected
-void i2cScanner(I2C &i2c) {}
-
-// Buffer to hold incoming data
-const int BUFFER_SIZE = 100;
-char buffer[BUFFER_SIZE];
-int bufferIndex = 0;
-
-// Variables to hold the parsed data
-int MotTypeCode = 0;
-int MotNo = 0;
-int Param1 = 0;
-int Param2 = 0;
-float DTC;
-float pulseWidth;
-float ParampulseWidth;
+void i2cScanner(I2CBus &i2c) {}
 
-// THREADS
-Thread thread_stepper1;
-Thread thread_stepper2;
-Thread thread_dc1;
-Thread thread_dc2;
-Thread thread_bldc1;
-Thread thread_bluetooth;
-Thread thread_servos;
-Thread thread_for_music;
+// Received bytes, decoded in place by the command parser
+CommandRing rxRing;
+CommandParser parser;
 
-// Function for palying music
-void playNote(int pulseCount, float noteDurationMs, float frequencyHz) {
-    float stepDelay = 1000.0f / (frequencyHz * 2.0f);  // Delay for the desired frequency
+// Newest byte time, set by the RX interrupt
+volatile uint32_t rxLastUs = 0;
 
-    Playit.PlayMusic(pulseCount,  noteDurationMs, stepDelay);
+// Runs the decoded commands: quick ones in place, actuator ones on the
+// stepper_cmd, servo_cmd and dc_cmd workers
+CommandDispatch Dispatch(MyPlanner, ServoFrames, MyDC, MyBLDC, MySequencer, parser);
 
+// THREADS
+// Static stacks, so they are in the RAM report rather than on the heap.
+// Each is its peak in test_main_stacks (host, this file run start-up to
+// music) plus a quarter and 200 B for the exception frame, rounded up to
+// 256 B. The printing threads were measured with glibc's printf, which is
+// deeper than the target's minimal-printf.
+#define STACK_STEPPER_XY 1024   // 584 B
+#define STACK_DC 1024           // 488 B
+#define STACK_BLDC 1024         // 504 B
+#define STACK_SERVOS 768        // 312 B
+#define STACK_MUSIC 2560        // 1864 B, printf
+#define STACK_BLUETOOTH 3584    // 2640 B, snprintf replies
+#define STACK_BUTTON 1792       // 1128 B, OLED and All_stop
+
+MBED_ALIGN(8) unsigned char stack_stepperxy[STACK_STEPPER_XY];
+MBED_ALIGN(8) unsigned char stack_dc1[STACK_DC];
+MBED_ALIGN(8) unsigned char stack_dc2[STACK_DC];
+MBED_ALIGN(8) unsigned char stack_bldc1[STACK_BLDC];
+MBED_ALIGN(8) unsigned char stack_bluetooth[STACK_BLUETOOTH];
+MBED_ALIGN(8) unsigned char stack_servos[STACK_SERVOS];
+MBED_ALIGN(8) unsigned char stack_music[STACK_MUSIC];
+MBED_ALIGN(8) unsigned char stack_button[STACK_BUTTON];
+
+Thread thread_stepperxy(osPriorityNormal, sizeof(stack_stepperxy), stack_stepperxy, "stepper_xy");
+Thread thread_dc1(osPriorityNormal, sizeof(stack_dc1), stack_dc1, "dc1");
+Thread thread_dc2(osPriorityNormal, sizeof(stack_dc2), stack_dc2, "dc2");
+Thread thread_bldc1(osPriorityNormal, sizeof(stack_bldc1), stack_bldc1, "bldc1");
+Thread thread_bluetooth(osPriorityNormal, sizeof(stack_bluetooth), stack_bluetooth, "bluetooth");
+Thread thread_servos(osPriorityNormal, sizeof(stack_servos), stack_servos, "servos");
+Thread thread_for_music(osPriorityNormal, sizeof(stack_music), stack_music, "music");
+Thread thread_button(osPriorityNormal, sizeof(stack_button), stack_button, "button");
+
+// CPU share, wakeups and stack use per thread, printed on the console
+// and summarised on the OLED every window
+#define PROFILER_WINDOW_MS 5000
+ThreadProfiler profiler;
+
+// Replies and BUSY answers to the app
+void bluetoothReply(const char *data, int len) {
+    bluetooth.write(data, len);
 }
 
-// Function to process received string
-void processString(char *str) {
-    // Parse the string
-    char temp[3];
-
-    // Extract first two digits
-    temp[0] = str[0];
-    temp[1] = str[1];
-    temp[2] = '\0';
-    MotTypeCode = atoi(temp);
-
-    switch (MotTypeCode)
-    {
-    case 14: // 14 for Stepper Motor
-        // Extract Stepper Motor N0
-        MotNo = str[2] - '0';
-
-        // Extract the Direction
-        Param1 = str[3] - '0';
-
-        // Extract the Steps
-        Param2 = atoi(&str[4]);
-
-        // Execute the function
-        MyStepper.MoveStepper(MotNo, Param1, Param2);
-        break;
-
-    case 24: // 24 for Servo Motor
-        {
-        // Extract Servo Motor
-        char temp1[3];
-
-        // Extract Mot no
-        temp1[0] = str[2];
-        temp1[1] = str[3];
-        temp1[2] = '\0';
-        MotNo = atoi(temp1);
-
-        // Extract the Degree
-        Param1 = atoi(&str[4]);
-
-        i2cScanner(i2c1);
-        Servo MyServo(&i2c1, PCA9685_ADDRESS);
-
-        MyServo.begin();
-        MyServo.setPWMFreq(SERVO_FREQUENCY);
-
-        // Execute the function
-        for (int i = 0; i < Param1; i++) {
-            MyServo.setPWM(MotNo, 0, i);
-            ThisThread::sleep_for(3ms);
-        }
-        }
-        break;
-
-    case 34: // 34 for DC Motor
-        {
-        // Extract Motor No
-        MotNo = str[2] - '0';
-
-        // Extract the Direction
-        Param1 = str[3] - '0';
-
-        // Extract the Duty Cycle
-        Param2 = atoi(&str[4]);
-
-        DTC = Param2 / 100.0f;
-        // Execute the function
-        MyDC.MoveDC(MotNo, Param1, DTC);
-        }
-        break;
-
-    case 44: // 44 for BLDC Motor
-        // Extract Motor No
-        MotNo = str[2] - '0';
-
-        // Extract the Throttle
-        Param1 = atoi(&str[3]);
-
-        float temp2 = Param1 / 1000.0f;
-
-        // Calculate the pulse width based on the potentiometer value
-        ParampulseWidth = minPulseWidth + (temp2 * (maxPulseWidth - minPulseWidth));
-
-        // Set the PWM duty cycle based on the calculated pulse width
-        pwmPin.pulsewidth(ParampulseWidth);
-
-        break;
+// Interrupt context: move every waiting byte into the ring and wake the parser
+void bluetoothRx() {
+    char recv;
+    while (bluetooth.readable()) {
+        bluetooth.read(&recv, 1);
+        if (!rxRing.push(recv)) Dispatch.rxOverflow();
     }
+    rxLastUs = us_ticker_read();
+    thread_bluetooth.flags_set(BLUETOOTH_RX_FLAG);
 }
 
-// Thread for receiving Bluetooth data and controlling LED
+// Thread for receiving Bluetooth commands
 void bluetoothThread() {
-    // Initialize I2C1 for Servos
-    I2C i2c1(I2C_SDA, I2C_SCL);
-    i2c1.frequency(I2C_FREQUENCY);
-
     // Scan for I2C devices
     i2cScanner(i2c1);
-    Servo MyServo(&i2c1, PCA9685_ADDRESS);
 
     MyServo.begin();
     MyServo.setPWMFreq(SERVO_FREQUENCY);
 
     while (true) {
-        // Read data from Bluetooth module
-        if (bluetooth.readable()) {
-            char recv;
-            bluetooth.read(&recv, 1);
-
-            if (recv == '\n' || recv == '\r') { // End of string
-                buffer[bufferIndex] = '\0'; // Null-terminate the string
-                processString(buffer); // Process the received string
-                bufferIndex = 0; // Reset buffer index for next message
-            } else if (bufferIndex < BUFFER_SIZE - 1) { // Add character to buffer
-                buffer[bufferIndex++] = recv;
-            }
+        // Sleep until the RX interrupt has queued bytes
+        ThisThread::flags_wait_any(BLUETOOTH_RX_FLAG);
+
+        // Commands decoded now ended no later than the newest byte seen
+        uint32_t received = rxLastUs;
+
+        Command cmd;
+        while (parser.next(rxRing, cmd)) {
+            cmd.stamp = received;
+            Dispatch.execute(cmd);
         }
-        ThisThread::sleep_for(10ms); // Add a small delay to avoid CPU hogging
     }
 }
 
 // Function to stop all threads
 void All_stop() {
-    thread_stepper1.terminate();
-    thread_stepper2.terminate();
+    thread_stepperxy.terminate();
+    Dispatch.cancel(CMD_STEPPER);
+    Dispatch.cancel(CMD_SERVO);
+    Dispatch.cancel(CMD_DC);
+    MyStepper.stop(1);
+    MyStepper.stop(2);
     thread_dc1.terminate();
     thread_dc2.terminate();
     thread_bldc1.terminate();
@@ -226,11 +209,7 @@ void All_stop() {
 
     ThisThread::sleep_for(200ms);
 
-    float temp2 = 200 / 1000.0f;
-    // Calculate the pulse width based on the potentiometer value
-    ParampulseWidth = minPulseWidth + (temp2 * (maxPulseWidth - minPulseWidth));
-    // Set the PWM duty cycle based on the calculated pulse width
-    pwmPin.pulsewidth(ParampulseWidth);
+    MyBLDC.stopAll();
 
     MyDC.MoveDC(1, 0, 0.00f);
     ThisThread::sleep_for(200ms);
@@ -238,30 +217,16 @@ void All_stop() {
     ThisThread::sleep_for(200ms);
 }
 
-// Thread for Stepper 1
-void thread_stepper_1() {
-    while (1) {
-        MyStepper.MoveStepper(1, 1, 200);
-        ThisThread::sleep_for(1000ms);
-        MyStepper.MoveStepper(1, 1, 800);
-        ThisThread::sleep_for(1000ms);
-        MyStepper.MoveStepper(1, 0, 50);
-        ThisThread::sleep_for(1000ms);
-        MyStepper.MoveStepper(1, 0, 100);
-        ThisThread::sleep_for(1000ms);
-    }
-}
-
-// Thread for Stepper 2
-void thread_stepper_2() {
+// Thread for Steppers 1 and 2, moved together as an XY pair
+void thread_stepper_xy() {
     while (1) {
-        MyStepper.MoveStepper(2, 1, 200);
+        MyStepper.moveLinear(200, 200, 0, 0, true);
         ThisThread::sleep_for(1000ms);
-        MyStepper.MoveStepper(2, 1, 800);
+        MyStepper.moveLinear(800, 800, 0, 0, true);
         ThisThread::sleep_for(1000ms);
-        MyStepper.MoveStepper(2, 0, 50);
+        MyStepper.moveLinear(-50, -50, 0, 0, true);
         ThisThread::sleep_for(1000ms);
-        MyStepper.MoveStepper(2, 0, 100);
+        MyStepper.moveLinear(-100, -100, 0, 0, true);
         ThisThread::sleep_for(1000ms);
     }
 }
@@ -294,27 +259,21 @@ void thread_dc_2() {
 void thread_servo_1() {
     while (1) {
         // Positive rotation
-        for (int i = 0; i < 180; i++) {
-            MyServo.setPWM(0, 0, i);
-            MyServo.setPWM(1, 0, i);
-            MyServo.setPWM(2, 0, i);
-            MyServo.setPWM(3, 0, i);
-            MyServo.setPWM(4, 0, i);
-            MyServo.setPWM(5, 0, i);
-            thread_sleep_for(3);
+        for (int ch = 0; ch < 6; ch++) {
+            ServoFrames.moveTo(ch, SERVO_MAX_ANGLE);
+        }
+        while (!ServoFrames.isIdle()) {
+            thread_sleep_for(20);
         }
 
         thread_sleep_for(500);
 
         // Negative rotation
-        for (int i = 180; i > 0; i--) {
-            MyServo.setPWM(0, 0, i);
-            MyServo.setPWM(1, 0, i);
-            MyServo.setPWM(2, 0, i);
-            MyServo.setPWM(3, 0, i);
-            MyServo.setPWM(4, 0, i);
-            MyServo.setPWM(5, 0, i);
-            thread_sleep_for(3);
+        for (int ch = 0; ch < 6; ch++) {
+            ServoFrames.moveTo(ch, 0);
+        }
+        while (!ServoFrames.isIdle()) {
+            thread_sleep_for(20);
         }
 
         thread_sleep_for(500);
@@ -323,166 +282,30 @@ void thread_servo_1() {
 
 // Thread for BLDC 1
 void thread_bldc_1() {
-    // Set the PWM frequency
-    pwmPin.period(1.0f / pwmFrequency);
-
     while (true) {
-        // Read the potentiometer value (0.0 to 1.0)
-        float potValue = pot.read();
-
-        // Calculate the pulse width based on the potentiometer value
-        float pulseWidth = minPulseWidth + (potValue * (maxPulseWidth - minPulseWidth));
-
-        // Set the PWM duty cycle based on the calculated pulse width
-        pwmPin.pulsewidth(pulseWidth);
+        // Read the potentiometer value (0 to 1000)
+        MyBLDC.setThrottle(1, pot.read_u16() * 1000 / 65535);
 
         // Small delay to debounce the potentiometer reading
         thread_sleep_for(10);  // 10ms delay
     }
 }
 
-// Thread for music
+// Thread for music: the built-in songs, 2 s apart
 void thread_music(){
     while(1) {
+        for (unsigned i = 0; i < SONG_COUNT; i++) {
+            const Song &song = SONGS[i];
+            if (!MySequencer.play(song.events, song.count, SONG_TICK_US)) break;
+            MySequencer.wait();
+
+            printf("SONG %s %u bytes %lu notes %lu ms late avg %lu max %lu us\n", song.name,
+                   (unsigned)(song.count * sizeof(ScoreEvent)), (unsigned long)MySequencer.notes(),
+                   (unsigned long)(MySequencer.lengthTicks() * (SONG_TICK_US / 1000)),
+                   (unsigned long)MySequencer.avgLateUs(), (unsigned long)MySequencer.maxLateUs());
 
-        // Pirates of Caribbean
-        thread_sleep_for(20); // Rest
-        playNote(100, 50, 293.66); // D
-        playNote(100, 50, 293.66); // D
-        playNote(100, 0, 220.00); // A <- Start
-        playNote(100, 0, 261.63); // C
-        playNote(100, 10, 293.66); // D
-        playNote(100, 10, 293.66); // D
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 329.63); // E
-        playNote(100, 10, 349.23); // F
-        playNote(100, 10, 349.23); // F
-        playNote(100, 0, 349.23); // F
-        playNote(100, 0, 392.00); // G
-        playNote(100, 10, 329.63); // E
-        playNote(100, 10, 329.63); // E
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 261.63); // C
-        playNote(100, 0, 261.63); // C
-        playNote(100, 10, 293.66); // D <End
-        thread_sleep_for(30); // Rest<<<<<<<<<<<<<<<<<<<<<<
-        playNote(100, 0, 220.00); // A <- Start
-        playNote(100, 0, 261.63); // C
-        playNote(100, 10, 293.66); // D
-        playNote(100, 10, 293.66); // D
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 329.63); // E
-        playNote(100, 10, 349.23); // F
-        playNote(100, 10, 349.23); // F
-        playNote(100, 0, 349.23); // F
-        playNote(100, 0, 392.00); // G
-        playNote(100, 10, 329.63); // E
-        playNote(100, 10, 329.63); // E
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 261.63); // C
-        playNote(100, 0, 261.63); // C
-        playNote(100, 10, 293.66); // D <End
-        thread_sleep_for(30); // Rest<<<<<<<<<<<<<<<<<<<<<<
-        playNote(100, 0, 220.00); // A
-        playNote(100, 0, 261.63); // C
-        playNote(100, 10, 293.66); // D
-        playNote(100, 10, 293.66); // D
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 349.23); // F
-        playNote(100, 10, 392.00); // G
-        playNote(100, 10, 392.00); // G
-        playNote(100, 0, 392.00); // G
-        playNote(100, 0, 440.00); // A
-        playNote(100, 10, 466.16); // A#
-        playNote(100, 10, 466.16); // A#
-        playNote(100, 0, 440.00); // A
-        playNote(100, 0, 392.00); // G
-        playNote(100, 0, 440.00); // A
-        playNote(100, 10, 293.66); // D
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 329.63); // E
-        playNote(100, 0, 349.23); // F
-        playNote(100, 0, 392.00); // G
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 349.23); // F
-        playNote(100, 0, 329.63); // E
-        playNote(100, 0, 349.23); // F
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 329.63); // E
-        playNote(100, 0, 440.00); // A
-        playNote(100, 0, 261.63); // C
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 329.63); // E
-        playNote(100, 0, 349.23); // F
-        playNote(100, 0, 349.23); // F
-        playNote(100, 0, 349.23); // F
-        playNote(100, 0, 392.00); // G
-        playNote(100, 0, 329.63); // E
-        playNote(100, 0, 329.63); // E
-        playNote(100, 0, 293.66); // D
-        playNote(100, 0, 261.63); // C
-        playNote(100, 0, 293.66); // D <-End
-
-        thread_sleep_for(2000);
-
-       // Beethoven
-        // E E♭ E E♭ E
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-        playNote(80, 0, 622.25 / 2); // E♭ (311.13 Hz)
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-        playNote(80, 0, 622.25 / 2); // E♭ (311.13 Hz)
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-
-        // B D C A
-        playNote(80, 0, 493.88 / 2); // B (246.94 Hz)
-        playNote(80, 0, 587.33 / 2); // D (293.66 Hz)
-        playNote(80, 0, 523.25 / 2); // C (261.63 Hz)
-        playNote(130, 60, 440.00 / 2); // A (220.00 Hz)
-
-        // C E A B
-        playNote(80, 0, 523.25 / 2); // C (261.63 Hz)
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-        playNote(80, 0, 440.00 / 2); // A (220.00 Hz)
-        playNote(130, 60, 493.88 / 2); // B (246.94 Hz)
-
-        // E A B C
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-        playNote(80, 0, 440.00 / 2); // A (220.00 Hz)
-        playNote(80, 0, 493.88 / 2); // B (246.94 Hz)
-        playNote(130, 60, 523.25 / 2); // C (261.63 Hz)
-
-        // <- ##############
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-        playNote(80, 0, 622.25 / 2); // E♭ (311.13 Hz)
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-        playNote(80, 0, 622.25 / 2); // E♭ (311.13 Hz)
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-
-        // B D C A
-        playNote(80, 0, 493.88 / 2); // B (246.94 Hz)
-        playNote(80, 0, 587.33 / 2); // D (293.66 Hz)
-        playNote(80, 0, 523.25 / 2); // C (261.63 Hz)
-        playNote(130, 60, 440.00 / 2); // A (220.00 Hz)
-
-        // C E A B
-        playNote(80, 0, 523.25 / 2); // C (261.63 Hz)
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-        playNote(80, 0, 440.00 / 2); // A (220.00 Hz)
-        playNote(130, 60, 493.88 / 2); // B (246.94 Hz)
-
-        // E C B A
-        playNote(80, 0, 659.25 / 2); // E (329.63 Hz)
-        playNote(80, 0, 523.25 / 2); // C (261.63 Hz)
-        playNote(80, 0, 493.88 / 2); // B (246.94 Hz)
-        playNote(130, 60, 440.00 / 2); // A (220.00 Hz)
-
-        // <- ##############
-
-        thread_sleep_for(2000);
-    
+            ThisThread::sleep_for(2000ms);
+        }
     }
 }
 
@@ -509,13 +332,11 @@ void ButtonThread() {
         if (currentButton2State != lastButton2State && currentButton2State == 1) { // RTOS parallel task
             B2_State = !B2_State;
             if (B2_State) {
-                thread_stepper1.start(thread_stepper_1);
-                thread_stepper2.start(thread_stepper_2);
+                thread_stepperxy.start(thread_stepper_xy);
                 thread_dc1.start(thread_dc_1);
                 thread_dc2.start(thread_dc_2);
                 thread_bldc1.start(thread_bldc_1);
 
-                Servo MyServo(&i2c1, PCA9685_ADDRESS);
                 MyServo.begin();
                 MyServo.setPWMFreq(SERVO_FREQUENCY);
 
@@ -532,7 +353,6 @@ void ButtonThread() {
                 oled.print_string("MUSIC",10,2);
                 ThisThread::sleep_for(4000ms);
 
-                Servo MyServo(&i2c1, PCA9685_ADDRESS);
                 MyServo.begin();
                 MyServo.setPWMFreq(SERVO_FREQUENCY);
 
@@ -549,19 +369,38 @@ void ButtonThread() {
 
 int main() {
 
-        float temp2 = 200 / 1000.0f;
+    // Cycle counter for the timing probes, if built in
+    timingInit();
+
+    // Ramp the steppers up to speed instead of the fixed 4 ms step period
+    for (int i = 1; i <= 4; i++) {
+        MyStepper.setMotion(i, STEPPER_MAX_SPEED, STEPPER_ACCEL);
+    }
+    MyPlanner.configure(STEPPER_MAX_SPEED, STEPPER_ACCEL, STEPPER_JUNCTION);
 
-        // Calculate the pulse width based on the potentiometer value
-        ParampulseWidth = minPulseWidth + (temp2 * (maxPulseWidth - minPulseWidth));
+    // Encoders for whichever DC motors have them fitted
+    if (DC1_ENCODER_A != NC) {
+        static InterruptEncoder dc1Encoder(DC1_ENCODER_A, DC1_ENCODER_B);
+        MyDC.attachEncoder(1, &dc1Encoder, DC_ENCODER_CPR);
+    }
+    if (DC2_ENCODER_A != NC) {
+        static InterruptEncoder dc2Encoder(DC2_ENCODER_A, DC2_ENCODER_B);
+        MyDC.attachEncoder(2, &dc2Encoder, DC_ENCODER_CPR);
+    }
 
-        // Set the PWM duty cycle based on the calculated pulse width
-        pwmPin.pulsewidth(ParampulseWidth);
+    // ESCs see zero throttle until they arm
+    for (int i = 1; i <= BLDC_CHANNELS; i++) {
+        MyBLDC.setLimits(i, BLDC_MIN_THROTTLE, BLDC_MAX_THROTTLE);
+        MyBLDC.arm(i);
+        if (!MyBLDC.attached(i)) printf("BLDC %d off: %s\n", i, MyBLDC.conflict(i));
+    }
 
     // Start Button thread
-    Thread Thread_Button;
-    Thread_Button.start(ButtonThread);
+    thread_button.start(ButtonThread);
 
+    Dispatch.onReply(bluetoothReply);
     thread_bluetooth.start(bluetoothThread);
+    bluetooth.attach(bluetoothRx, SerialBase::RxIrq);
 
     // Initialize OLED display
         oled.begin(); 
@@ -576,7 +415,40 @@ int main() {
         oled.setCursor(0,0);
         oled.print_string("Bluetooth",10,2);
 
+    // Every thread, running or not yet started
+    profiler.add(thread_stepperxy);
+    profiler.add(thread_dc1);
+    profiler.add(thread_dc2);
+    profiler.add(thread_bldc1);
+    profiler.add(thread_servos);
+    profiler.add(thread_for_music);
+    profiler.add(thread_bluetooth);
+    profiler.add(thread_button);
+    profiler.add(Dispatch.stepperThread());
+    profiler.add(Dispatch.servoThread());
+    profiler.add(Dispatch.dcThread());
+    profiler.add(ServoFrames.thread());
+    profiler.add(MySequencer.thread());
+    profiler.add(i2c1.thread(), "i2c1_bus");
+    profiler.add(i2c3.thread(), "i2c3_bus");
+    profiler.start();
+
     while (1) {
-        ThisThread::sleep_for(1000ms); // Main thread sleeps, letting other threads run
+        ThisThread::sleep_for(std::chrono::milliseconds(PROFILER_WINDOW_MS)); // Main thread sleeps, letting other threads run
+        profiler.update();
+
+        char line[64];
+        profiler.summary(line, sizeof(line));
+        printf("%s", line);
+        for (int i = 0; i < profiler.threads(); i++) {
+            profiler.line(i, line, sizeof(line));
+            printf("%s", line);
+        }
+
+        // Bottom row, 12 characters: load and the busiest thread
+        int top = profiler.busiest();
+        snprintf(line, sizeof(line), "CPU%3lu%% %-4.4s", (unsigned long)profiler.load(),
+                 top < 0 ? "" : profiler.name(top));
+        oled.print_string(line, 0, 6);
     }
 }
@@ -0,0 +1,72 @@
+/**
+ ******************************************************************************
+ * @file    HostTest.h
+ * @brief   Minimal checks for the host unit tests.
+ ******************************************************************************
+ * @attention
+ *
+ * Each test program is a list of plain functions run from main() with
+ * RUN(). A failed CHECK prints its location and the program exits
+ * non-zero at the end, which is all CTest looks at. The trace is cleared
+ * before every test; the virtual clock keeps running.
+ *
+ ******************************************************************************
+ */
+
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include "mbed.h"
+
+#include <stdio.h>
+#include <vector>
+
+namespace host {
+
+inline int &testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+// Virtual time in us of every change of pin to level since the trace
+// was last cleared
+inline std::vector<uint64_t> pinEdgesUs(int pin, int level) {
+    std::vector<uint64_t> out;
+    for (const TraceEvent &e : traceEvents()) {
+        if (e.kind == TRACE_PIN && e.id == pin && e.a == level) out.push_back(e.ns / 1000);
+    }
+    return out;
+}
+
+} // namespace host
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            host::testFailures()++;                                             \
+        }                                                                       \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                          \
+    do {                                                                        \
+        long long _a = (long long)(a), _b = (long long)(b);                     \
+        if (_a != _b) {                                                         \
+            fprintf(stderr, "%s:%d: %s == %s failed: %lld != %lld\n", __FILE__,  \
+                    __LINE__, #a, #b, _a, _b);                                  \
+            host::testFailures()++;                                             \
+        }                                                                       \
+    } while (0)
+
+#define RUN(test)                                                               \
+    do {                                                                        \
+        int _before = host::testFailures();                                     \
+        host::traceClear();                                                     \
+        test();                                                                 \
+        fprintf(stderr, "%s %s\n", _before == host::testFailures() ? "ok  " : "FAIL", #test); \
+    } while (0)
+
+// Exit status of the test program
+#define TEST_RESULT() (host::testFailures() ? 1 : 0)
+
+#endif
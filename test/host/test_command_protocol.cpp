@@ -0,0 +1,162 @@
+/**
+ ******************************************************************************
+ * @file    test_command_protocol.cpp
+ * @brief   Range checks of the ASCII and binary stepper, linear, servo
+ *          and BLDC commands.
+ ******************************************************************************
+ */
+
+#include "HostTest.h"
+#include "CommandProtocol.h"
+
+static void pushBytes(CommandRing &ring, const uint8_t *data, int len) {
+    for (int i = 0; i < len; i++) ring.push(data[i]);
+}
+
+static void pushStepperFrame(CommandRing &ring, uint8_t motor, uint8_t dir, uint32_t steps) {
+    uint8_t payload[6] = { motor, dir, (uint8_t)steps, (uint8_t)(steps >> 8),
+                           (uint8_t)(steps >> 16), (uint8_t)(steps >> 24) };
+    uint8_t frame[sizeof(payload) + COMMAND_FRAME_OVERHEAD];
+    pushBytes(ring, frame, encodeFrame(CMD_STEPPER, payload, sizeof(payload), frame));
+}
+
+static void pushLinearFrame(CommandRing &ring, const int32_t delta[4], uint16_t speed) {
+    uint8_t payload[18];
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 4; b++) payload[4 * i + b] = (uint32_t)delta[i] >> (8 * b);
+    }
+    payload[16] = speed;
+    payload[17] = speed >> 8;
+    uint8_t frame[sizeof(payload) + COMMAND_FRAME_OVERHEAD];
+    pushBytes(ring, frame, encodeFrame(CMD_LINEAR, payload, sizeof(payload), frame));
+}
+
+static void pushLine(CommandRing &ring, const char *line) {
+    pushBytes(ring, (const uint8_t *)line, strlen(line));
+}
+
+static void testBinaryStepper() {
+    CommandRing ring;
+    CommandParser parser;
+    Command cmd;
+
+    pushStepperFrame(ring, 2, 1, 0x7FFFFFFF);
+    CHECK(parser.next(ring, cmd));
+    CHECK_EQ(cmd.code, CMD_STEPPER);
+    CHECK_EQ(cmd.motor, 2);
+    CHECK_EQ(cmd.dir, 1);
+    CHECK_EQ(cmd.value, 0x7FFFFFFF);
+
+    pushStepperFrame(ring, 1, 0, 0x80000000u);
+    pushStepperFrame(ring, 1, 2, 100);
+    pushStepperFrame(ring, 0, 1, 100);
+    pushStepperFrame(ring, 5, 1, 100);
+    CHECK(!parser.next(ring, cmd));
+    CHECK_EQ(parser.rejected(), 4);
+    CHECK_EQ(parser.frames(), 1);
+    CHECK_EQ(ring.size(), 0);
+}
+
+static void testAsciiStepper() {
+    CommandRing ring;
+    CommandParser parser;
+    Command cmd;
+
+    pushLine(ring, "14410250\n");
+    CHECK(parser.next(ring, cmd));
+    CHECK_EQ(cmd.motor, 4);
+    CHECK_EQ(cmd.dir, 1);
+    CHECK_EQ(cmd.value, 250);
+
+    pushLine(ring, "1412100\n1451100\n14119999999999\n1411-5\n");
+    CHECK(!parser.next(ring, cmd));
+    CHECK_EQ(parser.rejected(), 4);
+    CHECK_EQ(parser.lines(), 1);
+}
+
+// Every delta must be negatable: INT32_MIN and anything past the int32
+// range are refused
+static void testBinaryLinear() {
+    CommandRing ring;
+    CommandParser parser;
+    Command cmd;
+
+    const int32_t ok[4] = { INT32_MAX, -INT32_MAX, 0, -5 };
+    pushLinearFrame(ring, ok, 800);
+    CHECK(parser.next(ring, cmd));
+    CHECK_EQ(cmd.code, CMD_LINEAR);
+    CHECK_EQ(cmd.delta[0], INT32_MAX);
+    CHECK_EQ(cmd.delta[1], -INT32_MAX);
+    CHECK_EQ(cmd.delta[3], -5);
+    CHECK(cmd.speed == 800.0f);
+
+    const int32_t low[4] = { 10, 0, INT32_MIN, 0 };
+    pushLinearFrame(ring, low, 0);
+    CHECK(!parser.next(ring, cmd));
+    CHECK_EQ(parser.rejected(), 1);
+    CHECK_EQ(ring.size(), 0);
+}
+
+static void testAsciiLinear() {
+    CommandRing ring;
+    CommandParser parser;
+    Command cmd;
+
+    pushLine(ring, "15100,-2147483647,0,3,500\n");
+    CHECK(parser.next(ring, cmd));
+    CHECK_EQ(cmd.delta[0], 100);
+    CHECK_EQ(cmd.delta[1], -INT32_MAX);
+    CHECK_EQ(cmd.delta[3], 3);
+    CHECK(cmd.speed == 500.0f);
+
+    pushLine(ring, "150,-2147483648,0,0\n1599999999999,0,0,0\n150,0,0,-99999999999\n");
+    CHECK(!parser.next(ring, cmd));
+    CHECK_EQ(parser.rejected(), 3);
+    CHECK_EQ(parser.lines(), 1);
+}
+
+static void pushLevelFrame(CommandRing &ring, uint8_t code, uint8_t motor, uint16_t value) {
+    uint8_t payload[3] = { motor, (uint8_t)value, (uint8_t)(value >> 8) };
+    uint8_t frame[sizeof(payload) + COMMAND_FRAME_OVERHEAD];
+    pushBytes(ring, frame, encodeFrame(code, payload, sizeof(payload), frame));
+}
+
+// Servo degrees and BLDC throttle are refused past their range rather
+// than scaled into an overflow or a throttle above full
+static void testServoAndThrottle() {
+    CommandRing ring;
+    CommandParser parser;
+    Command cmd;
+
+    pushLevelFrame(ring, CMD_SERVO, 3, COMMAND_MAX_DEGREES);
+    CHECK(parser.next(ring, cmd));
+    CHECK_EQ(cmd.value, COMMAND_MAX_DEGREES);
+    pushLevelFrame(ring, CMD_BLDC, 1, COMMAND_MAX_THROTTLE);
+    CHECK(parser.next(ring, cmd));
+    CHECK_EQ(cmd.value, COMMAND_MAX_THROTTLE);
+    pushLine(ring, "2403090\n442500\n");
+    CHECK(parser.next(ring, cmd));
+    CHECK_EQ(cmd.motor, 3);
+    CHECK_EQ(cmd.value, 90);
+    CHECK(parser.next(ring, cmd));
+    CHECK_EQ(cmd.motor, 2);
+    CHECK_EQ(cmd.value, 500);
+
+    pushLevelFrame(ring, CMD_SERVO, 3, COMMAND_MAX_DEGREES + 1);
+    pushLevelFrame(ring, CMD_BLDC, 1, 0xFFFF);
+    CHECK(!parser.next(ring, cmd));
+    CHECK_EQ(parser.rejected(), 2);
+
+    pushLine(ring, "240399999999999\n2403-1\n4411001\n441-20\n");
+    CHECK(!parser.next(ring, cmd));
+    CHECK_EQ(parser.rejected(), 6);
+}
+
+int main() {
+    RUN(testBinaryStepper);
+    RUN(testAsciiStepper);
+    RUN(testBinaryLinear);
+    RUN(testAsciiLinear);
+    RUN(testServoAndThrottle);
+    return TEST_RESULT();
+}
@@ -0,0 +1,89 @@
+/**
+ ******************************************************************************
+ * @file    test_esc_output.cpp
+ * @brief   DShot frame bits and the timer ownership BLDC checks.
+ ******************************************************************************
+ * @attention
+ *
+ * The DMA transfer itself only exists on the target; what it sends is
+ * the buffer built here, so the frame layout and the compare value of
+ * every bit are checked against hand-computed values.
+ *
+ ******************************************************************************
+ */
+
+#include "HostTest.h"
+#include "EscOutput.h"
+#include "VMShield.h"
+
+static uint16_t crcOf(uint16_t frame) {
+    uint16_t v = frame >> 4;
+    return (v ^ (v >> 4) ^ (v >> 8)) & 0xF;
+}
+
+static void testThrottleValue() {
+    CHECK_EQ(dshotValue(0), 0);
+    CHECK_EQ(dshotValue(1), DSHOT_THROTTLE_MIN + 1);
+    CHECK_EQ(dshotValue(500), 1047);
+    CHECK_EQ(dshotValue(ESC_THROTTLE_MAX), DSHOT_THROTTLE_MAX);
+    CHECK_EQ(dshotValue(ESC_THROTTLE_MAX + 1), DSHOT_THROTTLE_MAX);
+}
+
+// Value in the top 11 bits, telemetry request below it, CRC in the low
+// nibble
+static void testFrameLayout() {
+    CHECK_EQ(dshotFrame(1046), 0x82C6);
+    CHECK_EQ(dshotFrame(1046, true), 0x82D7);
+    CHECK_EQ(dshotFrame(0), 0x0000);
+    CHECK_EQ(dshotFrame(DSHOT_THROTTLE_MAX), 0xFFEE);
+
+    for (uint16_t value = 0; value <= DSHOT_THROTTLE_MAX; value++) {
+        for (int telemetry = 0; telemetry < 2; telemetry++) {
+            uint16_t frame = dshotFrame(value, telemetry);
+            if (frame >> 5 != value || ((frame >> 4) & 1) != telemetry || (frame & 0xF) != crcOf(frame)) {
+                CHECK_EQ(frame, value);
+                return;
+            }
+        }
+    }
+}
+
+// MSB first, one compare value per bit, then low periods to end the frame
+static void testBitsToCompare() {
+    const uint32_t one = 90, zero = 45;
+    uint32_t out[DSHOT_BUFFER_LEN];
+    for (int i = 0; i < DSHOT_BUFFER_LEN; i++) out[i] = 0xFFFF;
+
+    dshotBits(0x82C6, one, zero, out);
+    const char *expect = "1000001011000110";
+    for (int i = 0; i < DSHOT_FRAME_BITS; i++) {
+        CHECK_EQ(out[i], expect[i] == '1' ? one : zero);
+    }
+    for (int i = DSHOT_FRAME_BITS; i < DSHOT_BUFFER_LEN; i++) {
+        CHECK_EQ(out[i], 0);
+    }
+}
+
+// A timer held by one driver is refused to another; timer 0 stands for
+// "no timer" and is never refused
+static void testTimerOwnership() {
+    static const char *dc = "DC";
+    static const char *bldc = "BLDC";
+
+    CHECK(PinRegistry::claimTimer(0x40000400, dc));
+    CHECK(PinRegistry::claimTimer(0x40000400, dc));
+    CHECK(!PinRegistry::claimTimer(0x40000400, bldc));
+    CHECK(PinRegistry::timerOwner(0x40000400) == dc);
+    CHECK(PinRegistry::timerOwner(0x40010000) == NULL);
+    CHECK(PinRegistry::claimTimer(0x40010000, bldc));
+    CHECK(PinRegistry::claimTimer(0, dc));
+    CHECK(PinRegistry::claimTimer(0, bldc));
+}
+
+int main() {
+    RUN(testThrottleValue);
+    RUN(testFrameLayout);
+    RUN(testBitsToCompare);
+    RUN(testTimerOwnership);
+    return TEST_RESULT();
+}
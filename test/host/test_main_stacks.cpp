@@ -0,0 +1,105 @@
+/**
+ ******************************************************************************
+ * @file    test_main_stacks.cpp
+ * @brief   Stack use of the application threads in main.cpp.
+ ******************************************************************************
+ * @attention
+ *
+ * main.cpp is built in with its main() renamed to firmware_main() and run
+ * the way the board runs: start-up and the OLED splash, a burst of
+ * Bluetooth commands of every kind, button 2 to start the RTOS demo
+ * threads, and button 2 again to stop them and play both songs.
+ *
+ * Every thread's host peak, plus the margin main.cpp states for its
+ * STACK_* sizes (a quarter, and 200 B for the exception frame), must fit
+ * the stack it is given. glibc's printf is deeper than the target's
+ * minimal-printf, so the printing threads are measured on the safe side.
+ *
+ ******************************************************************************
+ */
+
+#include "HostTest.h"
+#include "CommandProtocol.h"
+
+#define STACK_MARGIN(peak) ((peak) + (peak) / 4 + 200)
+
+extern UnbufferedSerial bluetooth;
+extern Thread thread_stepperxy;
+extern Thread thread_dc1;
+extern Thread thread_dc2;
+extern Thread thread_bldc1;
+extern Thread thread_bluetooth;
+extern Thread thread_servos;
+extern Thread thread_for_music;
+extern Thread thread_button;
+
+int firmware_main();
+
+static void firmwareMain() {
+    firmware_main();
+}
+
+// Button 2 (PC_6), polled every 50 ms
+static void pressButton2() {
+    host::setPin(PC_6, 1);
+    host::runFor(200000);
+    host::setPin(PC_6, 0);
+    host::runFor(200000);
+}
+
+static void send(const char *text) {
+    bluetooth.receive(text, strlen(text));
+}
+
+static void sendFrame(uint8_t code, const uint8_t *payload, int len) {
+    uint8_t frame[COMMAND_MAX_PAYLOAD + COMMAND_FRAME_OVERHEAD];
+    bluetooth.receive((const char *)frame, encodeFrame(code, payload, len, frame));
+}
+
+static void checkStack(const Thread &thread) {
+    uint32_t peak = thread.max_stack();
+    fprintf(stderr, "  %-12s %5lu B, needs %5lu of %5lu\n", thread.get_name(), (unsigned long)peak,
+            (unsigned long)STACK_MARGIN(peak), (unsigned long)thread.stack_size());
+    CHECK(peak > 0);
+    CHECK(STACK_MARGIN(peak) <= thread.stack_size());
+}
+
+static void testApplicationStacks() {
+    // Growing the trace allocates on whichever thread writes a pin
+    host::traceEnable(false);
+
+    // The target's main thread gets the default OS_STACK_SIZE too
+    Thread mainThread(osPriorityNormal, OS_STACK_SIZE, nullptr, "main");
+    mainThread.start(firmwareMain);
+    host::runFor(6000000);
+
+    // Replies, stats, every actuator, a cancel, and a score upload
+    send("09\n19\n29\n291\n14110\n1410200\n15100,-50,0,0,300\n!2403090\n3420050\n3510\n3610\n4421500\n0814\n");
+    const uint8_t score[] = { 0, 0, 60, 0x40, 8, 64, 0x40, 8, 67, 0x40, 8, 72, 0x40, 8 };
+    sendFrame(CMD_SCORE, score, sizeof(score));
+    const uint8_t play[] = { 4, 0, 0xE8, 0x03 };
+    sendFrame(CMD_PLAY, play, sizeof(play));
+    host::runFor(3000000);
+
+    pressButton2();
+    host::runFor(15000000);
+    pressButton2();
+    // Splash, both songs and the pauses after them
+    host::runFor(45000000);
+
+    // Busy replies while a song plays
+    sendFrame(CMD_PLAY, play, sizeof(play));
+    send("09\n");
+    host::runFor(1000000);
+
+    const Thread *threads[] = { &thread_stepperxy, &thread_dc1, &thread_dc2, &thread_bldc1, &thread_servos,
+                                &thread_for_music, &thread_bluetooth, &thread_button, &mainThread };
+    for (const Thread *thread : threads) {
+        checkStack(*thread);
+    }
+}
+
+int main() {
+    RUN(testApplicationStacks);
+    return TEST_RESULT();
+}
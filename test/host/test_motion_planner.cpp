@@ -0,0 +1,163 @@
+/**
+ ******************************************************************************
+ * @file    test_motion_planner.cpp
+ * @brief   Planner and Stepper stop paths on the simulated step timer.
+ ******************************************************************************
+ * @attention
+ *
+ * A move that is stopped part way must leave the planner free to run the
+ * next one: All_stop in main.cpp clears the planner and stops the motors,
+ * then Bluetooth keeps sending 14/15 commands.
+ *
+ ******************************************************************************
+ */
+
+#include "HostTest.h"
+#include "MotionPlanner.h"
+
+#define SETTLE_US 10000000
+
+static Stepper stepper(PA_6, PA_5, PB_6, PA_7, PB_13, PC_7, PB_10, PA_8);
+static MotionPlanner planner(stepper);
+
+static bool idle() {
+    return planner.isIdle() && !stepper.isLinearBusy();
+}
+
+static size_t steps(int pin) {
+    return host::pinEdgesUs(pin, 1).size();
+}
+
+// The All_stop sequence, then a new move
+static void testClearThenStop() {
+    CHECK(planner.push(1000, 0, 0, 0));
+    host::runFor(100000);
+    CHECK(!planner.isIdle());
+
+    planner.clear();
+    stepper.stop(1);
+    CHECK(idle());
+    CHECK_EQ(planner.depth(), 0);
+    size_t stopped = steps(PA_6);
+    CHECK(stopped > 0 && stopped < 1000);
+
+    CHECK(planner.push(0, 500, 0, 0));
+    CHECK(!planner.isIdle());
+    CHECK(host::runUntil(idle, SETTLE_US));
+    CHECK_EQ(steps(PB_6), 500);
+    CHECK_EQ(steps(PA_6), stopped);
+}
+
+// A stop on an axis of the running block also drops what was queued
+static void testStopThenPush() {
+    CHECK(planner.push(400, 0, 0, 0));
+    CHECK(planner.push(0, 400, 0, 0));
+    CHECK(planner.push(400, 0, 0, 0));
+    host::runFor(100000);
+
+    stepper.stop(1);
+    CHECK(idle());
+    CHECK_EQ(planner.depth(), 0);
+    host::runFor(100000);
+    CHECK_EQ(steps(PB_6), 0);
+
+    CHECK(planner.push(0, 0, 0, 300));
+    CHECK(host::runUntil(idle, SETTLE_US));
+    CHECK_EQ(steps(PB_10), 300);
+}
+
+// Stopping a motor outside the running block changes nothing
+static void testStopOtherAxis() {
+    CHECK(planner.push(300, 300, 0, 0));
+    host::runFor(50000);
+    stepper.stop(3);
+    CHECK(!planner.isIdle());
+    CHECK(host::runUntil(idle, SETTLE_US));
+    CHECK_EQ(steps(PA_6), 300);
+    CHECK_EQ(steps(PB_6), 300);
+}
+
+// A full queue empties on a stop, so the pushing thread is not stuck
+static void testFullQueueStop() {
+    int pushed = 0;
+    while (planner.push(pushed % 2 ? 100 : -100, 100, 0, 0)) {
+        pushed++;
+    }
+    CHECK(pushed >= MOTION_QUEUE_SIZE);
+    host::runFor(20000);
+
+    stepper.stop(2);
+    CHECK(idle());
+    CHECK(planner.push(100, 0, 0, 0));
+    CHECK(host::runUntil(idle, SETTLE_US));
+}
+
+static volatile bool linearDone;
+
+static void linearWaiter() {
+    stepper.moveLinear(500, 500, 0, 0, true);
+    linearDone = true;
+}
+
+// A blocked moveLinear() wakes when one of its own axes is stopped only
+static void testLinearWaiter() {
+    Thread waiter(osPriorityNormal, OS_STACK_SIZE, nullptr, "waiter");
+    linearDone = false;
+    waiter.start(linearWaiter);
+    host::runFor(50000);
+    CHECK(stepper.isLinearBusy());
+
+    stepper.stop(4);
+    host::runFor(1000);
+    CHECK(!linearDone);
+
+    stepper.stop(2);
+    host::runFor(1000);
+    CHECK(linearDone);
+    CHECK(!stepper.isLinearBusy());
+    waiter.join();
+}
+
+static bool linearFinished() {
+    return linearDone;
+}
+
+static void longWaiter() {
+    stepper.moveLinear(300, 0, 0, 0, true);
+    linearDone = true;
+}
+
+// Queued blocks that chain onto a direct moveLinear() do not hold its
+// caller until the queue drains
+static void testWaiterBeforeQueue() {
+    Thread waiter(osPriorityNormal, OS_STACK_SIZE, nullptr, "waiter");
+    linearDone = false;
+    waiter.start(longWaiter);
+    host::runFor(20000);
+    CHECK(stepper.isLinearBusy());
+
+    CHECK(planner.push(0, 2000, 0, 0));
+    CHECK(host::runUntil(linearFinished, SETTLE_US));
+    CHECK_EQ(steps(PA_6), 300);
+    CHECK(steps(PB_6) < 2000);
+    CHECK(!planner.isIdle());
+
+    CHECK(host::runUntil(idle, SETTLE_US));
+    CHECK_EQ(steps(PB_6), 2000);
+    waiter.join();
+}
+
+int main() {
+    for (int i = 1; i <= 4; i++) {
+        stepper.setMotion(i, 1500.0f, 6000.0f);
+    }
+    planner.configure(1500.0f, 6000.0f, 1.0f);
+
+    RUN(testClearThenStop);
+    RUN(testStopThenPush);
+    RUN(testStopOtherAxis);
+    RUN(testFullQueueStop);
+    RUN(testLinearWaiter);
+    RUN(testWaiterBeforeQueue);
+    return TEST_RESULT();
+}
@@ -0,0 +1,85 @@
+/**
+ ******************************************************************************
+ * @file    test_sequencer.cpp
+ * @brief   The built-in songs on the voices main.cpp connects.
+ ******************************************************************************
+ * @attention
+ *
+ * Voices 1 and 3 have no step pin on this board (their timers belong to
+ * DC and BLDC), so every note of a built-in score must be on a voice that
+ * has one, and playing the score must put tones on those pins.
+ *
+ ******************************************************************************
+ */
+
+#include "HostTest.h"
+#include "Sequencer.h"
+#include "Songs.h"
+
+// As in main.cpp
+static Music voice1(NC, NC);
+static Music voice2(PB_6, PA_7);
+static Music voice3(NC, NC);
+static Music voice4(PB_10, NC);
+static Sequencer sequencer(voice1, voice2, voice3, voice4);
+
+static const int VOICE_PIN[SEQ_VOICES] = { NC, PB_6, NC, PB_10 };
+
+// Tones started on pin: PWM settings with a high time
+static int tones(int pin) {
+    int n = 0;
+    for (const host::TraceEvent &e : host::traceEvents()) {
+        if (e.kind == host::TRACE_PWM && e.id == pin && e.b > 0) n++;
+    }
+    return n;
+}
+
+static bool stopped() {
+    return !sequencer.isPlaying();
+}
+
+static void testSongsUseConnectedVoices() {
+    for (unsigned s = 0; s < SONG_COUNT; s++) {
+        const Song &song = SONGS[s];
+        for (uint16_t i = 0; i < song.count; i++) {
+            const ScoreEvent &e = song.events[i];
+            if (e.note == SCORE_REST) continue;
+            if (VOICE_PIN[e.voiceDelta >> 6] == NC) {
+                fprintf(stderr, "%s event %u on an unconnected voice\n", song.name, i);
+                CHECK(false);
+                break;
+            }
+        }
+    }
+}
+
+// Every voice a song writes to sounds; faster tick, same events
+static void testSongsDrivePins() {
+    for (unsigned s = 0; s < SONG_COUNT; s++) {
+        const Song &song = SONGS[s];
+        int notes[SEQ_VOICES] = { 0, 0, 0, 0 };
+        for (uint16_t i = 0; i < song.count; i++) {
+            if (song.events[i].note != SCORE_REST) notes[song.events[i].voiceDelta >> 6]++;
+        }
+
+        host::traceClear();
+        CHECK(sequencer.play(song.events, song.count, 1000));
+        CHECK(host::runUntil(stopped, 60000000));
+
+        int total = 0;
+        for (int v = 0; v < SEQ_VOICES; v++) {
+            if (VOICE_PIN[v] == NC) continue;
+            int n = tones(VOICE_PIN[v]);
+            if (notes[v]) CHECK(n > 0);
+            total += n;
+        }
+        CHECK(total > 0);
+        CHECK_EQ(sequencer.notes(), notes[0] + notes[1] + notes[2] + notes[3]);
+    }
+}
+
+int main() {
+    RUN(testSongsUseConnectedVoices);
+    RUN(testSongsDrivePins);
+    return TEST_RESULT();
+}
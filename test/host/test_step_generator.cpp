@@ -0,0 +1,329 @@
+/**
+ ******************************************************************************
+ * @file    test_step_generator.cpp
+ * @brief   Step counts and timing of the step generator on a mock timer.
+ ******************************************************************************
+ * @attention
+ *
+ * The mock timer only fires when the test runs it, at exactly the time
+ * the generator asked for, so every step edge in the trace can be
+ * checked against the interval it should have.
+ *
+ ******************************************************************************
+ */
+
+#include "HostTest.h"
+#include "StepGenerator.h"
+
+// Compares fire from run() only, on the virtual clock
+class MockStepTimer : public StepTimer {
+public:
+    MockStepTimer() : _at(0), _armed(false) {}
+
+    uint32_t now() override { return us_ticker_read(); }
+
+    void schedule(uint32_t delay_us) override {
+        _at = now() + delay_us;
+        _armed = true;
+    }
+
+    void cancel() override { _armed = false; }
+
+    bool armed() const { return _armed; }
+
+    // Fire every compare due in the next us microseconds, then let the
+    // rest of that time pass
+    void run(uint32_t us) {
+        uint32_t end = now() + us;
+        while (_armed && (int32_t)(_at - end) <= 0) {
+            host::spin((uint64_t)(_at - now()) * 1000);
+            _armed = false;
+            host::setInterrupt(true);
+            _handler();
+            host::setInterrupt(false);
+        }
+        host::spin((uint64_t)(end - now()) * 1000);
+    }
+
+private:
+    uint32_t _at;
+    bool _armed;
+};
+
+static DigitalOut step1(PA_6), dir1(PA_5);
+static DigitalOut step2(PB_6), dir2(PA_7);
+static DigitalOut step3(PB_13), dir3(PC_7);
+static DigitalOut step4(PB_10), dir4(PA_8);
+
+static void attachAll(StepGenerator &gen) {
+    gen.attachChannel(0, &step1, &dir1);
+    gen.attachChannel(1, &step2, &dir2);
+    gen.attachChannel(2, &step3, &dir3);
+    gen.attachChannel(3, &step4, &dir4);
+}
+
+static int completions[STEP_CHANNELS + 1];
+
+static void recordDone(int ch) {
+    completions[ch == STEP_LINEAR ? STEP_CHANNELS : ch]++;
+}
+
+static void testConstantRate() {
+    MockStepTimer timer;
+    StepGenerator gen(timer);
+    attachAll(gen);
+    memset(completions, 0, sizeof(completions));
+    gen.onComplete(recordDone);
+
+    uint64_t t0 = us_ticker_read();
+    CHECK(gen.move(0, 1, 10, 500));
+    CHECK(gen.isBusy(0));
+    CHECK_EQ(host::pinLevel(PA_5), 1);
+    timer.run(100000);
+
+    std::vector<uint64_t> rises = host::pinEdgesUs(PA_6, 1);
+    std::vector<uint64_t> falls = host::pinEdgesUs(PA_6, 0);
+    CHECK_EQ(rises.size(), 10);
+    CHECK_EQ(falls.size(), 10);
+    for (size_t i = 0; i < rises.size() && i < falls.size(); i++) {
+        CHECK_EQ(rises[i] - t0, 500 * (i + 1));
+        CHECK_EQ(falls[i] - rises[i], STEP_PULSE_US);
+    }
+    CHECK(!gen.isBusy(0));
+    CHECK_EQ(completions[0], 1);
+    CHECK(!timer.armed());
+}
+
+// Every interval is the ramp table entry for its position in the move
+static void testRampedMove() {
+    MockStepTimer timer;
+    StepGenerator gen(timer);
+    attachAll(gen);
+
+    RampProfile ramp;
+    ramp.configure(1500.0f, 6000.0f);
+    const uint32_t steps = 400;
+
+    uint64_t t0 = us_ticker_read();
+    CHECK(gen.move(1, 0, steps, ramp));
+    CHECK_EQ(host::pinLevel(PA_7), 0);
+    timer.run(2000000);
+
+    std::vector<uint64_t> rises = host::pinEdgesUs(PB_6, 1);
+    CHECK_EQ(rises.size(), steps);
+
+    uint64_t t = t0;
+    bool cruised = false;
+    for (uint32_t i = 0; i < steps && i < rises.size(); i++) {
+        uint32_t interval = ramp.interval(i, steps - i);
+        t += interval;
+        CHECK_EQ(rises[i], t);
+        if (interval == ramp.cruiseInterval()) cruised = true;
+    }
+    // Long enough to reach full speed, and as slow at the end as at the start
+    CHECK(cruised);
+    CHECK_EQ(ramp.interval(0, steps), ramp.interval(steps - 1, 1));
+    CHECK(!gen.isBusy(1));
+}
+
+static void testStopMidMove() {
+    MockStepTimer timer;
+    StepGenerator gen(timer);
+    attachAll(gen);
+    memset(completions, 0, sizeof(completions));
+    gen.onComplete(recordDone);
+
+    CHECK(gen.move(0, 1, 100, 1000));
+    timer.run(20500);
+    CHECK_EQ(gen.stepsRemaining(0), 80);
+    gen.stop(0);
+    CHECK(!gen.isBusy(0));
+    CHECK_EQ(gen.stepsRemaining(0), 0);
+
+    timer.run(100000);
+    CHECK_EQ(host::pinEdgesUs(PA_6, 1).size(), 20);
+    CHECK_EQ(host::pinLevel(PA_6), 0);
+    CHECK_EQ(completions[0], 0);
+    CHECK(!timer.armed());
+
+    // The channel is free again
+    CHECK(gen.move(0, 0, 5, 1000));
+    timer.run(100000);
+    CHECK_EQ(host::pinEdgesUs(PA_6, 1).size(), 25);
+    CHECK_EQ(completions[0], 1);
+}
+
+// A busy channel refuses new moves and keeps its direction
+static void testBusyChannel() {
+    MockStepTimer timer;
+    StepGenerator gen(timer);
+    attachAll(gen);
+
+    CHECK(gen.move(2, 1, 10, 1000));
+    CHECK(!gen.move(2, 0, 5, 1000));
+    CHECK_EQ(host::pinLevel(PC_7), 1);
+
+    const int32_t delta[STEP_CHANNELS] = { 0, 0, 10, 0 };
+    CHECK(!gen.moveLinear(delta, 1000));
+
+    timer.run(100000);
+    CHECK_EQ(host::pinEdgesUs(PB_13, 1).size(), 10);
+}
+
+// Minor axes step on major axis ticks only, every axis gets its count
+// and makes its last step on the final tick
+static void testCoordinatedMove() {
+    MockStepTimer timer;
+    StepGenerator gen(timer);
+    attachAll(gen);
+    memset(completions, 0, sizeof(completions));
+    gen.onComplete(recordDone);
+
+    uint64_t t0 = us_ticker_read();
+    const int32_t delta[STEP_CHANNELS] = { 300, 100, 0, -50 };
+    CHECK(gen.moveLinear(delta, 1000));
+    CHECK(gen.isLinearBusy());
+    CHECK(gen.isLinearAxis(3));
+    CHECK(!gen.isLinearAxis(2));
+    CHECK(!gen.move(0, 1, 10, 1000));
+    CHECK_EQ(host::pinLevel(PA_5), 1);
+    CHECK_EQ(host::pinLevel(PA_8), 0);
+    timer.run(1000000);
+
+    std::vector<uint64_t> major = host::pinEdgesUs(PA_6, 1);
+    std::vector<uint64_t> minor = host::pinEdgesUs(PB_6, 1);
+    std::vector<uint64_t> reverse = host::pinEdgesUs(PB_10, 1);
+    CHECK_EQ(major.size(), 300);
+    CHECK_EQ(minor.size(), 100);
+    CHECK_EQ(reverse.size(), 50);
+    CHECK_EQ(host::pinEdgesUs(PB_13, 1).size(), 0);
+
+    for (size_t i = 0; i < major.size(); i++) {
+        CHECK_EQ(major[i] - t0, 1000 * (i + 1));
+    }
+    for (uint64_t t : minor) {
+        CHECK((t - t0) % 1000 == 0);
+    }
+    for (uint64_t t : reverse) {
+        CHECK((t - t0) % 1000 == 0);
+    }
+    // All axes finish together
+    CHECK_EQ(minor.back(), major.back());
+    CHECK_EQ(reverse.back(), major.back());
+    CHECK_EQ(completions[STEP_CHANNELS], 1);
+    CHECK(!gen.isLinearBusy());
+}
+
+// Stopping any axis of a coordinated move ends the whole move
+static void testStopLinearAxis() {
+    MockStepTimer timer;
+    StepGenerator gen(timer);
+    attachAll(gen);
+
+    const int32_t delta[STEP_CHANNELS] = { 200, 200, 0, 0 };
+    CHECK(gen.moveLinear(delta, 1000));
+    timer.run(50500);
+    gen.stop(1);
+    CHECK(!gen.isLinearBusy());
+    CHECK(!gen.isBusy(0));
+
+    timer.run(100000);
+    CHECK_EQ(host::pinEdgesUs(PA_6, 1).size(), 50);
+    CHECK_EQ(host::pinEdgesUs(PB_6, 1).size(), 50);
+    CHECK(!timer.armed());
+}
+
+// One queued block for the chain tests, handed over once
+static LinearSegment queued;
+static bool haveQueued;
+static int aborts;
+
+static bool nextQueued(LinearSegment &seg) {
+    if (!haveQueued) return false;
+    seg = queued;
+    haveQueued = false;
+    return true;
+}
+
+static void recordAbort() {
+    aborts++;
+}
+
+// A block chained onto a reversal: DIR changes only after the last pulse
+// of the old direction has ended, and the first step in the new one
+// follows at least a pulse width later. Both segments complete.
+static void testChainReversal() {
+    MockStepTimer timer;
+    StepGenerator gen(timer);
+    attachAll(gen);
+    memset(completions, 0, sizeof(completions));
+    gen.onComplete(recordDone);
+    gen.onLinearNext(nextQueued);
+
+    LinearSegment reverse = { { -10, 0, 0, 0 }, 0, 0, UINT32_MAX, NULL };
+    queued = reverse;
+    haveQueued = true;
+
+    const int32_t delta[STEP_CHANNELS] = { 10, 0, 0, 0 };
+    CHECK(gen.moveLinear(delta, 1000));
+    timer.run(100000);
+
+    std::vector<uint64_t> rises = host::pinEdgesUs(PA_6, 1);
+    std::vector<uint64_t> falls = host::pinEdgesUs(PA_6, 0);
+    std::vector<uint64_t> dir = host::pinEdgesUs(PA_5, 0);
+    CHECK_EQ(rises.size(), 20);
+    CHECK_EQ(falls.size(), 20);
+    CHECK_EQ(dir.size(), 1);
+    if (rises.size() == 20 && falls.size() == 20 && dir.size() == 1) {
+        CHECK(dir[0] >= falls[9]);
+        CHECK(rises[10] >= dir[0] + STEP_PULSE_US);
+    }
+    CHECK_EQ(host::pinLevel(PA_5), 0);
+    CHECK_EQ(completions[STEP_CHANNELS], 2);
+    gen.onLinearNext(NULL);
+}
+
+// A queued block whose axis is busy with a single move is refused, and
+// the single move keeps its steps and direction
+static void testChainBusyAxis() {
+    MockStepTimer timer;
+    StepGenerator gen(timer);
+    attachAll(gen);
+    memset(completions, 0, sizeof(completions));
+    aborts = 0;
+    gen.onComplete(recordDone);
+    gen.onLinearNext(nextQueued);
+    gen.onLinearAbort(recordAbort);
+
+    LinearSegment other = { { 0, -30, 0, 0 }, 0, 0, UINT32_MAX, NULL };
+    queued = other;
+    haveQueued = true;
+
+    const int32_t delta[STEP_CHANNELS] = { 20, 0, 0, 0 };
+    CHECK(gen.moveLinear(delta, 1000));
+    CHECK(gen.move(1, 1, 100, 1000));
+    timer.run(200000);
+
+    CHECK_EQ(host::pinEdgesUs(PA_6, 1).size(), 20);
+    CHECK_EQ(host::pinEdgesUs(PB_6, 1).size(), 100);
+    CHECK_EQ(host::pinEdgesUs(PA_7, 0).size(), 0);
+    CHECK_EQ(aborts, 1);
+    CHECK_EQ(completions[STEP_CHANNELS], 1);
+    CHECK_EQ(completions[1], 1);
+    CHECK(!gen.isLinearBusy());
+    CHECK(!timer.armed());
+    gen.onLinearNext(NULL);
+    gen.onLinearAbort(NULL);
+}
+
+int main() {
+    RUN(testConstantRate);
+    RUN(testRampedMove);
+    RUN(testStopMidMove);
+    RUN(testBusyChannel);
+    RUN(testCoordinatedMove);
+    RUN(testStopLinearAxis);
+    RUN(testChainReversal);
+    RUN(testChainBusyAxis);
+    return TEST_RESULT();
+}